@@ -0,0 +1,101 @@
+#include <arena.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+#define ALIGN_UP(x, a) (((x) + ((a)-1)) & ~((size_t)(a)-1))
+
+// The header is padded so that the first allocation in a block is aligned.
+#define BLOCK_HEADER_SIZE ALIGN_UP(sizeof(struct ArenaBlock), ARENA_ALIGNMENT)
+
+static struct ArenaBlock *arena_new_block(size_t size) {
+  struct ArenaBlock *b = malloc(BLOCK_HEADER_SIZE + size);
+  assert(b && "Out of memory");
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+void *arena_alloc(struct Arena *a, size_t size) {
+  size = ALIGN_UP(size, ARENA_ALIGNMENT);
+  struct ArenaBlock *b = a->head;
+  if (!b || b->size - b->used < size) {
+    if (size > ARENA_BLOCK_SIZE / 4 && b) {
+      // Large allocations get a block of their own which is put behind the
+      // current one, so the space left in the current block is not wasted.
+      struct ArenaBlock *large = arena_new_block(size);
+      large->used = size;
+      large->next = b->next;
+      b->next = large;
+      return (uint8_t *)large + BLOCK_HEADER_SIZE;
+    }
+    b = arena_new_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    b->next = a->head;
+    a->head = b;
+  }
+  void *r = (uint8_t *)b + BLOCK_HEADER_SIZE + b->used;
+  b->used += size;
+  return r;
+}
+
+void *arena_calloc(struct Arena *a, size_t n, size_t size) {
+  void *r = arena_alloc(a, n * size);
+  memset(r, 0, n * size);
+  return r;
+}
+
+char *arena_strdup(struct Arena *a, const char *s) {
+  size_t l = strlen(s) + 1;
+  char *r = arena_alloc(a, l);
+  memcpy(r, s, l);
+  return r;
+}
+
+char *arena_strndup(struct Arena *a, const char *s, size_t l) {
+  char *r = arena_alloc(a, l + 1);
+  memcpy(r, s, l);
+  r[l] = '\0';
+  return r;
+}
+
+void arena_append(struct Arena *a, struct Arena *other) {
+  struct ArenaBlock *b = other->head;
+  other->head = NULL;
+  if (!b)
+    return;
+  if (!a->head) {
+    a->head = b;
+    return;
+  }
+  // Keep allocating from the current block of a
+  struct ArenaBlock *last = b;
+  for (; last->next;)
+    last = last->next;
+  last->next = a->head->next;
+  a->head->next = b;
+}
+
+void arena_reset(struct Arena *a) {
+  struct ArenaBlock *b = a->head;
+  if (!b)
+    return;
+  struct Arena rest = {b->next};
+  arena_free(&rest);
+  b->next = NULL;
+  b->used = 0;
+}
+
+void arena_free(struct Arena *a) {
+  struct ArenaBlock *b = a->head;
+  for (; b;) {
+    struct ArenaBlock *next = b->next;
+    free(b);
+    b = next;
+  }
+  a->head = NULL;
+}
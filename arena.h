@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+
+// Bump allocator. Allocations are carved out of large blocks and can not be
+// freed individually, everything is released at once by arena_free().
+struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+  // Block memory follows the header
+};
+
+struct Arena {
+  struct ArenaBlock *head;
+};
+
+void *arena_alloc(struct Arena *a, size_t size);
+void *arena_calloc(struct Arena *a, size_t n, size_t size);
+char *arena_strdup(struct Arena *a, const char *s);
+char *arena_strndup(struct Arena *a, const char *s, size_t l);
+// Moves every block of other into a, other is left empty.
+void arena_append(struct Arena *a, struct Arena *other);
+// Releases every allocation but keeps the current block for reuse.
+void arena_reset(struct Arena *a);
+void arena_free(struct Arena *a);
+#endif // ARENA_H
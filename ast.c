@@ -1,3 +1,4 @@
+#include <arena.h>
 #include <assert.h>
 #include <ast.h>
 #include <ctype.h>
@@ -5,38 +6,54 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <symbol.h>
+
+struct Parser {
+  struct TokenArray *tokens;
+  size_t pos;
+  // Stacks of parse_expression(), shared by nested expressions
+  ast_index *operands;
+  uint8_t *operators;
+  size_t operand_count;
+  size_t operator_count;
+  size_t stack_capacity;
+};
 
-ast_t *parse_codeblock(token_t **t_orig);
-ast_t *parse_primary(token_t **t_orig);
-ast_t *parse_expression(token_t **t_orig);
-struct BuiltinType parse_type(token_t **t_orig, int *error);
+ast_index parse_codeblock(struct Parser *p);
+ast_index parse_primary(struct Parser *p);
+ast_index parse_expression(struct Parser *p);
+ast_index parse_type(struct Parser *p);
 
 #define ARCH_POINTER_SIZE 8
 
-HashMap *global_definitions;
+// The AST of the unit being compiled by the current thread
+_Thread_local struct Ast ast;
+_Thread_local struct Arena ast_arena;
+// Used by lex2ast_item() so the expression stacks are kept between items
+_Thread_local struct Parser item_parser;
+// struct_definition nodes indexed by the symbol of their name
+_Thread_local ast_index *struct_definitions;
+_Thread_local uint32_t struct_definitions_size;
 
 const struct BuiltinType u64 = {
     .variant = builtin,
     .name = "u64",
     .byte_size = 8,
+    .alignment = 8,
 };
 
 const struct BuiltinType u32 = {
     .variant = builtin,
     .name = "u32",
     .byte_size = 4,
+    .alignment = 4,
 };
 
 const struct BuiltinType t_void = {
     .variant = builtin,
     .name = "u0",
     .byte_size = 0,
-};
-
-struct BuiltinType types[] = {
-    u64,
-    u32,
-    t_void,
+    .alignment = 1,
 };
 
 const char *type_to_string(struct BuiltinType t) {
@@ -44,592 +61,772 @@ const char *type_to_string(struct BuiltinType t) {
   return t.name;
 }
 
-uint64_t parse_number(const char *s) {
+// Makes room for one more element in one of the pools of ast.
+static void *pool_reserve(void *pool, uint32_t count, uint32_t *capacity,
+                          size_t size) {
+  if (count < *capacity)
+    return pool;
+  assert(*capacity < UINT32_MAX / 2 && "AST too large");
+  *capacity = *capacity ? *capacity * 2 : 256;
+  pool = realloc(pool, *capacity * size);
+  assert(pool && "Out of memory");
+  return pool;
+}
+
+// Nodes start out zeroed, so every index field is AST_NONE and every symbol
+// field is SYMBOL_NONE.
+ast_index new_node(ast_enum type) {
+  ast.nodes = pool_reserve(ast.nodes, ast.node_count, &ast.node_capacity,
+                           sizeof(struct AstNode));
+  ast_index i = ast.node_count++;
+  ast.nodes[i] = (struct AstNode){.type = type};
+  return i;
+}
+
+ast_index new_type(struct BuiltinType t) {
+  ast.types = pool_reserve(ast.types, ast.type_count, &ast.type_capacity,
+                           sizeof(struct BuiltinType));
+  ast_index i = ast.type_count++;
+  ast.types[i] = t;
+  return i;
+}
+
+ast_index new_function(struct AstFunction f) {
+  ast.functions = pool_reserve(ast.functions, ast.function_count,
+                               &ast.function_capacity,
+                               sizeof(struct AstFunction));
+  ast_index i = ast.function_count++;
+  ast.functions[i] = f;
+  return i;
+}
+
+ast_index new_string(char *s) {
+  ast.strings = pool_reserve(ast.strings, ast.string_count,
+                             &ast.string_capacity, sizeof(char *));
+  ast_index i = ast.string_count++;
+  ast.strings[i] = s;
+  return i;
+}
+
+static void ast_init(size_t token_count) {
+  if (ast.nodes)
+    return;
+  // Roughly one node for every two tokens
+  ast.node_capacity = token_count / 2 + 1;
+  ast.nodes = malloc(ast.node_capacity * sizeof(struct AstNode));
+  assert(ast.nodes && "Out of memory");
+  new_node(noop);
+  new_type(u64); // AST_NONE
+  ast_index r = new_type(u64);
+  assert(TYPE_U64 == r);
+  r = new_type(u32);
+  assert(TYPE_U32 == r);
+  r = new_type(t_void);
+  assert(TYPE_U0 == r);
+  new_function((struct AstFunction){0});
+  new_string(NULL);
+}
+
+void ast_free(void) {
+  free(ast.nodes);
+  free(ast.types);
+  free(ast.functions);
+  free(ast.strings);
+  memset(&ast, 0, sizeof(ast));
+  free(struct_definitions);
+  struct_definitions = NULL;
+  struct_definitions_size = 0;
+  free(item_parser.operands);
+  free(item_parser.operators);
+  item_parser = (struct Parser){0};
+  arena_free(&ast_arena);
+}
+
+// Pointer types are created once per type being pointed to.
+ast_index pointer_type(ast_index t) {
+  if (AST_NONE == ast_type(t)->pointer_type) {
+    ast_index r = new_type((struct BuiltinType){
+        .variant = pointer,
+        .name = ast_type(t)->name,
+        .ptr = t,
+        .byte_size = ARCH_POINTER_SIZE,
+        .alignment = ARCH_POINTER_SIZE,
+    });
+    ast_type(t)->pointer_type = r;
+  }
+  return ast_type(t)->pointer_type;
+}
+
+// The token array is padded with TOKEN_LOOKAHEAD end tokens so peeking a
+// few tokens ahead is always in bounds.
+static inline token_enum peek_type(struct Parser *p, size_t n) {
+  return p->tokens->type[p->pos + n];
+}
+
+static inline uint32_t peek_symbol(struct Parser *p, size_t n) {
+  return p->tokens->data[p->pos + n];
+}
+
+// Strings kept in the AST are copied out of the tokens so that the token
+// array and lexer_arena can be freed once parsing is done.
+char *copy_token_string(struct Parser *p) {
+  size_t l;
+  const char *s = token_string(p->tokens, p->pos, &l);
+  return arena_strndup(&ast_arena, s, l);
+}
+
+void add_struct_definition(ast_index a) {
+  uint32_t symbol = ast_node(a)->structure.symbol;
+  if (symbol >= struct_definitions_size) {
+    uint32_t size = struct_definitions_size ? struct_definitions_size : 64;
+    for (; size <= symbol;)
+      size *= 2;
+    struct_definitions =
+        realloc(struct_definitions, size * sizeof(ast_index));
+    assert(struct_definitions && "Out of memory");
+    memset(struct_definitions + struct_definitions_size, 0,
+           (size - struct_definitions_size) * sizeof(ast_index));
+    struct_definitions_size = size;
+  }
+  struct_definitions[symbol] = a;
+}
+
+ast_index get_struct_definition(uint32_t symbol) {
+  if (symbol >= struct_definitions_size)
+    return AST_NONE;
+  return struct_definitions[symbol];
+}
+
+int is_builtin_type(token_enum type) {
+  return type == type_u64 || type == type_u32 || type == type_u0;
+}
+
+uint64_t parse_number(struct Parser *p) {
+  size_t l;
+  const char *s = token_string(p->tokens, p->pos, &l);
   uint64_t r = 0;
-  for (; *s && isdigit(*s); s++) {
+  for (size_t i = 0; i < l && isdigit(s[i]); i++) {
     r *= 10;
-    r += *s - '0';
+    r += s[i] - '0';
   }
   return r;
 }
 
-ast_t *parse_function_call_arguments(token_t **t_orig) {
-  token_t *t = *t_orig;
-  if (t->type == closeparen) {
-    t = t->next;
-    *t_orig = t;
-    return NULL;
+static void set_number(ast_index a, uint64_t n) {
+  ast_node(a)->value_type = num;
+  ast_node(a)->number.low = (uint32_t)n;
+  ast_node(a)->number.high = (uint32_t)(n >> 32);
+}
+
+static void set_string(ast_index a, char *s) {
+  ast_index i = new_string(s);
+  ast_node(a)->value_type = string;
+  ast_node(a)->string.index = i;
+}
+
+ast_index parse_function_call_arguments(struct Parser *p) {
+  if (peek_type(p, 0) == closeparen) {
+    p->pos++;
+    return AST_NONE;
   }
-  ast_t *r = malloc(sizeof(ast_t));
-  ast_t *a = r;
-  for (; t->type != closeparen;) {
-    *a = *parse_expression(&t);
-    if (t->type == closeparen)
+  ast_index r = AST_NONE;
+  ast_index last = AST_NONE;
+  for (; peek_type(p, 0) != closeparen;) {
+    ast_index a = parse_expression(p);
+    if (last)
+      ast_node(last)->next = a;
+    else
+      r = a;
+    last = a;
+    if (peek_type(p, 0) == closeparen)
       break;
-    assert(t->type == comma);
-    t = t->next;
-
-    a->next = malloc(sizeof(ast_t));
-    a = a->next;
+    assert(peek_type(p, 0) == comma);
+    p->pos++;
   }
-  a->next = NULL;
-  t = t->next;
-  *t_orig = t;
+  p->pos++;
   return r;
 }
 
-ast_t *parse_function_arguments(token_t **t_orig) {
-  token_t *t = *t_orig;
-  if (t->type == closeparen) {
-    t = t->next;
-    *t_orig = t;
-    return NULL;
+ast_index parse_function_arguments(struct Parser *p) {
+  if (peek_type(p, 0) == closeparen) {
+    p->pos++;
+    return AST_NONE;
   }
-  ast_t *r = malloc(sizeof(ast_t));
-  ast_t *a = r;
-  for (; t->type != closeparen;) {
-    int error;
-    struct BuiltinType type = parse_type(&t, &error);
-    assert(!error);
-    a->type = function_argument;
-    a->children = NULL;
-    a->statement_variable_type = type;
-    t = t->next;
-    assert(t->type == alpha && "Expected name after type.");
-    a->value_type = string;
-    a->value.string = t->string_rep;
-    t = t->next;
-
-    a->next = NULL;
-    if (t->type == closeparen)
-      break;
-    assert(t->type == comma);
-    t = t->next;
+  ast_index r = AST_NONE;
+  ast_index last = AST_NONE;
+  for (; peek_type(p, 0) != closeparen;) {
+    ast_index type = parse_type(p);
+    assert(type);
+    p->pos++;
+    assert(peek_type(p, 0) == alpha && "Expected name after type.");
+    ast_index a = new_node(function_argument);
+    ast_node(a)->declaration.type = type;
+    ast_node(a)->declaration.symbol = peek_symbol(p, 0);
+    p->pos++;
+    if (last)
+      ast_node(last)->next = a;
+    else
+      r = a;
+    last = a;
 
-    a->next = malloc(sizeof(ast_t));
-    a = a->next;
+    if (peek_type(p, 0) == closeparen)
+      break;
+    assert(peek_type(p, 0) == comma);
+    p->pos++;
   }
-  t = t->next;
-  *t_orig = t;
+  p->pos++;
   return r;
 }
 
-ast_t *parse_primary(token_t **t_orig) {
-  token_t *t = *t_orig;
-  ast_t *r = malloc(sizeof(ast_t));
-  r->next = NULL;
-  r->children = NULL;
+ast_index parse_primary(struct Parser *p) {
+  ast_index r = new_node(noop);
   int is_reference = 0;
-  if (t->type == ampersand) {
+  if (peek_type(p, 0) == ampersand) {
     is_reference = 1;
-    t = t->next;
+    p->pos++;
   }
-  if (t->type == number) {
-    r->type = literal;
-    r->value_type = number;
-    r->value.number = parse_number(t->string_rep);
-    t = t->next;
-  } else if (t->type == alpha) {
-    if (t->next->type == openparen) {
-      r->type = function_call;
-      r->value.string = t->string_rep;
-      r->value_type = string;
-
-      t = t->next;
-      t = t->next;
-      r->children = parse_function_call_arguments(&t);
+  if (peek_type(p, 0) == number) {
+    ast_node(r)->type = literal;
+    set_number(r, parse_number(p));
+    p->pos++;
+  } else if (peek_type(p, 0) == alpha) {
+    if (peek_type(p, 1) == openparen) {
+      ast_node(r)->type = function_call;
+      ast_node(r)->call.symbol = peek_symbol(p, 0);
+
+      p->pos++;
+      p->pos++;
+      ast_index arguments = parse_function_call_arguments(p);
+      ast_node(r)->call.arguments = arguments;
     } else {
       if (is_reference) {
-        r->type = variable_reference;
+        ast_node(r)->type = variable_reference;
       } else {
-        r->type = variable;
+        ast_node(r)->type = variable;
       }
-      r->value_type = string;
-      if (t->next->type == dot) {
-        char *a = t->string_rep;
-        uint32_t l = strlen(t->string_rep);
-        t = t->next;
-        l++; // dot
-        t = t->next;
-        l += strlen(t->string_rep);
-        char *b = t->string_rep;
-        r->value.string = malloc(l + 1);
-        strcpy(r->value.string, a);
-        strcat(r->value.string, ".");
-        strcat(r->value.string, b);
-      } else {
-        r->value.string = t->string_rep;
+      ast_node(r)->variable.symbol = peek_symbol(p, 0);
+      if (peek_type(p, 1) == dot) {
+        p->pos++;
+        p->pos++;
+        assert(peek_type(p, 0) == alpha && "Expected member name.");
+        ast_node(r)->variable.member = peek_symbol(p, 0);
       }
-      t = t->next;
+      p->pos++;
     }
-  } else if (t->type == lexer_string) {
-    r->type = literal;
-    r->value_type = string;
-    r->value.string = t->string_rep;
-    t = t->next;
+  } else if (peek_type(p, 0) == lexer_string) {
+    ast_node(r)->type = literal;
+    set_string(r, copy_token_string(p));
+    p->pos++;
   } else {
-    printf("t->type: %d\n", t->type);
-    printf("t->string_rep: %s\n", t->string_rep);
+    printf("peek_type(p, 0): %d\n", peek_type(p, 0));
+    size_t l;
+    const char *s = token_string(p->tokens, p->pos, &l);
+    printf("t->string_rep: %.*s\n", (int)l, s);
     assert(0);
   }
-  *t_orig = t;
   return r;
 }
 
-int precedence(token_t *t) {
-  switch (t->type) {
-  case plus:
-    return 0;
-    break;
-  case minus:
-    return 1;
-    break;
-  case star:
-    return 2;
-    break;
-  case equal:
-    return 3;
-    break;
-  default:
-    printf("Got invalid characther %s at %u:%u, expected binaryoperator or "
-           "semicolon\n",
-           t->string_rep, t->line + 1, t->col);
-    fflush(stdout);
-    for (;;)
-      ;
-    break;
-  }
-}
+// Binding power of every binary operator, higher binds tighter. All binary
+// operators are left associative.
+static const uint8_t operator_precedence[] = {
+    [operator_mul] = 10, [operator_div] = 10, [operator_mod] = 10,
+    [operator_add] = 9,  [operator_sub] = 9,  [operator_shl] = 8,
+    [operator_shr] = 8,  [operator_lt] = 7,   [operator_le] = 7,
+    [operator_gt] = 7,   [operator_ge] = 7,   [operator_eq] = 6,
+    [operator_ne] = 6,   [operator_and] = 5,  [operator_xor] = 4,
+    [operator_or] = 3,
+};
 
-char type_to_operator_char(token_enum t) {
+// Binary operator of a token, -1 if the token is not one.
+int token_to_operator(token_enum t) {
   switch (t) {
   case plus:
-    return '+';
+    return operator_add;
   case minus:
-    return '-';
+    return operator_sub;
   case star:
-    return '*';
+    return operator_mul;
+  case slash:
+    return operator_div;
+  case percent:
+    return operator_mod;
+  case shift_left:
+    return operator_shl;
+  case shift_right:
+    return operator_shr;
+  case ampersand:
+    return operator_and;
+  case vertical_bar:
+    return operator_or;
+  case caret:
+    return operator_xor;
   case equal:
-    return '=';
+    return operator_eq;
+  case not_equal:
+    return operator_ne;
+  case less:
+    return operator_lt;
+  case less_equal:
+    return operator_le;
+  case greater:
+    return operator_gt;
+  case greater_equal:
+    return operator_ge;
   default:
-    assert(0);
-    break;
+    return -1;
   }
 }
 
-int is_end_of_expression(token_t *t) {
-  return (t->type == semicolon || t->type == closeparen || t->type == comma);
-}
-
-// Future me is going to hate this code but current me likes it, because
-// somehow it works.
-ast_t *parse_expression_1(token_t **t_orig, ast_t *lhs, int min_prec) {
-  token_t *t = *t_orig;
-  token_t *operator= t;
-
-  if (is_end_of_expression(operator))
-    return lhs;
-
-  for (; precedence(operator) >= min_prec;) {
-    token_t *op_orig = operator;
-    t = operator->next;
-    ast_t *rhs = parse_primary(&t);
-    operator= t;
-    if (!is_end_of_expression(t) && !is_end_of_expression(operator)) {
-      for (; precedence(operator) >= precedence(op_orig);) {
-        int is_higher = (precedence(operator) > precedence(op_orig));
-        rhs = parse_expression_1(&t, rhs, precedence(op_orig) + is_higher);
-        operator= t;
-        if (is_end_of_expression(operator)) {
-          break;
-        }
+int is_end_of_expression(struct Parser *p, size_t t) {
+  token_enum type = p->tokens->type[t];
+  return (type == semicolon || type == closeparen || type == comma);
+}
+
+static void parser_reserve_stack(struct Parser *p, size_t n) {
+  if (n <= p->stack_capacity)
+    return;
+  p->stack_capacity = p->stack_capacity ? p->stack_capacity * 2 : 64;
+  p->operands = realloc(p->operands, p->stack_capacity * sizeof(ast_index));
+  p->operators = realloc(p->operators, p->stack_capacity);
+  assert(p->operands && p->operators && "Out of memory");
+}
+
+// Operator precedence parsing with explicit operand and operator stacks, so
+// the length of an expression does not affect the depth of the C stack.
+// Nested calls in the primaries parse their arguments with a recursive call
+// that uses the stacks above the entries of the outer expression.
+ast_index parse_expression(struct Parser *p) {
+  size_t operand_base = p->operand_count;
+  size_t operator_base = p->operator_count;
+  ast_index primary = parse_primary(p);
+  parser_reserve_stack(p, p->operand_count + 1);
+  p->operands[p->operand_count++] = primary;
+  for (;;) {
+    int op = -1;
+    if (!is_end_of_expression(p, p->pos)) {
+      op = token_to_operator(peek_type(p, 0));
+      if (-1 == op) {
+        size_t l;
+        const char *s = token_string(p->tokens, p->pos, &l);
+        printf("Got invalid characther %.*s at %u:%u, expected "
+               "binaryoperator or semicolon\n",
+               (int)l, s, p->tokens->line[p->pos] + 1,
+               token_col(p->tokens, p->pos));
+        fflush(stdout);
+        assert(0);
       }
     }
-    ast_t *new_lhs = malloc(sizeof(ast_t));
-    new_lhs->left = lhs;
-    lhs = new_lhs;
-    lhs->type = binaryexpression;
-    lhs->right = rhs;
-    lhs->operator= type_to_operator_char(op_orig->type);
-    if (is_end_of_expression(t)) {
-      break;
+    // Reduce everything that binds at least as tightly as the next operator,
+    // or everything once the end of the expression has been reached.
+    for (; p->operator_count > operator_base;) {
+      uint8_t top = p->operators[p->operator_count - 1];
+      if (-1 != op && operator_precedence[top] < operator_precedence[op])
+        break;
+      ast_index r = new_node(binaryexpression);
+      ast_node(r)->operator= top;
+      ast_node(r)->binary.right = p->operands[--p->operand_count];
+      ast_node(r)->binary.left = p->operands[p->operand_count - 1];
+      p->operands[p->operand_count - 1] = r;
+      p->operator_count--;
     }
-    if (is_end_of_expression(operator)) {
-      t = operator;
+    if (-1 == op)
       break;
-    }
+    p->pos++;
+    parser_reserve_stack(p, p->operator_count + 1);
+    p->operators[p->operator_count++] = op;
+    primary = parse_primary(p);
+    parser_reserve_stack(p, p->operand_count + 1);
+    p->operands[p->operand_count++] = primary;
   }
-  *t_orig = t;
-  return lhs;
-}
-
-ast_t *parse_expression(token_t **t_orig) {
-  token_t *t = *t_orig;
-  if (t->type == lexer_string) {
-    ast_t *r = malloc(sizeof(ast_t));
-    r->type = literal;
-    r->value_type = string;
-    r->value.string = t->string_rep;
-    t = t->next;
-    *t_orig = t;
-    return r;
-  }
-  return parse_expression_1(t_orig, parse_primary(t_orig), 0);
-}
-
-struct BuiltinType parse_type(token_t **t_orig, int *error) {
-  *error = 0;
-  token_t *t = *t_orig;
-  if (0 == strcmp(t->string_rep, "struct")) {
-    t = t->next;
-    assert(t->type == alpha);
-    ast_t *a = hashmap_get_entry(global_definitions, t->string_rep);
-    struct BuiltinType r;
-    r.variant = structure;
-    r.name = a->value.string;
-    r.ast_struct = a;
-    uint32_t size = 0;
-    for (ast_t *c = a->children; c; c = c->next) {
-      size += c->statement_variable_type.byte_size;
-    }
-    r.byte_size = size;
-    *t_orig = t;
-    return r;
+  assert(p->operand_count == operand_base + 1);
+  return p->operands[--p->operand_count];
+}
+
+// Returns AST_NONE if the current token does not start a type.
+ast_index parse_type(struct Parser *p) {
+  switch (peek_type(p, 0)) {
+  case type_u64:
+    return TYPE_U64;
+  case type_u32:
+    return TYPE_U32;
+  case type_u0:
+    return TYPE_U0;
+  case keyword_struct: {
+    p->pos++;
+    assert(peek_type(p, 0) == alpha);
+    ast_index a = get_struct_definition(peek_symbol(p, 0));
+    assert(a && "Unknown struct");
+    return ast_node(a)->structure.type;
   }
-  for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
-    if (0 == strcmp(t->string_rep, types[i].name)) {
-      return types[i];
-    }
+  default:
+    return AST_NONE;
   }
-  *error = 1;
-  return u64;
 }
 
-int parse_for(token_t **t_orig, ast_t *a) {
-  token_t *t = *t_orig;
-  if (t->type != alpha)
+int parse_for(struct Parser *p, ast_index a) {
+  if (peek_type(p, 0) != keyword_for)
     return 0;
 
-  if (0 != strcmp(t->string_rep, "for"))
-    return 0;
-
-  a->type = for_statement;
+  ast_node(a)->type = for_statement;
 
-  t = t->next;
-  assert(t->type == openparen);
-  t = t->next;
+  p->pos++;
+  assert(peek_type(p, 0) == openparen);
+  p->pos++;
 
-  a->exp = parse_expression(&t);
-  assert(t->type == closeparen);
+  ast_index condition = parse_expression(p);
+  ast_node(a)->branch.condition = condition;
+  assert(peek_type(p, 0) == closeparen);
 
-  t = t->next;
-  assert(t->type == openbracket);
+  p->pos++;
+  assert(peek_type(p, 0) == openbracket);
 
-  t = t->next;
-  a->children = parse_codeblock(&t);
+  p->pos++;
+  ast_index body = parse_codeblock(p);
+  ast_node(a)->branch.body = body;
 
-  *t_orig = t;
   return 1;
 }
 
-int parse_if(token_t **t_orig, ast_t *a) {
-  token_t *t = *t_orig;
-  if (t->type != alpha)
-    return 0;
-
-  if (0 != strcmp(t->string_rep, "if"))
+int parse_if(struct Parser *p, ast_index a) {
+  if (peek_type(p, 0) != keyword_if)
     return 0;
 
-  a->type = if_statement;
+  ast_node(a)->type = if_statement;
 
-  t = t->next;
-  assert(t->type == openparen);
-  t = t->next;
+  p->pos++;
+  assert(peek_type(p, 0) == openparen);
+  p->pos++;
 
-  a->exp = parse_expression(&t);
-  assert(t->type == closeparen);
+  ast_index condition = parse_expression(p);
+  ast_node(a)->branch.condition = condition;
+  assert(peek_type(p, 0) == closeparen);
 
-  t = t->next;
-  assert(t->type == openbracket);
+  p->pos++;
+  assert(peek_type(p, 0) == openbracket);
 
-  t = t->next;
-  a->children = parse_codeblock(&t);
+  p->pos++;
+  ast_index body = parse_codeblock(p);
+  ast_node(a)->branch.body = body;
 
-  *t_orig = t;
   return 1;
 }
 
-int parse_struct_definition(token_t **t_orig, ast_t *a) {
-  token_t *t = *t_orig;
-  if (t->type != alpha)
+int parse_struct_definition(struct Parser *p, ast_index a) {
+  if (peek_type(p, 0) != keyword_struct)
     return 0;
 
-  if (0 != strcmp(t->string_rep, "struct"))
-    return 0;
-
-  a->type = struct_definition;
+  ast_node(a)->type = struct_definition;
 
-  t = t->next;
+  p->pos++;
 
-  assert(t->type == alpha);
-  a->value_type = string;
-  a->value.string = t->string_rep;
-  a->children = NULL;
-  t = t->next;
-  assert(t->type == openbracket);
+  assert(peek_type(p, 0) == alpha);
+  ast_node(a)->structure.symbol = peek_symbol(p, 0);
+  p->pos++;
+  assert(peek_type(p, 0) == openbracket);
 
-  t = t->next;
+  p->pos++;
   // Parse elements of struct
-  a->children = malloc(sizeof(ast_t));
-  ast_t *r = a->children;
-  ast_t *prev = NULL;
-  ast_t *temp = r;
-  for (; t->type != closebracket;) {
-    int error;
-    struct BuiltinType type = parse_type(&t, &error);
-    t = t->next;
-
-    assert(!error && "Unknown type");
-    temp->type = variable_declaration;
-    temp->children = NULL;
-    temp->statement_variable_type = type;
-    assert(t->type == alpha && "Expected name after type.");
-    temp->value_type = string;
-    temp->value.string = t->string_rep;
-    t = t->next;
-    assert(t->type == comma);
-    t = t->next;
-
-    prev = temp;
-    temp->next = malloc(sizeof(ast_t));
-    temp = temp->next;
-  }
-  if (prev) {
-    free(prev->next);
-    prev->next = NULL;
+  ast_index last = AST_NONE;
+  uint32_t size = 0;
+  uint8_t alignment = 1;
+  for (; peek_type(p, 0) != closebracket;) {
+    ast_index type = parse_type(p);
+    p->pos++;
+
+    assert(type && "Unknown type");
+    size += ast_type(type)->byte_size;
+    if (alignment < ast_type(type)->alignment)
+      alignment = ast_type(type)->alignment;
+    ast_index member = new_node(variable_declaration);
+    ast_node(member)->declaration.type = type;
+    assert(peek_type(p, 0) == alpha && "Expected name after type.");
+    ast_node(member)->declaration.symbol = peek_symbol(p, 0);
+    p->pos++;
+    assert(peek_type(p, 0) == comma);
+    p->pos++;
+
+    if (last)
+      ast_node(last)->next = member;
+    else
+      ast_node(a)->structure.members = member;
+    last = member;
   }
-  t = t->next;
-  hashmap_add_entry(global_definitions, (char *)a->value.string, a, NULL, 0);
-  *t_orig = t;
+  p->pos++;
+  ast_index type = new_type((struct BuiltinType){
+      .variant = structure,
+      .name = symbol_name(ast_node(a)->structure.symbol),
+      .ast_struct = a,
+      .byte_size = size,
+      .alignment = alignment,
+  });
+  ast_node(a)->structure.type = type;
+  add_struct_definition(a);
   return 1;
 }
 
-int parse_variable_declaration(token_t **t_orig, ast_t *a) {
-  token_t *t = *t_orig;
-  if (t->type != alpha)
-    return 0;
-  int error;
-  struct BuiltinType type = parse_type(&t, &error);
-  if (error)
+int parse_variable_declaration(struct Parser *p, ast_index a) {
+  ast_index type = parse_type(p);
+  if (!type)
     return 0;
   // Implies we are parsing <type> <something>
   // So it should be a variable declaration.
-  a->type = variable_declaration;
-  a->children = NULL;
-  t = t->next;
-  if (t->type == star) {
-    struct BuiltinType *buf = malloc(sizeof(struct BuiltinType));
-    memcpy(buf, &type, sizeof(struct BuiltinType));
-    type.variant = pointer;
-    type.ptr = buf;
-    type.byte_size = ARCH_POINTER_SIZE;
-    t = t->next;
+  ast_node(a)->type = variable_declaration;
+  p->pos++;
+  if (peek_type(p, 0) == star) {
+    type = pointer_type(type);
+    p->pos++;
   }
-  a->statement_variable_type = type;
-  assert(t->type == alpha && "Expected name after type.");
-  a->value_type = string;
-  a->value.string = t->string_rep;
-  t = t->next;
-  if (t->type != semicolon) {
-    assert(t->type == equals && "Expected equals");
-    t = t->next;
-    a->children = parse_expression(&t);
-    assert(t->type == semicolon);
-    t = t->next;
+  ast_node(a)->declaration.type = type;
+  assert(peek_type(p, 0) == alpha && "Expected name after type.");
+  ast_node(a)->declaration.symbol = peek_symbol(p, 0);
+  p->pos++;
+  if (peek_type(p, 0) != semicolon) {
+    assert(peek_type(p, 0) == equals && "Expected equals");
+    p->pos++;
+    ast_index value = parse_expression(p);
+    ast_node(a)->declaration.value = value;
+    assert(peek_type(p, 0) == semicolon);
+    p->pos++;
   } else {
-    t = t->next;
+    p->pos++;
   }
-  *t_orig = t;
   return 1;
 }
 
-int parse_variable_assignment(token_t **t_orig, ast_t *a) {
+int parse_variable_assignment(struct Parser *p, ast_index a) {
   int is_dereference = 0;
-  token_t *t = *t_orig;
-  if (t->type == star) {
+  if (peek_type(p, 0) == star)
     is_dereference = 1;
-    t = t->next;
-  }
-  if (t->type != alpha) {
+  // Look past the dereference without consuming it, as this might not be an
+  // assignment at all.
+  size_t n = is_dereference;
+  if (peek_type(p, n) != alpha) {
     return 0;
   }
-
-  if (t->next->type == dot && t->next->next->type == alpha) {
-    char *s1 = t->string_rep;
-    t = t->next;
-    t = t->next;
-    char *s2 = t->string_rep;
-    uint32_t l = strlen(s1) + 1 + strlen(s2);
-    a->value.string = malloc(l + 1);
-    strcpy(a->value.string, s1);
-    strcat(a->value.string, ".");
-    strcat(a->value.string, s2);
-  } else if (t->next->type == equals) {
-    a->value.string = t->string_rep; // alpha
-  } else {
+  if (peek_type(p, n + 1) != equals &&
+      !(peek_type(p, n + 1) == dot && peek_type(p, n + 2) == alpha))
     return 0;
+  p->pos += n;
+
+  ast_node(a)->assignment.symbol = peek_symbol(p, 0);
+  if (peek_type(p, 1) == dot && peek_type(p, 2) == alpha) {
+    p->pos++;
+    p->pos++;
+    ast_node(a)->assignment.member = peek_symbol(p, 0);
   }
 
   // Implies we are parsing <alpha> <equals> <something>("alpha = ?")
   // So it should be a variable assignment
   if (is_dereference)
-    a->type = variable_reference_assignment;
+    ast_node(a)->type = variable_reference_assignment;
   else
-    a->type = variable_assignment;
-  a->value_type = string;
+    ast_node(a)->type = variable_assignment;
 
-  t = t->next; // equals
-  t = t->next; // something
-  a->children = parse_expression(&t);
-  assert(t->type == semicolon);
-  t = t->next;
+  p->pos++; // equals
+  p->pos++; // something
+  ast_index value = parse_expression(p);
+  ast_node(a)->assignment.value = value;
+  assert(peek_type(p, 0) == semicolon);
+  p->pos++;
 
-  *t_orig = t;
   return 1;
 }
 
-int parse_function_call(token_t **t_orig, ast_t *a) {
-  token_t *t = *t_orig;
-  if (t->type != alpha)
+int parse_function_call(struct Parser *p, ast_index a) {
+  if (peek_type(p, 0) != alpha)
     return 0;
-  if (t->next->type != openparen)
+  if (peek_type(p, 1) != openparen)
     return 0;
-  a->type = function_call;
-  a->value.string = t->string_rep;
-  a->value_type = string;
+  ast_node(a)->type = function_call;
+  ast_node(a)->call.symbol = peek_symbol(p, 0);
 
-  t = t->next;
-  t = t->next;
-  a->children = parse_function_call_arguments(&t);
-  assert(t->type == semicolon && "Expeceted semicolonn");
-  t = t->next;
+  p->pos++;
+  p->pos++;
+  ast_index arguments = parse_function_call_arguments(p);
+  ast_node(a)->call.arguments = arguments;
+  assert(peek_type(p, 0) == semicolon && "Expeceted semicolonn");
+  p->pos++;
 
-  *t_orig = t;
   return 1;
 }
 
-int parse_builtin_statement(token_t **t_orig, ast_t *a) {
-  token_t *t = *t_orig;
-  if (t->type != alpha)
-    return 0;
+int parse_builtin_statement(struct Parser *p, ast_index a) {
   // Check for builtin statement
-  assert(t->string_rep);
-  if (0 == strcmp(t->string_rep, "return")) {
-    a->type = return_statement;
-    a->next = NULL;
-    t = t->next;
-    a->children = parse_expression(&t);
-    t = t->next;
+  if (peek_type(p, 0) == keyword_return) {
+    ast_node(a)->type = return_statement;
+    p->pos++;
+    ast_index value = parse_expression(p);
+    ast_node(a)->ret.value = value;
+    p->pos++;
   } else {
     assert(0 && "Expected builtin statement");
   }
-  *t_orig = t;
   return 1;
 }
 
-ast_t *parse_codeblock(token_t **t_orig) {
-  token_t *t = *t_orig;
-  ast_t *r = malloc(sizeof(ast_t));
-  ast_t *a = r;
-  for (; t->type != closebracket;) {
+ast_index parse_codeblock(struct Parser *p) {
+  ast_index r = AST_NONE;
+  ast_index last = AST_NONE;
+  for (; peek_type(p, 0) != closebracket;) {
+    ast_index a = new_node(noop);
     // u64 x; OR u64 x = 5;
-    if (parse_variable_declaration(&t, a))
+    if (parse_variable_declaration(p, a))
       goto cont_for_loop;
     // x = 5;
-    else if (parse_variable_assignment(&t, a))
+    else if (parse_variable_assignment(p, a))
       goto cont_for_loop;
     // if(condition) {}
-    else if (parse_if(&t, a))
+    else if (parse_if(p, a))
       goto cont_for_loop;
     // for(condition) {}
-    else if (parse_for(&t, a))
+    else if (parse_for(p, a))
       goto cont_for_loop;
     // foo(); OR foo(arg1, arg2, ...);
-    else if (parse_function_call(&t, a))
+    else if (parse_function_call(p, a))
       goto cont_for_loop;
     // asm(); OR return x; etc
-    else if (parse_builtin_statement(&t, a))
+    else if (parse_builtin_statement(p, a))
       goto cont_for_loop;
     else
       assert(0);
 
   cont_for_loop:
-    a->next = malloc(sizeof(ast_t));
-    a = a->next;
-    a->type = noop;
-    a->children = NULL;
+    if (last)
+      ast_node(last)->next = a;
+    else
+      r = a;
+    last = a;
   }
-  t = t->next;
-  *t_orig = t;
+  p->pos++;
   return r;
 }
 
-ast_t *lex2ast(token_t *t) {
-  global_definitions = hashmap_create(20);
-  ast_t *r = malloc(sizeof(ast_t));
-  ast_t *a = r;
-  a->next = NULL;
-  for (; t && t->type != end;) {
-    if (!t || !t->next || !t->next->next)
-      break;
-    if (parse_struct_definition(&t, a)) {
+// Parses one function or struct definition.
+static ast_index parse_item(struct Parser *p) {
+  ast_index a = new_node(noop);
+  if (parse_struct_definition(p, a)) {
 
-    } else if (t->type == alpha && t->next->type == alpha &&
-               t->next->next->type == openparen) { // Check function
-      a->type = function;
+  } else if (is_builtin_type(peek_type(p, 0)) && peek_type(p, 1) == alpha &&
+             peek_type(p, 2) == openparen) { // Check function
+    ast_node(a)->type = function;
 
-      int error;
-      a->statement_variable_type = parse_type(&t, &error);
-      assert(!error);
+    struct AstFunction f = {0};
+    f.return_type = parse_type(p);
+    assert(f.return_type);
 
-      t = t->next;
+    p->pos++;
 
-      a->value_type = string;
-      a->value.string = t->string_rep;
-      t = t->next;
-      t = t->next;
-      a->args = parse_function_arguments(&t);
+    f.symbol = peek_symbol(p, 0);
+    p->pos++;
+    p->pos++;
+    f.arguments = parse_function_arguments(p);
 
-      assert(t->type == openbracket && "srror");
-      t = t->next;
-      a->children = parse_codeblock(&t);
-    }
-    a->next = malloc(sizeof(ast_t));
-    a = a->next;
-    a->type = noop;
-    a->next = NULL;
+    assert(peek_type(p, 0) == openbracket && "srror");
+    p->pos++;
+    f.body = parse_codeblock(p);
+    ast_node(a)->function.index = new_function(f);
+  } else {
+    assert(0 && "Expected function or struct definition");
   }
+  return a;
+}
+
+ast_index lex2ast(struct TokenArray *tokens) {
+  struct Parser parser = {
+      .tokens = tokens,
+      .pos = 0,
+  };
+  struct Parser *p = &parser;
+  ast_init(tokens->count);
+  ast_index r = AST_NONE;
+  ast_index last = AST_NONE;
+  for (; peek_type(p, 0) != end;) {
+    ast_index a = parse_item(p);
+    if (last)
+      ast_node(last)->next = a;
+    else
+      r = a;
+    last = a;
+  }
+  free(p->operands);
+  free(p->operators);
+  return r;
+}
+
+ast_index lex2ast_item(struct TokenArray *tokens) {
+  item_parser.tokens = tokens;
+  item_parser.pos = 0;
+  ast_init(tokens->count);
+  ast_index r = parse_item(&item_parser);
+  assert(peek_type(&item_parser, 0) == end && "Expected end of item");
   return r;
 }
 
-int calculate_expression(ast_t *a) {
+struct AstMark ast_mark(void) {
+  // The reserved entries have to exist before the mark so they are never
+  // released.
+  ast_init(0);
+  return (struct AstMark){
+      .node_count = ast.node_count,
+      .function_count = ast.function_count,
+      .string_count = ast.string_count,
+  };
+}
+
+void ast_release(struct AstMark mark) {
+  assert(mark.node_count <= ast.node_count);
+  ast.node_count = mark.node_count;
+  ast.function_count = mark.function_count;
+  ast.string_count = mark.string_count;
+  arena_reset(&ast_arena);
+}
+
+int calculate_expression(ast_index i) {
+  struct AstNode *a = ast_node(i);
   if (a->type == binaryexpression) {
-    int x = calculate_expression(a->left);
-    int y = calculate_expression(a->right);
+    int x = calculate_expression(a->binary.left);
+    int y = calculate_expression(a->binary.right);
     switch (a->operator) {
-    case '+':
+    case operator_add:
       return x + y;
-    case '-':
+    case operator_sub:
       return x - y;
-    case '*':
+    case operator_mul:
       return x * y;
+    case operator_div:
+      return x / y;
+    case operator_mod:
+      return x % y;
+    case operator_shl:
+      return x << y;
+    case operator_shr:
+      return x >> y;
+    case operator_and:
+      return x & y;
+    case operator_or:
+      return x | y;
+    case operator_xor:
+      return x ^ y;
+    case operator_eq:
+      return x == y;
+    case operator_ne:
+      return x != y;
+    case operator_lt:
+      return x < y;
+    case operator_le:
+      return x <= y;
+    case operator_gt:
+      return x > y;
+    case operator_ge:
+      return x >= y;
     default:
       assert(0);
       break;
     }
   } else if (a->type == literal) {
-    if (a->value_type == (ast_value_type)number) {
-      return a->value.number;
+    if (a->value_type == num) {
+      return ast_number(a);
     } else {
       assert(0 && "unimplemented");
     }
@@ -639,7 +836,7 @@ int calculate_expression(ast_t *a) {
 }
 
 void test_calculation(void) {
-  token_t *head = lexer("\
+  const char *source = "\
 	u64 main() {\
 		u64 foo = 1+2;\
 		u64 bar = 4*2+1;\
@@ -650,76 +847,99 @@ void test_calculation(void) {
 		u64 fooze = 1+booze;\
 		u64 rand = ooooaaa(1);\
 		u32 *ptr = 22;\
-	}");
-  ast_t *h = lex2ast(head);
+		u64 sub = 10-4-3+2*3-1;\
+		u64 cmp = 1+2 < 4 == 3 >= 3 != 0 > 1;\
+		u64 bits = 7 & 12 | 1 ^ 3 << 2 >> 1 + 100 / 7 % 5;\
+	}";
+  struct TokenArray tokens;
+  lexer(source, strlen(source), &tokens);
+  struct AstNode *h = ast_node(lex2ast(&tokens));
+  token_array_free(&tokens);
   assert(h->type == function);
-  h = h->children;
+  h = ast_node(ast_function(h->function.index)->body);
 
-  ast_t *c = h;
+  struct AstNode *c = h;
   assert(c->type == variable_declaration);
-  assert(3 == calculate_expression(c->children));
+  assert(3 == calculate_expression(c->declaration.value));
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  assert(9 == calculate_expression(c->children));
+  assert(9 == calculate_expression(c->declaration.value));
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  assert(9 == calculate_expression(c->children));
+  assert(9 == calculate_expression(c->declaration.value));
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  ast_t *f = c->children;
+  struct AstNode *f = ast_node(c->declaration.value);
   assert(f->type == function_call);
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  f = c->children;
-  assert(f);
+  assert(c->declaration.value);
+  f = ast_node(c->declaration.value);
   assert(f->type == binaryexpression);
-  assert(f->left->type == function_call);
-  assert(f->right->type == literal);
+  assert(ast_node(f->binary.left)->type == function_call);
+  assert(ast_node(f->binary.right)->type == literal);
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  f = c->children;
-  assert(f);
+  assert(c->declaration.value);
+  f = ast_node(c->declaration.value);
   assert(f->type == binaryexpression);
-  assert(f->left->type == literal);
-  assert(f->right->type == function_call);
+  assert(ast_node(f->binary.left)->type == literal);
+  assert(ast_node(f->binary.right)->type == function_call);
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  f = c->children;
-  assert(f);
+  assert(c->declaration.value);
+  f = ast_node(c->declaration.value);
   assert(f->type == binaryexpression);
-  assert(f->left->type == literal);
-  assert(f->right->type == variable);
+  assert(ast_node(f->binary.left)->type == literal);
+  assert(ast_node(f->binary.right)->type == variable);
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
   assert(c->type == variable_declaration);
-  c = c->children;
+  c = ast_node(c->declaration.value);
   assert(c->type == function_call);
-  f = c->children;
-  assert(f);
+  assert(c->call.arguments);
+  f = ast_node(c->call.arguments);
   assert(f->type == literal);
-  assert(f->value_type == (ast_value_type)number);
-  assert(f->value.number == 1);
+  assert(f->value_type == num);
+  assert(ast_number(f) == 1);
 
-  h = h->next;
+  h = ast_node(h->next);
   c = h;
-  struct BuiltinType bt = c->statement_variable_type;
-  assert(bt.variant == pointer);
-  assert(bt.ptr->variant == builtin);
+  struct BuiltinType *bt = ast_type(c->declaration.type);
+  assert(bt->variant == pointer);
+  assert(ast_type(bt->ptr)->variant == builtin);
   assert(c->type == variable_declaration);
-  c = c->children;
+  c = ast_node(c->declaration.value);
   assert(c->type == literal);
-  assert(c->value.number == 22);
+  assert(ast_number(c) == 22);
+
+  h = ast_node(h->next);
+  c = h;
+  assert(c->type == variable_declaration);
+  assert(8 == calculate_expression(c->declaration.value));
+
+  h = ast_node(h->next);
+  c = h;
+  assert(c->type == variable_declaration);
+  assert(1 == calculate_expression(c->declaration.value));
+
+  h = ast_node(h->next);
+  c = h;
+  assert(c->type == variable_declaration);
+  assert(5 == calculate_expression(c->declaration.value));
+  assert(!h->next);
+  ast_free();
 }
@@ -1,16 +1,10 @@
-typedef struct ast_struct ast_t;
 #ifndef AST_H
 #define AST_H
-#include <hashmap/hashmap.h>
+#include <arena.h>
 #include <lexer.h>
 #include <stdint.h>
 #include <stdio.h>
 
-typedef union {
-  char *string;
-  uint64_t number;
-} ast_value;
-
 typedef enum { num, string } ast_value_type;
 
 typedef enum {
@@ -31,22 +25,57 @@ typedef enum {
   noop,
 } ast_enum;
 
+typedef enum {
+  operator_add,
+  operator_sub,
+  operator_mul,
+  operator_div,
+  operator_mod,
+  operator_shl,
+  operator_shr,
+  operator_and,
+  operator_or,
+  operator_xor,
+  operator_eq,
+  operator_ne,
+  operator_lt,
+  operator_le,
+  operator_gt,
+  operator_ge,
+} ast_operator;
+
+// Comparisons are the last operators, their result is 0 or 1.
+static inline int is_comparison(uint8_t operator) {
+  return operator>= operator_eq;
+}
+
+// Nodes, types and functions are addressed by 32-bit indices into the pools
+// of struct Ast. Index 0 is never handed out and means "none".
+typedef uint32_t ast_index;
+#define AST_NONE 0
+
 typedef enum { builtin, structure, pointer } type_variant;
 
+// Builtin types are put into the type pool up front so they have fixed
+// indices.
+#define TYPE_U64 1
+#define TYPE_U32 2
+#define TYPE_U0 3
+
 struct BuiltinType {
   type_variant variant;
   const char *name;
   union {
-    ast_t *ast_struct;
-    struct BuiltinType *ptr;
+    // struct_definition node
+    ast_index ast_struct;
+    // Type being pointed to
+    ast_index ptr;
   };
+  // Pointer type to this type, created the first time it is needed
+  ast_index pointer_type;
   uint8_t byte_size;
-};
-
-struct FunctionVariable {
-  uint64_t offset;
-  int is_argument;
-  struct BuiltinType type;
+  // That of the largest member for structs
+  uint8_t alignment;
 };
 
 struct CompiledData {
@@ -57,25 +86,141 @@ struct CompiledData {
   struct CompiledData *prev;
 };
 
-struct ast_struct {
-  ast_enum type;
-  ast_t *children;
-  ast_t *next;
-  char operator;
-  struct BuiltinType statement_variable_type;
-  ast_value_type value_type;
-  ast_value value;
-  ast_t *exp;
-  ast_t *args;
-  ast_t *left;
-  ast_t *right;
+// Every node is 20 bytes, the fields that are used depend on the type of the
+// node. Lists of statements, arguments and struct members are linked through
+// next. Nodes are appended in the order they are parsed, so walking a
+// function touches memory mostly sequentially.
+struct AstNode {
+  uint8_t type;
+  // Binary expressions, an ast_operator
+  uint8_t operator;
+  // Literals
+  uint8_t value_type;
+  ast_index next;
+  union {
+    // variable, variable_reference
+    struct {
+      uint32_t symbol;
+      // Struct member being accessed, SYMBOL_NONE if there is none
+      uint32_t member;
+    } variable;
+    // variable_assignment, variable_reference_assignment
+    struct {
+      uint32_t symbol;
+      uint32_t member;
+      ast_index value;
+    } assignment;
+    // variable_declaration, function_argument, struct members. value is the
+    // initializer and AST_NONE if there is none.
+    struct {
+      uint32_t symbol;
+      ast_index type;
+      ast_index value;
+    } declaration;
+    struct {
+      ast_index left;
+      ast_index right;
+    } binary;
+    struct {
+      uint32_t symbol;
+      ast_index arguments;
+    } call;
+    // if_statement, for_statement
+    struct {
+      ast_index condition;
+      ast_index body;
+    } branch;
+    // return_statement
+    struct {
+      ast_index value;
+    } ret;
+    struct {
+      uint32_t symbol;
+      ast_index members;
+      ast_index type;
+    } structure;
+    // Index into the function pool
+    struct {
+      ast_index index;
+    } function;
+    // literal, numbers are split in two words to keep the node 4 byte aligned
+    struct {
+      uint32_t low;
+      uint32_t high;
+    } number;
+    // literal, index into the string pool
+    struct {
+      uint32_t index;
+    } string;
+  };
+};
+
+struct AstFunction {
+  uint32_t symbol;
+  ast_index return_type;
+  ast_index arguments;
+  ast_index body;
 };
 
+struct Ast {
+  struct AstNode *nodes;
+  uint32_t node_count;
+  uint32_t node_capacity;
+  struct BuiltinType *types;
+  uint32_t type_count;
+  uint32_t type_capacity;
+  struct AstFunction *functions;
+  uint32_t function_count;
+  uint32_t function_capacity;
+  // String literals, NUL terminated and allocated from ast_arena
+  char **strings;
+  uint32_t string_count;
+  uint32_t string_capacity;
+};
+
+// Every thread builds its own AST.
+extern _Thread_local struct Ast ast;
+// String literals in the AST are allocated from ast_arena.
+extern _Thread_local struct Arena ast_arena;
+
+static inline struct AstNode *ast_node(ast_index i) { return &ast.nodes[i]; }
+
+static inline struct BuiltinType *ast_type(ast_index i) {
+  return &ast.types[i];
+}
+
+static inline struct AstFunction *ast_function(ast_index i) {
+  return &ast.functions[i];
+}
+
+static inline const char *ast_string(ast_index i) { return ast.strings[i]; }
+
+static inline uint64_t ast_number(struct AstNode *a) {
+  return (uint64_t)a->number.high << 32 | a->number.low;
+}
+
 const char *type_to_string(struct BuiltinType t);
-ast_t *lex2ast(token_t *t);
-void print_ast(ast_t *a);
-void compile_ast(ast_t *a, ast_t *parent, HashMap *m,
-                 struct CompiledData **data_orig, FILE *fp, size_t *stack_size);
+// Parses the tokens into the pools of ast and returns the first top level
+// node.
+ast_index lex2ast(struct TokenArray *tokens);
+// Parses a single top level item, as produced by lexer_stream_next(), and
+// appends it to the pools of ast.
+ast_index lex2ast_item(struct TokenArray *tokens);
+
+// Sizes of the pools at some point, see ast_release().
+struct AstMark {
+  uint32_t node_count;
+  uint32_t function_count;
+  uint32_t string_count;
+};
+
+struct AstMark ast_mark(void);
+// Drops the nodes, functions and strings added since mark was taken, and
+// everything in ast_arena. Types are kept as pointer types are cached in the
+// types they point to, and so are struct definitions parsed before mark.
+void ast_release(struct AstMark mark);
+// Releases all pools and ast_arena.
+void ast_free(void);
 
 void test_calculation(void);
 #endif // AST_H
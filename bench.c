@@ -0,0 +1,334 @@
+#include <arena.h>
+#include <assert.h>
+#include <ast.h>
+#include <codegen.h>
+#include <lexer.h>
+#include <source.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stream.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Front-end throughput benchmark. Either reads a source file or generates a
+// synthetic program of a given shape and size, then times lexer(), lex2ast()
+// and compile_ast() separately, or compile_stream() as a whole. Results are
+// printed as one JSON object per phase and line so they can be collected by
+// scripts.
+
+struct Buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static void buffer_printf(struct Buffer *b, const char *fmt, ...) {
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t left = b->capacity - b->length;
+    int n = vsnprintf(b->data + b->length, left, fmt, ap);
+    va_end(ap);
+    assert(n >= 0);
+    if ((size_t)n < left) {
+      b->length += n;
+      return;
+    }
+    b->capacity = b->capacity ? b->capacity * 2 : 4096;
+    for (; b->capacity - b->length <= (size_t)n;)
+      b->capacity *= 2;
+    b->data = realloc(b->data, b->capacity);
+    assert(b->data && "Out of memory");
+  }
+}
+
+static void gen_header(struct Buffer *b) {
+  buffer_printf(b, "u64 exit(u64 code) {\n"
+                   "  asm(\"mov rdi, [rbp+0x10]\\nmov rax, 60\\n"
+                   "syscall\\n\");\n"
+                   "}\n\n");
+}
+
+// Many small functions calling the previous one
+static void gen_functions(struct Buffer *b, uint32_t i) {
+  buffer_printf(b,
+                "u64 function_%u(u64 alpha, u64 beta) {\n"
+                "  u64 result = alpha * %u + beta;\n"
+                "  u64 *gamma = &result;\n"
+                "  *gamma = result + beta;\n",
+                i, i % 97);
+  if (i > 0)
+    buffer_printf(b, "  result = function_%u(result, beta);\n",
+                  i - 1);
+  buffer_printf(b, "  return result + 1;\n}\n\n");
+}
+
+// Deeply nested if and for statements
+static void gen_nesting(struct Buffer *b, uint32_t i) {
+  const uint32_t depth = 48;
+  buffer_printf(b, "u64 nested_%u(u64 n) {\n  u64 counter = 0;\n", i);
+  for (uint32_t d = 0; d < depth; d++)
+    buffer_printf(b, "%*s%s (counter == %u) {\n", d * 2 + 2, "",
+                  (d & 1) ? "for" : "if", d);
+  for (uint32_t d = depth; d > 0; d--)
+    buffer_printf(b, "%*scounter = counter + %u;\n%*s}\n", d * 2 + 2, "", d,
+                  d * 2, "");
+  buffer_printf(b, "  return counter;\n}\n\n");
+}
+
+// Long expressions mixing every operator
+static void gen_expressions(struct Buffer *b, uint32_t i) {
+  static const char *operators[] = {"+", "*", "-", "+", "*", "=="};
+  const uint32_t terms = 256;
+  buffer_printf(b, "u64 expression_%u(u64 a, u64 b, u64 c) {\n  u64 r = a", i);
+  for (uint32_t t = 1; t < terms; t++) {
+    const char *op = operators[t % 6];
+    switch (t % 4) {
+    case 0:
+      buffer_printf(b, " %s %u", op, t);
+      break;
+    case 1:
+      buffer_printf(b, " %s b", op);
+      break;
+    case 2:
+      buffer_printf(b, " %s c", op);
+      break;
+    default:
+      buffer_printf(b, " %s a", op);
+      break;
+    }
+    if (0 == t % 8)
+      buffer_printf(b, "\n     ");
+  }
+  buffer_printf(b, ";\n  return r;\n}\n\n");
+}
+
+// Struct definitions with a function using their members
+static void gen_structs(struct Buffer *b, uint32_t i) {
+  const uint32_t members = 8;
+  buffer_printf(b, "struct Record_%u {\n", i);
+  for (uint32_t m = 0; m < members; m++)
+    buffer_printf(b, "  %s member_%u,\n", (m & 1) ? "u32" : "u64", m);
+  buffer_printf(b, "}\n\nu64 record_%u(u64 seed) {\n  struct Record_%u r;\n", i,
+                i);
+  for (uint32_t m = 0; m < members; m++)
+    buffer_printf(b, "  r.member_%u = seed + %u;\n", m, m);
+  buffer_printf(b, "  return r.member_0");
+  for (uint32_t m = 1; m < members; m++)
+    buffer_printf(b, " + r.member_%u", m);
+  buffer_printf(b, ";\n}\n\n");
+}
+
+// Huge string literals, some with escape sequences
+static void gen_strings(struct Buffer *b, uint32_t i) {
+  const uint32_t length = 4096;
+  buffer_printf(b, "u0 strings_%u() {\n  print(\"", i);
+  for (uint32_t c = 0; c < length; c++) {
+    if ((i & 1) && 0 == c % 64)
+      buffer_printf(b, "\\n");
+    else
+      buffer_printf(b, "%c", 'a' + (c + i) % 26);
+  }
+  buffer_printf(b, "\");\n}\n\n");
+}
+
+typedef void (*generator_t)(struct Buffer *, uint32_t);
+
+static const struct {
+  const char *name;
+  generator_t generator;
+} shapes[] = {
+    {"functions", gen_functions}, {"nesting", gen_nesting},
+    {"expressions", gen_expressions}, {"structs", gen_structs},
+    {"strings", gen_strings},         {"mixed", NULL},
+};
+
+// Generates roughly size bytes of source of the given shape. The mixed
+// shape cycles through all of the others.
+static int generate(struct Buffer *b, const char *shape, size_t size) {
+  size_t n = sizeof(shapes) / sizeof(shapes[0]);
+  size_t s = 0;
+  for (; s < n && 0 != strcmp(shapes[s].name, shape); s++)
+    ;
+  if (s == n)
+    return 0;
+  gen_header(b);
+  for (uint32_t i = 0; b->length < size; i++) {
+    if (shapes[s].generator)
+      shapes[s].generator(b, i);
+    else
+      shapes[i % (n - 1)].generator(b, i);
+  }
+  return 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+struct Phase {
+  const char *name;
+  double seconds;
+  long peak_rss_kb;
+};
+
+static void report(struct Phase *p, const char *input, int threads,
+                   size_t bytes, size_t tokens, size_t nodes) {
+  printf("{\"phase\":\"%s\",\"input\":\"%s\",\"threads\":%d,\"bytes\":%zu,"
+         "\"tokens\":%zu,\"nodes\":%zu,\"seconds\":%.6f,\"mb_per_s\":%.2f,"
+         "\"tokens_per_s\":%.0f,\"nodes_per_s\":%.0f,\"peak_rss_kb\":%ld}\n",
+         p->name, input, threads, bytes, tokens, nodes, p->seconds,
+         bytes / p->seconds / 1e6, tokens / p->seconds, nodes / p->seconds,
+         p->peak_rss_kb);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-s shape] [-n bytes] [-r repeat] [-j threads] [-S] "
+          "[-g] [file]\n"
+          "shapes: functions nesting expressions structs strings mixed\n"
+          "-j lexes with lexer_parallel() on that many threads\n"
+          "-S times compile_stream() instead of the separate phases\n"
+          "-g writes the generated program to stdout instead of timing it\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  const char *shape = "mixed";
+  size_t size = 1 << 20;
+  int repeat = 3;
+  int print_source = 0;
+  int threads = 1;
+  int stream = 0;
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strcmp(argv[i], "-s") && i + 1 < argc) {
+      shape = argv[++i];
+    } else if (0 == strcmp(argv[i], "-n") && i + 1 < argc) {
+      size = strtoull(argv[++i], NULL, 0);
+    } else if (0 == strcmp(argv[i], "-r") && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-j") && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-S")) {
+      stream = 1;
+    } else if (0 == strcmp(argv[i], "-g")) {
+      print_source = 1;
+    } else if ('-' != argv[i][0] && !path) {
+      path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (repeat < 1)
+    repeat = 1;
+
+  struct Source source = {0};
+  struct Buffer generated = {0};
+  char input[64];
+  if (path) {
+    if (0 != source_open(&source, path)) {
+      fprintf(stderr, "File \"%s\" could not be opened.\n", path);
+      return 1;
+    }
+    snprintf(input, sizeof(input), "%s", path);
+  } else {
+    if (!generate(&generated, shape, size)) {
+      usage(argv[0]);
+      return 1;
+    }
+    source.data = generated.data;
+    source.length = generated.length;
+    snprintf(input, sizeof(input), "%s", shape);
+  }
+  if (print_source) {
+    fwrite(source.data, source.length, 1, stdout);
+    return 0;
+  }
+
+  FILE *null = fopen("/dev/null", "w");
+  assert(null);
+  if (stream) {
+    struct Phase phase = {"stream"};
+    struct StreamStats stats;
+    for (int r = 0; r < repeat; r++) {
+      double start = now();
+      compile_stream(&source, null, &stats);
+      double seconds = now() - start;
+      if (0 == r)
+        phase.peak_rss_kb = peak_rss_kb();
+      if (0 == r || seconds < phase.seconds)
+        phase.seconds = seconds;
+      ast_free();
+      arena_free(&codegen_arena);
+    }
+    fclose(null);
+    report(&phase, input, 1, source.length, stats.tokens, stats.nodes);
+    if (path)
+      source_close(&source);
+    free(generated.data);
+    return 0;
+  }
+  struct Phase phases[3] = {{"lexer"}, {"lex2ast"}, {"compile_ast"}};
+  size_t tokens = 0;
+  size_t nodes = 0;
+  // Every phase is timed on each repetition and the fastest run is kept.
+  for (int r = 0; r < repeat; r++) {
+    struct TokenArray token_array;
+    double start = now();
+    lexer_parallel(source.data, source.length, &token_array, threads);
+    double lexed = now();
+    long lexer_rss = peak_rss_kb();
+    ast_index h = lex2ast(&token_array);
+    double parsed = now();
+    long lex2ast_rss = peak_rss_kb();
+    tokens = token_array.count;
+    token_array_free(&token_array);
+    arena_free(&lexer_arena);
+
+    struct CompiledData *data = NULL;
+    double compile_start = now();
+    compile_ast(h, &data, null);
+    double compiled = now();
+    long compile_ast_rss = peak_rss_kb();
+    // Node 0 is reserved
+    nodes = ast.node_count - 1;
+    ast_free();
+    arena_free(&codegen_arena);
+
+    double seconds[3] = {lexed - start, parsed - lexed,
+                         compiled - compile_start};
+    // Later repetitions reuse memory so only the first one shows the peak
+    // usage of each phase.
+    if (0 == r) {
+      phases[0].peak_rss_kb = lexer_rss;
+      phases[1].peak_rss_kb = lex2ast_rss;
+      phases[2].peak_rss_kb = compile_ast_rss;
+    }
+    for (int i = 0; i < 3; i++) {
+      if (0 == r || seconds[i] < phases[i].seconds)
+        phases[i].seconds = seconds[i];
+    }
+  }
+  fclose(null);
+
+  report(&phases[0], input, threads, source.length, tokens, 0);
+  report(&phases[1], input, threads, source.length, tokens, nodes);
+  report(&phases[2], input, threads, source.length, tokens, nodes);
+  if (path)
+    source_close(&source);
+  free(generated.data);
+  return 0;
+}
@@ -1,394 +1,312 @@
+#include <arena.h>
 #include <assert.h>
 #include <codegen.h>
+#include <ir.h>
+#include <lower.h>
+#include <opt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <symbol.h>
+#include <x86.h>
 
-void calculate_asm_expression(ast_t *a, HashMap *m,
-                              struct CompiledData **data_orig, FILE *fp);
+_Thread_local struct Arena codegen_arena;
+struct CodegenOptions codegen_options = {.optimize = 1, .inline_budget = 40};
 
-static const char *matching_register_prefix(uint8_t byte_size) {
-  switch (byte_size) {
-  case 1:
-    return ""; // 8 bits
-  case 4:
-    return "e"; // 32 bits
-  case 8:
-    return "r"; // 64 bits
-  default:
-    assert(0);
-    break;
-  }
-}
-
-void gen_rand_string(char *s, int l) {
-  int i = 0;
-  for (; i < l - 1; i++)
-    s[i] = (rand() % 15) + 'A';
-  s[i] = '\0';
-}
-
-int builtin_functions(const char *function, ast_t *arguments) {
-  if (0 == strcmp(function, "asm")) {
-    printf("%s", arguments->value.string);
-    return 1;
-  }
-  return 0;
-}
+// Labels are numbered per unit, so the output of a file does not depend on
+// what else was compiled before it or on another thread.
+_Thread_local uint64_t label_count;
+// Reused for every function compiled on this thread
+_Thread_local struct IrFunction ir_function;
+// Function node inlined in place of calls to every symbol, set up by
+// plan_inlining() in codegen_arena. NULL when nothing is inlined.
+_Thread_local ast_index *inline_functions;
+_Thread_local uint32_t inline_function_count;
+// Whether each function has inline assembly, by function index. The assembly
+// may rely on what a call left in registers, so nothing is inlined into it.
+_Thread_local uint8_t *asm_functions;
 
-void compile_binary_expression(ast_t *a, HashMap *m,
-                               struct CompiledData **data_orig, FILE *fp) {
-  calculate_asm_expression(a->right, m, data_orig, fp);
-  fprintf(fp, "push rax\n");
-  calculate_asm_expression(a->left, m, data_orig, fp);
-  fprintf(fp, "pop rcx\n");
-  switch (a->operator) {
-  case '+':
-    fprintf(fp, "add rax, rcx\n");
-    break;
-  case '-':
-    fprintf(fp, "sub rax, rcx\n");
-    break;
-  case '*':
-    fprintf(fp, "mul rcx\n");
-    break;
-  case '=': {
-    char label[10];
-    gen_rand_string(label, 10);
-    fprintf(fp, "mov rdx, 0\n");
-    fprintf(fp, "cmp rax, rcx\n");
-    fprintf(fp, "jne %s\n", label);
-    fprintf(fp, "mov rdx, 1\n");
-    fprintf(fp, "%s:\n", label);
-    fprintf(fp, "mov rax, rdx\n");
-    break;
-  }
-  default:
-    assert(0);
-    break;
-  }
+// Writes a label of l - 1 letters, unique within the unit.
+void gen_label(char *s, int l) {
+  uint64_t n = label_count++;
+  s[l - 1] = '\0';
+  for (int i = l - 2; i >= 0; i--, n /= 15)
+    s[i] = n % 15 + 'A';
 }
 
-void compile_function_call(ast_t *a, HashMap *m,
-                           struct CompiledData **data_orig, FILE *fp,
-                           int allow_builtin) {
-  assert(a->value_type == string);
-  if (allow_builtin) {
-    int rc = builtin_functions(a->value.string, a->children);
-    if (rc)
-      return;
-  }
-  int stack_to_recover = 0;
-  ast_t *arguments[10];
-  int i = 0;
-  for (ast_t *c = a->children; c; c = c->next, i++) {
-    arguments[i] = c;
-  }
-  i--;
-  for (; i >= 0; i--) {
-    calculate_asm_expression(arguments[i], m, data_orig, fp);
-    stack_to_recover += 8;
-    fprintf(fp, "push rax\n");
+const char *add_data(struct CompiledData **data_orig, const char *string) {
+  struct CompiledData *data = *data_orig;
+  if (!data) {
+    data = arena_alloc(&codegen_arena, sizeof(struct CompiledData));
+    data->prev = NULL;
+  } else {
+    struct CompiledData *prev = data;
+    data->next = arena_alloc(&codegen_arena, sizeof(struct CompiledData));
+    data = data->next;
+    data->prev = prev;
   }
-  fprintf(fp, "call %s\n", a->value.string);
-  fprintf(fp, "add rsp, %d\n", stack_to_recover);
+  data->name = arena_alloc(&codegen_arena, 10);
+  gen_label(data->name, 10);
+  data->buffer_size = strlen(string);
+  data->buffer = arena_alloc(&codegen_arena, data->buffer_size + 1);
+  data->next = NULL;
+  strcpy(data->buffer, string);
+  *data_orig = data;
+  return data->name;
 }
 
-void compile_struct(ast_t *a, FILE *fp) {
+void compile_struct(struct AstNode *a, FILE *fp) {
   fprintf(fp, "section .data\n");
-  assert(string == a->value_type);
-  fprintf(fp, "%s:\n", a->value.string);
-  for (ast_t *c = a->children; c; c = c->next) {
-    struct BuiltinType type = c->statement_variable_type;
-    fprintf(fp, "times %d db 0\n", type.byte_size);
+  fprintf(fp, "%s:\n", symbol_name(a->structure.symbol));
+  for (ast_index c = a->structure.members; c; c = ast_node(c)->next) {
+    struct BuiltinType *type = ast_type(ast_node(c)->declaration.type);
+    fprintf(fp, "times %d db 0\n", type->byte_size);
   }
   fprintf(fp, "section .text\n");
   return;
 }
 
-uint64_t struct_find_member(ast_t *ast_struct, const char *member) {
+// Offset of member from the start of the struct, the type of the member is
+// written to type.
+uint64_t struct_find_member(ast_index ast_struct, uint32_t member,
+                            struct BuiltinType *type) {
   uint64_t r = 0;
-  for (ast_t *c = ast_struct->children; c; c = c->next) {
-    if (0 == strcmp(c->value.string, member)) {
+  for (ast_index i = ast_node(ast_struct)->structure.members; i;
+       i = ast_node(i)->next) {
+    struct AstNode *c = ast_node(i);
+    if (c->declaration.symbol == member) {
+      *type = *ast_type(c->declaration.type);
       return r;
     }
-    r += c->statement_variable_type.byte_size;
+    r += ast_type(c->declaration.type)->byte_size;
   }
   assert(0);
   return 0;
 }
 
-void compile_variable(ast_t *a, HashMap *m, FILE *fp) {
-  struct FunctionVariable *ptr = hashmap_get_entry(m, (char *)a->value.string);
-  // Check if we are pointing into a struct
-  if (!ptr) {
-    char *dot_ps = strchr(a->value.string, '.');
-    if (!dot_ps) {
-      assert(0 && "Unknown variable");
-    }
-    *dot_ps = '\0';
-    ptr = hashmap_get_entry(m, (char *)a->value.string);
-    assert(!ptr->is_argument && "FIXME");
-    assert(ptr && "Unknown variable");
-    char *member = dot_ps + 1;
-    uint64_t stack_location = ptr->offset;
-    uint64_t member_offset = struct_find_member(ptr->type.ast_struct, member);
-    if (a->type == variable_reference) {
-      member_offset = struct_find_member(ptr->type.ast_struct, member);
-
-      fprintf(fp, "mov rax, rbp\n");
-      fprintf(fp, "sub rax, 0x%lx\n", stack_location + member_offset);
-      return;
-    }
-    fprintf(fp, "mov %sax, [rbp-0x%lx]\n",
-            matching_register_prefix(ptr->type.byte_size),
-            stack_location + member_offset);
-    return;
+// Lowers the function to the IR, optimizes it and emits machine code.
+void compile_function(ast_index a, struct CompiledData **data_orig, FILE *fp) {
+  struct IrFunction *f = &ir_function;
+  lower_function(f, a, data_orig);
+  ir_cfg(f);
+  if (codegen_options.optimize) {
+    tail_recursion(f);
+    ir_dominators(f);
+    mem2reg(f);
+    sccp(f);
+    ir_dominators(f);
+    gvn(f);
+    licm(f);
+    dce(f);
   }
-  uint64_t stack_location = ptr->offset;
-  if (ptr->is_argument) {
-    if (a->type == variable_reference) {
-      fprintf(fp, "mov rax, rbp\n");
-      fprintf(fp, "add rax, 0x%lx\n", stack_location + 0x8);
-      return;
-    }
-    fprintf(fp, "mov %sax, [rbp+0x%lx]\n",
-            matching_register_prefix(ptr->type.byte_size), stack_location + 0x8);
-    return;
-  }
-  if (a->type == variable_reference) {
-    fprintf(fp, "mov rax, rbp\n");
-    fprintf(fp, "sub rax, 0x%lx\n", stack_location);
-    return;
-  }
-  fprintf(fp, "mov %sax, [rbp-0x%lx]\n",
-          matching_register_prefix(ptr->type.byte_size), stack_location);
+  if (codegen_options.print_ir)
+    ir_print(f, fp);
+  x86_emit(f, fp);
 }
 
-void compile_literal(ast_t *a, HashMap *m, struct CompiledData **data_orig,
-                     FILE *fp) {
-  struct CompiledData *data = *data_orig;
-  if (a->value_type == num) {
-    fprintf(fp, "mov rax, %ld\n", a->value.number);
-  } else if (a->value_type == string) {
-    if (!data) {
-      data = malloc(sizeof(struct CompiledData));
-      data->prev = NULL;
-    } else {
-      struct CompiledData *prev = data;
-      data->next = malloc(sizeof(struct CompiledData));
-      data = data->next;
-      data->prev = prev;
+void compile_ast(ast_index i, struct CompiledData **data_orig, FILE *fp) {
+  for (; i; i = ast_node(i)->next) {
+    struct AstNode *a = ast_node(i);
+    switch (a->type) {
+    case struct_definition:
+      compile_struct(a, fp);
+      break;
+    case function:
+      compile_function(i, data_orig, fp);
+      break;
+    case noop:
+      break;
+    default:
+      assert(0 && "unimplemented");
     }
-    data->name = malloc(10);
-    gen_rand_string(data->name, 10);
-    fprintf(fp, "mov rax, %s\n", data->name);
-    data->buffer_size = strlen(a->value.string);
-    data->buffer = malloc(data->buffer_size + 1);
-    data->next = NULL;
-    strcpy(data->buffer, a->value.string);
-  } else {
-    assert(0 && "unimplemented");
   }
-  *data_orig = data;
 }
 
-void calculate_asm_expression(ast_t *a, HashMap *m,
-                              struct CompiledData **data_orig, FILE *fp) {
-  if (a->type == binaryexpression) {
-    compile_binary_expression(a, m, data_orig, fp);
-  } else if (a->type == literal) {
-    compile_literal(a, m, data_orig, fp);
-  } else if (a->type == function_call) {
-    compile_function_call(a, m, data_orig, fp, 0);
-  } else if (a->type == variable || a->type == variable_reference) {
-    compile_variable(a, m, fp);
-  } else {
-    assert(0);
+void compile_data(struct CompiledData *data, FILE *fp) {
+  fprintf(fp, "section .data\n");
+  for (; data; data = data->prev) {
+    fprintf(fp, "%s: db ", data->name);
+    for (char *b = data->buffer; *b; b++) {
+      fprintf(fp, "0x%x, ", *b);
+    }
+    fprintf(fp, "\n");
   }
 }
 
-void compile_function(ast_t *a, struct CompiledData **data_orig, FILE *fp) {
-  assert(a->value_type == string);
-  fprintf(fp, "%s:\n", a->value.string);
-  fprintf(fp, "push rbp\n");
-  fprintf(fp, "mov rbp, rsp\n");
-  char *buffer;
-  size_t length = 0;
-  FILE *memstream = open_memstream(&buffer, &length);
-  size_t s = 8;
-  compile_ast(a->children, a, NULL, data_orig, memstream, &s);
-  fflush(memstream);
-  if (s > 8)
-    fprintf(fp, "sub rsp, %ld\n", s);
-  fwrite(buffer, length, 1, fp);
-  fclose(memstream);
-  fprintf(fp, "mov rsp, rbp\n");
-  fprintf(fp, "pop rbp\n");
-  fprintf(fp, "ret\n\n");
+// Top level node of the function defining every symbol.
+static ast_index *defined_functions(ast_index a, uint32_t symbols) {
+  ast_index *defined = arena_calloc(&codegen_arena, symbols, sizeof(ast_index));
+  for (ast_index i = a; i; i = ast_node(i)->next) {
+    if (function == ast_node(i)->type)
+      defined[ast_function(ast_node(i)->function.index)->symbol] = i;
+  }
+  return defined;
 }
 
-void compile_if_statement(ast_t *a, HashMap *m, struct CompiledData **data_orig,
-                          FILE *fp, size_t *stack_size) {
-  calculate_asm_expression(a->exp, m, data_orig, fp);
-  fprintf(fp, "and rax, rax\n");
-  char rand_string[10];
-  gen_rand_string(rand_string, sizeof(rand_string));
-  fprintf(fp, "jz _end_if_%s\n", rand_string);
-  compile_ast(a->children, NULL, m, data_orig, fp, stack_size);
-  fprintf(fp, "_end_if_%s:\n", rand_string);
+static uint32_t list_length(ast_index i) {
+  uint32_t n = 0;
+  for (; i; i = ast_node(i)->next)
+    n++;
+  return n;
 }
 
-void compile_for_statement(ast_t *a, HashMap *m,
-                           struct CompiledData **data_orig, FILE *fp,
-                           size_t *stack_size) {
-  char for_statement_rand_string[10];
-  gen_rand_string(for_statement_rand_string, sizeof(for_statement_rand_string));
-  char rand_string[10];
-  gen_rand_string(rand_string, sizeof(rand_string));
-  fprintf(fp, "%s:\n", for_statement_rand_string);
-  calculate_asm_expression(a->exp, m, data_orig, fp);
-  fprintf(fp, "and rax, rax\n");
-  fprintf(fp, "jz _end_if_%s\n", rand_string);
-  compile_ast(a->children, NULL, m, data_orig, fp, stack_size);
-  fprintf(fp, "jmp %s\n", for_statement_rand_string);
-  fprintf(fp, "_end_if_%s:\n", rand_string);
+ast_index inline_target(ast_index caller, struct AstNode *call) {
+  if (call->call.symbol >= inline_function_count ||
+      asm_functions[ast_node(caller)->function.index])
+    return AST_NONE;
+  ast_index callee = inline_functions[call->call.symbol];
+  if (!callee ||
+      list_length(call->call.arguments) !=
+          list_length(ast_function(ast_node(callee)->function.index)->arguments))
+    return AST_NONE;
+  return callee;
 }
 
-void compile_return_statement(ast_t *a, HashMap *m,
-                              struct CompiledData **data_orig, FILE *fp) {
-  calculate_asm_expression(a->children, m, data_orig, fp);
-  fprintf(fp, "mov rsp, rbp\n");
-  fprintf(fp, "pop rbp\n");
-  fprintf(fp, "ret\n\n");
+// A function that would return whatever is left in rax by falling off its end
+// can only be inlined if it returns nothing.
+static int has_return_value(struct AstFunction *f) {
+  ast_index last = f->body;
+  for (; last && ast_node(last)->next;)
+    last = ast_node(last)->next;
+  return TYPE_U0 == f->return_type ||
+         (last && return_statement == ast_node(last)->type);
 }
 
-void compile_variable_declaration(ast_t *a, HashMap *m,
-                                  struct CompiledData **data_orig, FILE *fp,
-                                  size_t *stack_size, uint64_t *stack) {
-  *stack += a->statement_variable_type.byte_size;
-  if (stack_size) {
-    *stack_size += a->statement_variable_type.byte_size;
-  }
-  struct FunctionVariable *h = malloc(sizeof(struct FunctionVariable));
-  *h = (struct FunctionVariable){
-      .offset = *stack, .is_argument = 0, .type = a->statement_variable_type};
-  hashmap_add_entry(m, (char *)a->value.string, h, NULL, 0);
-  if (a->children) {
-    calculate_asm_expression(a->children, m, data_orig, fp);
-    fprintf(fp, "mov [rbp - 0x%lx], %sax\n", *stack,
-            matching_register_prefix(h->type.byte_size));
-  }
-}
+enum { plan_visiting = 1, plan_done = 2, plan_recursive = 4 };
 
-void compile_variable_assignment(ast_t *a, HashMap *m,
-                                 struct CompiledData **data_orig, FILE *fp) {
-  struct FunctionVariable *h = hashmap_get_entry(m, (char *)a->value.string);
+// Function being scanned by plan_inlining()
+struct PlanFrame {
+  ast_index function;
+  // Next node to look at
+  ast_index node;
+  uint32_t size;
+  int has_asm;
+};
 
-  // Check if we are pointing into a struct
-  if (!h) {
-    char *dot_ps = strchr(a->value.string, '.');
-    if (!dot_ps) {
-      assert(0 && "Unknown variable");
-    }
-    *dot_ps = '\0';
-    h = hashmap_get_entry(m, (char *)a->value.string);
-    assert(!h->is_argument && "FIXME");
-    assert(a->type != variable_reference && "FIXME");
-    assert(h && "Unknown variable");
-    char *member = dot_ps + 1;
-    uint64_t stack_location = h->offset;
-    uint64_t member_offset = struct_find_member(h->type.ast_struct, member);
-    assert(a->children);
-    calculate_asm_expression(a->children, m, data_orig, fp);
-    fprintf(fp, "mov [rbp - 0x%lx], %sax\n", stack_location + member_offset,
-            matching_register_prefix(h->type.byte_size));
+void plan_inlining(ast_index a) {
+  uint32_t budget = codegen_options.inline_budget;
+  if (!budget)
     return;
-  }
+  uint32_t symbols = symbol_count();
+  ast_index *defined = defined_functions(a, symbols);
+  uint8_t *state = arena_calloc(&codegen_arena, ast.node_count, 1);
+  uint32_t *size =
+      arena_alloc(&codegen_arena, ast.node_count * sizeof(uint32_t));
+  struct PlanFrame *stack = arena_alloc(
+      &codegen_arena, ast.function_count * sizeof(struct PlanFrame));
+  inline_functions = arena_calloc(&codegen_arena, symbols, sizeof(ast_index));
+  inline_function_count = symbols;
+  asm_functions = arena_calloc(&codegen_arena, ast.function_count, 1);
 
-  assert(h && "Undefined variable.");
-  uint64_t stack = h->offset;
-  assert(a->children);
-  calculate_asm_expression(a->children, m, data_orig, fp);
-  if (!h->is_argument) {
-    fprintf(fp, "mov [rbp - 0x%lx], %sax\n", stack,
-            matching_register_prefix(h->type.byte_size));
-  } else {
-    fprintf(fp, "mov [rbp + 0x%lx], %sax\n", stack + 0x8,
-            matching_register_prefix(h->type.byte_size));
+  // Callees are sized before their callers by a depth first search, so the
+  // size of a function includes the bodies inlined into it. A call to a
+  // function that is still being scanned closes a cycle, that function is
+  // never inlined so every cycle of calls keeps at least one call.
+  for (ast_index root = a; root; root = ast_node(root)->next) {
+    if (function != ast_node(root)->type || state[root])
+      continue;
+    uint32_t count = 0;
+    state[root] = plan_visiting;
+    stack[count++] = (struct PlanFrame){.function = root, .node = root + 1};
+    for (; count > 0;) {
+      struct PlanFrame *frame = &stack[count - 1];
+      ast_index end = ast_node(frame->function)->next
+                          ? ast_node(frame->function)->next
+                          : ast.node_count;
+      for (; frame->node < end; frame->node++) {
+        struct AstNode *call = ast_node(frame->node);
+        if (function_call != call->type)
+          continue;
+        if (SYMBOL_ASM == call->call.symbol)
+          frame->has_asm = 1;
+        ast_index callee =
+            call->call.symbol < symbols ? defined[call->call.symbol] : 0;
+        if (!callee)
+          continue;
+        if (!state[callee]) {
+          // Comes back to this call once the callee has been sized
+          state[callee] = plan_visiting;
+          stack[count++] =
+              (struct PlanFrame){.function = callee, .node = callee + 1};
+          break;
+        }
+        if (state[callee] & plan_visiting)
+          state[callee] |= plan_recursive;
+        else if (inline_target(frame->function, call))
+          frame->size += size[callee];
+      }
+      if (frame->node < end)
+        continue;
+      ast_index i = frame->function;
+      struct AstFunction *f = ast_function(ast_node(i)->function.index);
+      size[i] = frame->size + end - i;
+      asm_functions[ast_node(i)->function.index] = frame->has_asm;
+      if (!(state[i] & plan_recursive) && !frame->has_asm &&
+          size[i] <= budget && has_return_value(f))
+        inline_functions[f->symbol] = i;
+      state[i] = (state[i] & ~plan_visiting) | plan_done;
+      count--;
+    }
   }
 }
 
-void compile_variable_reference_assignment(ast_t *a, HashMap *m,
-                                           struct CompiledData **data_orig,
-                                           FILE *fp) {
-  struct FunctionVariable *h = hashmap_get_entry(m, (char *)a->value.string);
-  assert(h && "Undefined variable.");
-  assert(h->type.variant == pointer && "Attempting to dereference non pointer");
-  uint64_t stack = h->offset;
-  assert(a->children);
-  calculate_asm_expression(a->children, m, data_orig, fp);
-  if (!h->is_argument) {
-    fprintf(fp, "mov rcx, [rbp - 0x%lx]\n", stack);
-  } else {
-    fprintf(fp, "mov rcx, [rbp + 0x%lx]\n", stack + 0x8);
-  }
-  fprintf(fp, "mov [rcx], rax\n");
-}
+enum { function_scanned = 1, function_kept = 2 };
 
-void compile_ast(ast_t *a, ast_t *parent, HashMap *m,
-                 struct CompiledData **data_orig, FILE *fp,
-                 size_t *stack_size) {
-  struct CompiledData *data = *data_orig;
-  uint64_t stack = 0;
-  if (!m)
-    m = hashmap_create(10);
-  if (parent && parent->args) {
-    int i = 0x8;
-    for (ast_t *a = parent->args; a; a = a->next) {
-      assert(a->type == function_argument);
-      struct FunctionVariable *h = malloc(sizeof(struct FunctionVariable));
-      *h = (struct FunctionVariable){
-          .offset = i, .is_argument = 1, a->statement_variable_type};
-      hashmap_add_entry(m, (char *)a->value.string, h, NULL, 0);
-      i += 0x8;
+void remove_unused_functions(ast_index a) {
+  uint32_t symbols = symbol_count();
+  ast_index *defined = defined_functions(a, symbols);
+  uint8_t *state = arena_calloc(&codegen_arena, ast.node_count, 1);
+  ast_index *work = arena_alloc(&codegen_arena,
+                                ast.function_count * sizeof(ast_index));
+  uint32_t count = 0;
+  for (int r = 0; r < 2 + codegen_options.export_count; r++) {
+    const char *name = 0 == r   ? "_start"
+                       : 1 == r ? "main"
+                                : codegen_options.exports[r - 2];
+    uint32_t symbol = symbol_intern(name, strlen(name));
+    if (symbol < symbols && defined[symbol] && !state[defined[symbol]]) {
+      state[defined[symbol]] = function_scanned | function_kept;
+      work[count++] = defined[symbol];
     }
   }
-  for (; a; a = a->next) {
-    switch (a->type) {
-    case struct_definition:
-      compile_struct(a, fp);
-      break;
-    case function:
-      compile_function(a, &data, fp);
-      break;
-    case if_statement:
-      compile_if_statement(a, m, &data, fp, stack_size);
-      break;
-    case for_statement:
-      compile_for_statement(a, m, &data, fp, stack_size);
-      break;
-    case function_call:
-      compile_function_call(a, m, &data, fp, 1);
-      break;
-    case return_statement:
-      compile_return_statement(a, m, &data, fp);
-      break;
-    case variable_declaration:
-      compile_variable_declaration(a, m, &data, fp, stack_size, &stack);
-      break;
-    case variable_assignment:
-      compile_variable_assignment(a, m, &data, fp);
-      break;
-    case variable_reference_assignment:
-      compile_variable_reference_assignment(a, m, &data, fp);
-      break;
-    case noop:
-      break;
-    default:
-      assert(0 && "unimplemented");
+  // Without an entry point every function may be called from elsewhere
+  if (!count)
+    return;
+
+  // Nodes are appended as they are parsed, the nodes of a function lie
+  // between its top level node and the next one. The calls in the body of an
+  // inlined function end up in its callers, so it is scanned without being
+  // kept.
+  for (; count > 0;) {
+    ast_index i = work[--count];
+    ast_index end = ast_node(i)->next ? ast_node(i)->next : ast.node_count;
+    for (ast_index n = i + 1; n < end; n++) {
+      struct AstNode *call = ast_node(n);
+      if (function_call != call->type || call->call.symbol >= symbols)
+        continue;
+      ast_index callee = defined[call->call.symbol];
+      if (!callee)
+        continue;
+      if (!inline_target(i, call))
+        state[callee] |= function_kept;
+      if (!(state[callee] & function_scanned)) {
+        state[callee] |= function_scanned;
+        work[count++] = callee;
+      }
     }
   }
-  *data_orig = data;
+  for (ast_index i = a; i; i = ast_node(i)->next) {
+    if (function == ast_node(i)->type && !(state[i] & function_kept))
+      ast_node(i)->type = noop;
+  }
 }
 
+void codegen_free(void) {
+  lower_free();
+  ir_function_free(&ir_function);
+  inline_functions = NULL;
+  inline_function_count = 0;
+  asm_functions = NULL;
+  label_count = 0;
+  arena_free(&codegen_arena);
+}
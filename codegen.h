@@ -1,8 +1,63 @@
 #ifndef CODEGEN_H
 #define CODEGEN_H
+#include <arena.h>
 #include <ast.h>
-#include <hashmap/hashmap.h>
 
-void compile_ast(ast_t *a, ast_t *parent, HashMap *m,
-                 struct CompiledData **data_orig, FILE *fp, size_t *stack_size);
+// The CompiledData list lives in codegen_arena, it has to outlive
+// compile_ast() until the data section has been written.
+extern _Thread_local struct Arena codegen_arena;
+
+struct CodegenOptions {
+  // 0 skips every optimization pass
+  int optimize;
+  // Largest function that is inlined at its call sites, in AST nodes including
+  // the calls inlined into it. 0 turns inlining off.
+  uint32_t inline_budget;
+  // Writes the IR of every function as comments in front of its code
+  int print_ir;
+  // Addresses the frame through rsp in functions that call others too, leaf
+  // functions never set up rbp when optimizing
+  int omit_frame_pointer;
+  // Passes the first six arguments in rdi, rsi, rdx, rcx, r8 and r9 like the
+  // System V ABI, so C can call the functions and be called by them. The
+  // others are pushed by the caller as without it.
+  int sysv_abi;
+  // Functions that are called from outside, in addition to _start and main
+  const char **exports;
+  int export_count;
+};
+// Set up before anything is compiled and shared by all threads.
+extern struct CodegenOptions codegen_options;
+
+// Compiles the top level items starting at a, string literals are added to
+// *data_orig.
+void compile_ast(ast_index a, struct CompiledData **data_orig, FILE *fp);
+// Picks the functions that are inlined at their call sites: those without
+// inline assembly that are not recursive and fit into the inline budget.
+// Nothing is inlined into a function with inline assembly.
+// Needs every top level item starting at a, like remove_unused_functions().
+void plan_inlining(ast_index a);
+// Function node whose body is lowered in place of call in the function node
+// caller, AST_NONE if it stays a call.
+ast_index inline_target(ast_index caller, struct AstNode *call);
+// Turns the functions that can not be reached from _start, main or an export
+// through calls into noops, and so those that are inlined at every call site.
+// Needs every top level item starting at a, so it can not be used when the
+// items are compiled one at a time. Files without any of these entry points
+// keep all their functions.
+void remove_unused_functions(ast_index a);
+// Adds a string literal to the list ending in *data_orig and returns its
+// label.
+const char *add_data(struct CompiledData **data_orig, const char *string);
+// Writes a label of l - 1 letters, unique within the unit.
+void gen_label(char *s, int l);
+// Offset of member from the start of the struct, the type of the member is
+// written to type.
+uint64_t struct_find_member(ast_index ast_struct, uint32_t member,
+                            struct BuiltinType *type);
+// Writes the data section for the list ending in data.
+void compile_data(struct CompiledData *data, FILE *fp);
+// Releases the codegen state of the current thread including codegen_arena,
+// label numbering starts over for the next unit.
+void codegen_free(void);
 #endif // CODEGEN_H
@@ -0,0 +1,446 @@
+#include <arena.h>
+#include <assert.h>
+#include <ast.h>
+#include <ir.h>
+#include <stdlib.h>
+#include <string.h>
+#include <symbol.h>
+
+static void *grow(void *p, uint32_t *capacity, size_t size) {
+  *capacity = *capacity ? *capacity * 2 : 64;
+  p = realloc(p, *capacity * size);
+  assert(p && "Out of memory");
+  return p;
+}
+
+void ir_function_reset(struct IrFunction *f, uint32_t symbol) {
+  arena_reset(&f->arena);
+  f->symbol = symbol;
+  f->arg_count = 0;
+  f->has_asm = 0;
+  f->order = NULL;
+  f->order_count = 0;
+  f->slot_count = 0;
+  // Index 0 of both pools is reserved, block 1 is the entry
+  f->instr_count = 0;
+  if (!f->instr_capacity)
+    f->instrs = grow(f->instrs, &f->instr_capacity, sizeof(struct IrInstr));
+  memset(&f->instrs[0], 0, sizeof(struct IrInstr));
+  f->instr_count = 1;
+  f->block_count = 1;
+  if (!f->block_capacity)
+    f->blocks = grow(f->blocks, &f->block_capacity, sizeof(struct IrBlock));
+  memset(&f->blocks[0], 0, sizeof(struct IrBlock));
+  ir_new_block(f);
+}
+
+void ir_function_free(struct IrFunction *f) {
+  free(f->instrs);
+  free(f->blocks);
+  free(f->slots);
+  arena_free(&f->arena);
+  memset(f, 0, sizeof(*f));
+}
+
+ir_block ir_new_block(struct IrFunction *f) {
+  if (f->block_count == f->block_capacity)
+    f->blocks = grow(f->blocks, &f->block_capacity, sizeof(struct IrBlock));
+  memset(&f->blocks[f->block_count], 0, sizeof(struct IrBlock));
+  return f->block_count++;
+}
+
+uint32_t ir_new_slot(struct IrFunction *f, uint32_t size, uint32_t alignment,
+                     int32_t argument, int scalar) {
+  if (f->slot_count == f->slot_capacity)
+    f->slots = grow(f->slots, &f->slot_capacity, sizeof(struct IrSlot));
+  f->slots[f->slot_count] = (struct IrSlot){
+      .size = size,
+      .alignment = alignment,
+      .argument = argument,
+      .scalar = scalar};
+  return f->slot_count++;
+}
+
+static ir_value new_instr(struct IrFunction *f, ir_block b, ir_op op,
+                          uint32_t op_count) {
+  if (f->instr_count == f->instr_capacity)
+    f->instrs = grow(f->instrs, &f->instr_capacity, sizeof(struct IrInstr));
+  struct IrInstr *i = &f->instrs[f->instr_count];
+  memset(i, 0, sizeof(*i));
+  i->op = op;
+  i->block = b;
+  i->op_count = op_count;
+  if (op_count)
+    i->ops = arena_calloc(&f->arena, op_count, sizeof(ir_value));
+  return f->instr_count++;
+}
+
+ir_value ir_append(struct IrFunction *f, ir_block b, ir_op op,
+                   uint32_t op_count) {
+  ir_value v = new_instr(f, b, op, op_count);
+  struct IrBlock *block = &f->blocks[b];
+  f->instrs[v].prev = block->last;
+  if (block->last)
+    f->instrs[block->last].next = v;
+  else
+    block->first = v;
+  block->last = v;
+  return v;
+}
+
+static void link_before(struct IrFunction *f, ir_value v, ir_value before) {
+  ir_block b = f->instrs[before].block;
+  ir_value prev = f->instrs[before].prev;
+  f->instrs[v].block = b;
+  f->instrs[v].prev = prev;
+  f->instrs[v].next = before;
+  f->instrs[before].prev = v;
+  if (prev)
+    f->instrs[prev].next = v;
+  else
+    f->blocks[b].first = v;
+}
+
+ir_value ir_insert_before(struct IrFunction *f, ir_value before, ir_op op,
+                          uint32_t op_count) {
+  ir_value v = new_instr(f, f->instrs[before].block, op, op_count);
+  link_before(f, v, before);
+  return v;
+}
+
+ir_value ir_prepend(struct IrFunction *f, ir_block b, ir_op op,
+                    uint32_t op_count) {
+  if (!f->blocks[b].first)
+    return ir_append(f, b, op, op_count);
+  return ir_insert_before(f, f->blocks[b].first, op, op_count);
+}
+
+void ir_remove(struct IrFunction *f, ir_value v) {
+  struct IrInstr *i = &f->instrs[v];
+  struct IrBlock *block = &f->blocks[i->block];
+  if (i->prev)
+    f->instrs[i->prev].next = i->next;
+  else
+    block->first = i->next;
+  if (i->next)
+    f->instrs[i->next].prev = i->prev;
+  else
+    block->last = i->prev;
+  i->block = IR_NONE;
+  i->prev = i->next = IR_NONE;
+}
+
+void ir_move_before(struct IrFunction *f, ir_value v, ir_value before) {
+  ir_remove(f, v);
+  link_before(f, v, before);
+}
+
+ir_block ir_move_instructions(struct IrFunction *f, ir_block b) {
+  ir_block n = ir_new_block(f);
+  f->blocks[n].first = f->blocks[b].first;
+  f->blocks[n].last = f->blocks[b].last;
+  for (ir_value v = f->blocks[n].first; v; v = f->instrs[v].next)
+    f->instrs[v].block = n;
+  f->blocks[b].first = f->blocks[b].last = IR_NONE;
+  ir_instr(f, ir_append(f, b, ir_jump, 0))->target[0] = n;
+  return n;
+}
+
+int ir_successors(struct IrFunction *f, ir_block b, ir_block s[2]) {
+  ir_value t = ir_terminator(f, b);
+  assert(t && "Block without terminator");
+  struct IrInstr *i = &f->instrs[t];
+  switch (i->op) {
+  case ir_jump:
+    s[0] = i->target[0];
+    return 1;
+  case ir_branch:
+    s[0] = i->target[0];
+    s[1] = i->target[1];
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+static void add_pred(struct IrFunction *f, ir_block b, ir_block pred) {
+  struct IrBlock *block = &f->blocks[b];
+  if (block->pred_count == block->pred_capacity) {
+    uint32_t capacity = block->pred_capacity ? block->pred_capacity * 2 : 2;
+    ir_block *preds = arena_alloc(&f->arena, capacity * sizeof(ir_block));
+    if (block->pred_count)
+      memcpy(preds, block->preds, block->pred_count * sizeof(ir_block));
+    block->preds = preds;
+    block->pred_capacity = capacity;
+  }
+  block->preds[block->pred_count++] = pred;
+}
+
+static int is_pred(struct IrFunction *f, ir_block b, ir_block pred) {
+  struct IrBlock *block = &f->blocks[b];
+  for (uint32_t p = 0; p < block->pred_count; p++) {
+    if (block->preds[p] == pred)
+      return 1;
+  }
+  return 0;
+}
+
+void ir_cfg(struct IrFunction *f) {
+  for (ir_block b = 1; b < f->block_count; b++) {
+    f->blocks[b].pred_count = 0;
+    f->blocks[b].order = 0;
+  }
+  // Depth first search with an explicit stack of blocks and the number of
+  // their successors visited so far, blocks are numbered in postorder first.
+  struct {
+    ir_block block;
+    int successor;
+  } *stack = arena_alloc(&f->arena, f->block_count * sizeof(*stack));
+  ir_block *postorder =
+      arena_alloc(&f->arena, f->block_count * sizeof(ir_block));
+  uint32_t count = 0;
+  uint32_t depth = 0;
+  stack[depth].block = 1;
+  stack[depth++].successor = 0;
+  // Marks blocks on the stack or finished
+  f->blocks[1].order = 1;
+  for (; depth > 0;) {
+    ir_block s[2];
+    ir_block b = stack[depth - 1].block;
+    int n = ir_successors(f, b, s);
+    if (stack[depth - 1].successor < n) {
+      ir_block next = s[stack[depth - 1].successor++];
+      if (!f->blocks[next].order) {
+        f->blocks[next].order = 1;
+        stack[depth].block = next;
+        stack[depth++].successor = 0;
+      }
+      continue;
+    }
+    postorder[count++] = b;
+    depth--;
+  }
+
+  f->order = arena_alloc(&f->arena, count * sizeof(ir_block));
+  f->order_count = count;
+  for (uint32_t i = 0; i < count; i++) {
+    ir_block b = postorder[count - 1 - i];
+    f->order[i] = b;
+    f->blocks[b].order = i + 1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    ir_block s[2];
+    int n = ir_successors(f, f->order[i], s);
+    for (int j = 0; j < n; j++)
+      add_pred(f, s[j], f->order[i]);
+  }
+
+  for (ir_block b = 1; b < f->block_count; b++) {
+    if (!f->blocks[b].order) {
+      for (ir_value v = f->blocks[b].first; v;) {
+        ir_value next = f->instrs[v].next;
+        ir_remove(f, v);
+        v = next;
+      }
+      continue;
+    }
+    for (ir_value v = f->blocks[b].first; v && f->instrs[v].op == ir_phi;
+         v = f->instrs[v].next) {
+      struct IrInstr *phi = &f->instrs[v];
+      uint32_t kept = 0;
+      for (uint32_t o = 0; o < phi->op_count; o++) {
+        if (!is_pred(f, b, phi->incoming[o]))
+          continue;
+        phi->ops[kept] = phi->ops[o];
+        phi->incoming[kept++] = phi->incoming[o];
+      }
+      phi->op_count = kept;
+    }
+  }
+}
+
+static ir_block intersect(struct IrFunction *f, ir_block a, ir_block b) {
+  for (; a != b;) {
+    for (; f->blocks[a].order > f->blocks[b].order;)
+      a = f->blocks[a].idom;
+    for (; f->blocks[b].order > f->blocks[a].order;)
+      b = f->blocks[b].idom;
+  }
+  return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+void ir_dominators(struct IrFunction *f) {
+  for (ir_block b = 1; b < f->block_count; b++)
+    f->blocks[b].idom = IR_NONE;
+  f->blocks[1].idom = 1;
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (uint32_t i = 1; i < f->order_count; i++) {
+      ir_block b = f->order[i];
+      struct IrBlock *block = &f->blocks[b];
+      ir_block idom = IR_NONE;
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        ir_block pred = block->preds[p];
+        if (!f->blocks[pred].idom)
+          continue;
+        idom = idom ? intersect(f, pred, idom) : pred;
+      }
+      if (idom != block->idom) {
+        block->idom = idom;
+        changed = 1;
+      }
+    }
+  }
+  f->blocks[1].idom = IR_NONE;
+}
+
+void ir_split_edges(struct IrFunction *f) {
+  int split = 0;
+  for (uint32_t i = 0; i < f->order_count; i++) {
+    ir_block b = f->order[i];
+    ir_value first = f->blocks[b].first;
+    if (!first || f->instrs[first].op != ir_phi)
+      continue;
+    for (uint32_t p = 0; p < f->blocks[b].pred_count; p++) {
+      ir_block pred = f->blocks[b].preds[p];
+      ir_value t = ir_terminator(f, pred);
+      if (f->instrs[t].op != ir_branch)
+        continue;
+      ir_block n = ir_new_block(f);
+      ir_value jump = ir_append(f, n, ir_jump, 0);
+      f->instrs[jump].target[0] = b;
+      for (int s = 0; s < 2; s++) {
+        if (f->instrs[t].target[s] == b)
+          f->instrs[t].target[s] = n;
+      }
+      for (ir_value v = first; v && f->instrs[v].op == ir_phi;
+           v = f->instrs[v].next) {
+        struct IrInstr *phi = &f->instrs[v];
+        for (uint32_t o = 0; o < phi->op_count; o++) {
+          if (phi->incoming[o] == pred)
+            phi->incoming[o] = n;
+        }
+      }
+      split = 1;
+    }
+  }
+  if (split)
+    ir_cfg(f);
+}
+
+struct IrUsers ir_users(struct IrFunction *f) {
+  struct IrUsers u;
+  u.start = arena_calloc(&f->arena, f->instr_count + 1, sizeof(uint32_t));
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      for (uint32_t o = 0; o < i->op_count; o++)
+        u.start[i->ops[o] + 1]++;
+    }
+  }
+  for (uint32_t v = 1; v <= f->instr_count; v++)
+    u.start[v] += u.start[v - 1];
+  u.users = arena_alloc(&f->arena,
+                        (u.start[f->instr_count] + 1) * sizeof(ir_value));
+  uint32_t *fill = arena_alloc(&f->arena, f->instr_count * sizeof(uint32_t));
+  memcpy(fill, u.start, f->instr_count * sizeof(uint32_t));
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      for (uint32_t o = 0; o < i->op_count; o++)
+        u.users[fill[i->ops[o]]++] = v;
+    }
+  }
+  return u;
+}
+
+ir_value ir_resolve(ir_value *map, ir_value v) {
+  ir_value r = v;
+  for (; map[r] && map[r] != r;)
+    r = map[r];
+  // Shorten the path for the next lookup
+  for (; map[v] && map[v] != v;) {
+    ir_value next = map[v];
+    map[v] = r;
+    v = next;
+  }
+  return r;
+}
+
+void ir_replace_uses(struct IrFunction *f, ir_value *map) {
+  for (uint32_t i = 0; i < f->order_count; i++) {
+    for (ir_value v = f->blocks[f->order[i]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *instr = &f->instrs[v];
+      for (uint32_t o = 0; o < instr->op_count; o++)
+        instr->ops[o] = ir_resolve(map, instr->ops[o]);
+    }
+  }
+}
+
+static const char *op_names[] = {
+    [ir_const] = "const",   [ir_undef] = "undef",   [ir_arg] = "arg",
+    [ir_slot] = "slot",     [ir_string] = "string", [ir_load] = "load",
+    [ir_store] = "store",   [ir_binary] = "binary", [ir_zext] = "zext",
+    [ir_call] = "call",     [ir_asm] = "asm",       [ir_phi] = "phi",
+    [ir_jump] = "jump",     [ir_branch] = "branch", [ir_ret] = "ret",
+};
+
+static const char *operator_names[] = {
+    [operator_add] = "add", [operator_sub] = "sub", [operator_mul] = "mul",
+    [operator_div] = "div", [operator_mod] = "mod", [operator_shl] = "shl",
+    [operator_shr] = "shr", [operator_and] = "and", [operator_or] = "or",
+    [operator_xor] = "xor", [operator_eq] = "eq",   [operator_ne] = "ne",
+    [operator_lt] = "lt",   [operator_le] = "le",   [operator_gt] = "gt",
+    [operator_ge] = "ge",
+};
+
+void ir_print(struct IrFunction *f, FILE *fp) {
+  fprintf(fp, "; %s\n", symbol_name(f->symbol));
+  for (uint32_t i = 0; i < f->order_count; i++) {
+    ir_block b = f->order[i];
+    struct IrBlock *block = &f->blocks[b];
+    fprintf(fp, "; b%u: idom b%u preds", b, block->idom);
+    for (uint32_t p = 0; p < block->pred_count; p++)
+      fprintf(fp, " b%u", block->preds[p]);
+    fprintf(fp, "\n");
+    for (ir_value v = block->first; v; v = f->instrs[v].next) {
+      struct IrInstr *instr = &f->instrs[v];
+      fprintf(fp, ";   v%u = %s", v,
+              instr->op == ir_binary ? operator_names[instr->operator]
+                                     : op_names[instr->op]);
+      switch (instr->op) {
+      case ir_const:
+      case ir_slot:
+      case ir_arg:
+        fprintf(fp, " %ld", instr->imm);
+        break;
+      case ir_call:
+        fprintf(fp, " %s", symbol_name(instr->imm));
+        break;
+      case ir_string:
+        fprintf(fp, " %s", instr->name);
+        break;
+      case ir_load:
+      case ir_store:
+        fprintf(fp, "%u [%+ld]", instr->size * 8, instr->imm);
+        break;
+      default:
+        break;
+      }
+      for (uint32_t o = 0; o < instr->op_count; o++) {
+        fprintf(fp, "%s v%u", o ? "," : "", instr->ops[o]);
+        if (instr->op == ir_phi)
+          fprintf(fp, " b%u", instr->incoming[o]);
+      }
+      if (instr->op == ir_jump)
+        fprintf(fp, " b%u", instr->target[0]);
+      if (instr->op == ir_branch)
+        fprintf(fp, " b%u, b%u", instr->target[0], instr->target[1]);
+      fprintf(fp, "\n");
+    }
+  }
+}
@@ -0,0 +1,183 @@
+#ifndef IR_H
+#define IR_H
+#include <arena.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Functions are lowered from the AST to an intermediate representation in
+// SSA form before machine code is emitted. A function is a pool of basic
+// blocks and a pool of instructions, every instruction defines at most one
+// value that is named by its index. Instructions of a block are a doubly
+// linked list, so passes can insert and remove them without moving others.
+
+// Indices into the pools of struct IrFunction, 0 means "none".
+typedef uint32_t ir_value;
+typedef uint32_t ir_block;
+#define IR_NONE 0
+
+typedef enum {
+  // Integer constant imm
+  ir_const,
+  // Value that is never defined, e.g. a local read before it is written
+  ir_undef,
+  // Incoming argument imm read with size bytes
+  ir_arg,
+  // Address of stack slot imm
+  ir_slot,
+  // Address of a string literal in the data section, see name
+  ir_string,
+  // size bytes at ops[0] + imm, zero extended
+  ir_load,
+  // Stores size bytes of ops[1] at ops[0] + imm
+  ir_store,
+  // ops[0] operator ops[1]
+  ir_binary,
+  // Lower 32 bits of ops[0]
+  ir_zext,
+  // Calls symbol imm with the arguments ops
+  ir_call,
+  // Inline assembly, AST string imm
+  ir_asm,
+  // ops[i] when coming from incoming[i]
+  ir_phi,
+  // Terminators, every block ends with exactly one of them
+  ir_jump,
+  // target[0] if ops[0] is not zero, target[1] otherwise
+  ir_branch,
+  // Returns ops[0], or whatever is in rax if there are no operands
+  ir_ret,
+} ir_op;
+
+struct IrInstr {
+  uint8_t op;
+  // ir_binary, an ast_operator
+  uint8_t operator;
+  // Bytes accessed by ir_arg, ir_load and ir_store
+  uint8_t size;
+  // IR_NONE once the instruction has been removed
+  ir_block block;
+  ir_value prev;
+  ir_value next;
+  uint32_t op_count;
+  ir_value *ops;
+  int64_t imm;
+  union {
+    // ir_jump, ir_branch
+    ir_block target[2];
+    // ir_phi, the predecessor of every operand
+    ir_block *incoming;
+    // ir_string, label of the literal
+    const char *name;
+  };
+};
+
+struct IrBlock {
+  ir_value first;
+  ir_value last;
+  ir_block *preds;
+  uint32_t pred_count;
+  uint32_t pred_capacity;
+  // Immediate dominator, IR_NONE for the entry and unreachable blocks
+  ir_block idom;
+  // Position in reverse postorder starting at 1, 0 if unreachable
+  uint32_t order;
+};
+
+// Storage on the stack for a variable. Arguments live in the slots the
+// caller pushed them to.
+struct IrSlot {
+  uint32_t size;
+  uint32_t alignment;
+  // Incoming argument index, -1 for locals
+  int32_t argument;
+  // Only accessed through loads and stores of its whole size
+  uint8_t scalar;
+  // Offset from rbp, assigned by the backend
+  int32_t offset;
+};
+
+struct IrFunction {
+  uint32_t symbol;
+  uint32_t arg_count;
+  // Inline assembly may access any slot behind the compiler's back
+  int has_asm;
+  struct IrInstr *instrs;
+  uint32_t instr_count;
+  uint32_t instr_capacity;
+  struct IrBlock *blocks;
+  uint32_t block_count;
+  uint32_t block_capacity;
+  struct IrSlot *slots;
+  uint32_t slot_count;
+  uint32_t slot_capacity;
+  // Reachable blocks in reverse postorder, as computed by ir_cfg()
+  ir_block *order;
+  uint32_t order_count;
+  // Operand arrays and everything else that lives as long as the function
+  struct Arena arena;
+};
+
+// Empties f for the next function, keeping its memory.
+void ir_function_reset(struct IrFunction *f, uint32_t symbol);
+void ir_function_free(struct IrFunction *f);
+
+static inline struct IrInstr *ir_instr(struct IrFunction *f, ir_value v) {
+  return &f->instrs[v];
+}
+
+static inline struct IrBlock *ir_block_of(struct IrFunction *f, ir_block b) {
+  return &f->blocks[b];
+}
+
+ir_block ir_new_block(struct IrFunction *f);
+uint32_t ir_new_slot(struct IrFunction *f, uint32_t size, uint32_t alignment,
+                     int32_t argument, int scalar);
+// New instruction at the end of b, with room for op_count operands.
+ir_value ir_append(struct IrFunction *f, ir_block b, ir_op op,
+                   uint32_t op_count);
+// New instruction in front of before.
+ir_value ir_insert_before(struct IrFunction *f, ir_value before, ir_op op,
+                          uint32_t op_count);
+// New instruction at the start of b.
+ir_value ir_prepend(struct IrFunction *f, ir_block b, ir_op op,
+                    uint32_t op_count);
+void ir_remove(struct IrFunction *f, ir_value v);
+// Moves v in front of before, which may be in another block.
+void ir_move_before(struct IrFunction *f, ir_value v, ir_value before);
+// Moves every instruction of b to a new block that b jumps to, and returns
+// the new block. Phis of the successors still name b as their predecessor.
+ir_block ir_move_instructions(struct IrFunction *f, ir_block b);
+static inline ir_value ir_terminator(struct IrFunction *f, ir_block b) {
+  ir_value v = f->blocks[b].last;
+  return v && f->instrs[v].op >= ir_jump ? v : IR_NONE;
+}
+// Successors of b written to s, returns how many there are.
+int ir_successors(struct IrFunction *f, ir_block b, ir_block s[2]);
+
+// Recomputes predecessors and the reverse postorder, and removes blocks that
+// can not be reached from the entry along with their phi operands.
+void ir_cfg(struct IrFunction *f);
+// Computes the immediate dominators, needs ir_cfg().
+void ir_dominators(struct IrFunction *f);
+// Puts a block on every edge from a block with several successors to a block
+// with phis, so the moves of the phis have a block of their own.
+void ir_split_edges(struct IrFunction *f);
+
+// Instructions using every value, once per operand. The users of v are
+// users[start[v]] .. users[start[v + 1] - 1].
+struct IrUsers {
+  uint32_t *start;
+  ir_value *users;
+};
+
+// Collects the users in the reachable blocks, needs ir_cfg().
+struct IrUsers ir_users(struct IrFunction *f);
+
+// Follows replacements through map until a value that is not replaced.
+ir_value ir_resolve(ir_value *map, ir_value v);
+// Replaces every operand v by ir_resolve(map, v).
+void ir_replace_uses(struct IrFunction *f, ir_value *map);
+
+// Writes f as assembly comments.
+void ir_print(struct IrFunction *f, FILE *fp);
+#endif // IR_H
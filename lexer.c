@@ -1,249 +1,698 @@
+#include <arena.h>
 #include <assert.h>
-#include <ctype.h>
 #include <lexer.h>
+#include <pthread.h>
+#include <scan.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <symbol.h>
+#include <sys/mman.h>
 
-struct Iterator {
+_Thread_local struct Arena lexer_arena;
+
+#define LEXER_HUGE_PAGE ((uintptr_t)2 << 20)
+
+struct Lexer {
   const char *ptr;
-  uint32_t col;
+  const char *end;
+  const char *line_start;
   uint32_t line;
-  uint32_t last_col;
-  uint32_t last_line;
-  int is_eof;
+  struct SymbolTable *symbols;
+  // Decoded string literals
+  struct Arena *arena;
+  // Chunks of lexer_parallel() might start inside a string literal, so
+  // instead of reporting errors they stop and leave it to the fix-up pass to
+  // decide whether the error is real.
+  int is_chunk;
+  // Opening quote of a literal that is not terminated before the end
+  const char *open_string;
+  int error;
 };
 
-char next(struct Iterator *i) {
-  char c = *(i->ptr);
-  if ('\0' == c) {
-    i->is_eof = 1;
-    return 0;
+// What a token starting with a given byte can be. Bytes that always form a
+// token on their own map directly to their token type.
+typedef enum {
+  char_invalid,
+  char_space,
+  char_alpha,
+  char_digit,
+  char_quote,
+  char_operator,
+  char_single,
+} char_class_enum;
+
+struct CharClass {
+  uint8_t class;
+  uint8_t type;
+  // char_operator, the token of the byte followed by '='
+  uint8_t equals_type;
+  // char_operator, the token of the byte twice or end if there is none
+  uint8_t double_type;
+};
+
+static struct CharClass char_table[256];
+
+static void set_single(unsigned char c, token_enum type) {
+  char_table[c].class = char_single;
+  char_table[c].type = type;
+}
+
+// A byte that forms type on its own, equals_type when followed by '=' and
+// double_type when followed by itself. type is end if the byte is only a
+// token together with the '=', double_type if the byte can not be doubled.
+static void set_operator(unsigned char c, token_enum type,
+                         token_enum equals_type, token_enum double_type) {
+  char_table[c].class = char_operator;
+  char_table[c].type = type;
+  char_table[c].equals_type = equals_type;
+  char_table[c].double_type = double_type;
+}
+
+static void init_char_table(void) {
+  char_table[' '].class = char_space;
+  for (int c = '\t'; c <= '\r'; c++)
+    char_table[c].class = char_space;
+  for (int c = 'a'; c <= 'z'; c++)
+    char_table[c].class = char_alpha;
+  for (int c = 'A'; c <= 'Z'; c++)
+    char_table[c].class = char_alpha;
+  char_table['_'].class = char_alpha;
+  for (int c = '0'; c <= '9'; c++)
+    char_table[c].class = char_digit;
+  char_table['"'].class = char_quote;
+  set_operator('=', equals, equal, end);
+  set_operator('!', end, not_equal, end);
+  set_operator('<', less, less_equal, shift_left);
+  set_operator('>', greater, greater_equal, shift_right);
+  set_single('(', openparen);
+  set_single(')', closeparen);
+  set_single('{', openbracket);
+  set_single('}', closebracket);
+  set_single(';', semicolon);
+  set_single(',', comma);
+  set_single('&', ampersand);
+  set_single('*', star);
+  set_single('/', slash);
+  set_single('%', percent);
+  set_single('|', vertical_bar);
+  set_single('^', caret);
+  set_single('+', plus);
+  set_single('-', minus);
+  set_single('.', dot);
+}
+
+static void lexer_init(void) {
+  init_char_table();
+  scan_init();
+}
+
+struct Keyword {
+  const char *name;
+  size_t length;
+  token_enum type;
+};
+
+// Perfect hash over the keywords and builtin type names, every keyword has a
+// slot of its own so a lookup needs at most one comparison. The table has to
+// be recomputed when a keyword is added.
+#define KEYWORD_HASH(s, l) (((l) + (s)[0] + (s)[(l)-1]) & 7)
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
+
+static const struct Keyword keywords[8] = {
+    [1] = {"if", 2, keyword_if},         [2] = {"u32", 3, type_u32},
+    [3] = {"for", 3, keyword_for},       [4] = {"u64", 3, type_u64},
+    [5] = {"struct", 6, keyword_struct}, [6] = {"return", 6, keyword_return},
+    [7] = {"u0", 2, type_u0},
+};
+
+static token_enum classify_identifier(struct Lexer *lexer, const char *s,
+                                      size_t l, uint32_t *symbol) {
+  if (KEYWORD_MIN_LENGTH <= l && l <= KEYWORD_MAX_LENGTH) {
+    const struct Keyword *k = &keywords[KEYWORD_HASH(s, l)];
+    if (k->length == l && 0 == memcmp(k->name, s, l))
+      return k->type;
   }
-  if ('\n' == c) {
-    i->col = 0;
-    i->line++;
-  } else {
-    i->col++;
+  *symbol = symbol_table_intern(lexer->symbols, s, l);
+  return alpha;
+}
+
+// Asks for transparent huge pages on the part of a large column that is
+// covered by whole huge pages, a token array of a big input otherwise takes a
+// page fault every few hundred tokens.
+static void *column_realloc(void *p, size_t size) {
+  p = realloc(p, size);
+#ifdef MADV_HUGEPAGE
+  if (p && size >= 2 * LEXER_HUGE_PAGE) {
+    uintptr_t from = ((uintptr_t)p + LEXER_HUGE_PAGE - 1) & -LEXER_HUGE_PAGE;
+    uintptr_t to = ((uintptr_t)p + size) & -LEXER_HUGE_PAGE;
+    (void)madvise((void *)from, to - from, MADV_HUGEPAGE);
   }
-  i->ptr++;
-  return c;
+#endif
+  return p;
 }
 
-char peek(struct Iterator *i, int n) {
-  char c = *(i->ptr + n);
-  return c;
+static void token_array_reserve(struct TokenArray *tokens, size_t n) {
+  tokens->capacity = n;
+  tokens->type = column_realloc(tokens->type, n * sizeof(uint8_t));
+  tokens->offset = column_realloc(tokens->offset, n * sizeof(uint64_t));
+  tokens->line = column_realloc(tokens->line, n * sizeof(uint32_t));
+  tokens->data = column_realloc(tokens->data, n * sizeof(uint32_t));
+  assert(tokens->type && tokens->offset && tokens->line && tokens->data &&
+         "Out of memory");
 }
 
-void skip_whitespace(struct Iterator *i) {
-  char c;
-  for (; (c = peek(i, 0)); (void)next(i)) {
-    if (!isspace(c))
-      break;
-    i->last_col++;
+static void push_token(struct TokenArray *tokens, token_enum type,
+                       const char *start, uint32_t line, uint32_t data) {
+  if (tokens->count == tokens->capacity)
+    token_array_reserve(tokens, tokens->capacity * 2);
+  size_t i = tokens->count++;
+  tokens->type[i] = type;
+  tokens->offset[i] = start - tokens->source;
+  tokens->line[i] = line;
+  tokens->data[i] = data;
+}
+
+static uint32_t push_string(struct TokenArray *tokens, const char *s,
+                            size_t length) {
+  if (tokens->string_count == tokens->string_capacity) {
+    tokens->string_capacity =
+        tokens->string_capacity ? tokens->string_capacity * 2 : 64;
+    tokens->strings =
+        realloc(tokens->strings,
+                tokens->string_capacity * sizeof(struct TokenString));
+    assert(tokens->strings && "Out of memory");
   }
+  tokens->strings[tokens->string_count] =
+      (struct TokenString){.string = s, .length = length};
+  return tokens->string_count++;
 }
 
-int lexer_isalpha(char c) { return isalpha(c) || c == '_'; }
+static int is_identifier_byte(char c) {
+  uint8_t class = char_table[(unsigned char)c].class;
+  return char_alpha == class || char_digit == class;
+}
 
-int tokenize_char(struct Iterator *iter, token_t *t) {
-  char c;
-  switch ((c = peek(iter, 0))) {
-  case '(':
-    t->type = openparen;
-    break;
-  case ')':
-    t->type = closeparen;
-    break;
-  case '{':
-    t->type = openbracket;
-    break;
-  case '}':
-    t->type = closebracket;
-    break;
-  case '=':
-    t->type = equals;
-    break;
-  case ';':
-    t->type = semicolon;
-    break;
-  case ',':
-    t->type = comma;
-    break;
-  case '&':
-    t->type = ampersand;
-    break;
-  case '*':
-    t->type = star;
-    break;
-  case '+':
-    t->type = plus;
-    break;
-  case '-':
-    t->type = minus;
-    break;
-  case '.':
-    t->type = dot;
-    break;
-  case '\0':
-    t->type = end;
-    break;
+// Most identifiers and numbers are a few bytes long, they are scanned here
+// and only longer ones are handed to the scanners.
+#define LEXER_SHORT_RUN 16
+
+static const char *scan_identifier_short(const char *p, const char *end) {
+  const char *stop = end - p > LEXER_SHORT_RUN ? p + LEXER_SHORT_RUN : end;
+  for (; p < stop && is_identifier_byte(*p); p++)
+    ;
+  return p == stop ? scan_identifier(p, end) : p;
+}
+
+static const char *scan_digits_short(const char *p, const char *end) {
+  const char *stop = end - p > LEXER_SHORT_RUN ? p + LEXER_SHORT_RUN : end;
+  for (; p < stop && char_digit == char_table[(unsigned char)*p].class; p++)
+    ;
+  return p == stop ? scan_digits(p, end) : p;
+}
+
+// Skips whitespace and comments, newlines are counted in bulk by the
+// scanners. Tokens are mostly separated by a single space or none at all,
+// which is handled without calling them.
+static void skip_whitespace(struct Lexer *l) {
+  for (;;) {
+    if (l->ptr < l->end && ' ' == *l->ptr)
+      l->ptr++;
+    if (l->ptr < l->end &&
+        char_space == char_table[(unsigned char)*l->ptr].class)
+      l->ptr = scan_whitespace(l->ptr, l->end, &l->line, &l->line_start);
+    if (l->end - l->ptr < 2 || '/' != l->ptr[0] || '/' != l->ptr[1])
+      return;
+    const char *nl = memchr(l->ptr, '\n', l->end - l->ptr);
+    if (!nl) {
+      l->ptr = l->end;
+      return;
+    }
+    l->line++;
+    l->ptr = l->line_start = nl + 1;
+  }
+}
+
+// Returns -1 for unknown escape sequences
+int decode_escape(char c) {
+  switch (c) {
+  case 'n':
+    return '\n';
+  case 't':
+    return '\t';
+  case '\\':
+    return '\\';
+  case '0':
+    return '\0';
   default:
-    return 0;
-    break;
+    return -1;
   }
-  (void)next(iter);
-  t->next = NULL;
-  t->string_rep = calloc(sizeof(char), 2);
-  t->string_rep[0] = c;
-  return 1;
 }
 
-int tokenize_number(struct Iterator *iter, token_t *t) {
-  if (!isdigit(peek(iter, 0)))
+// Sets *index to the index of the literal in tokens->strings. Returns 0 if
+// the literal is not terminated or contains an unknown escape sequence,
+// which only happens for chunks.
+static int tokenize_string(struct Lexer *l, struct TokenArray *tokens,
+                           uint32_t *index) {
+  const char *start = l->ptr + 1;
+  // '\"' is not a valid escape sequence so the first quote always ends the
+  // literal.
+  const char *end = memchr(start, '"', l->end - start);
+  if (!end && l->is_chunk) {
+    l->open_string = l->ptr;
     return 0;
-  t->type = number;
-  t->next = NULL;
-  t->string_rep = calloc(sizeof(char), 256);
-  int i;
-  char c;
-  for (i = 0; (c = peek(iter, 0)); i++) {
-    if (!isdigit(c))
-      break;
-    (void)next(iter);
-    t->string_rep[i] = c;
   }
-  t->string_rep[i] = '\0';
+  assert(end && "Unterminated string");
+  if (!memchr(start, '\\', end - start)) {
+    *index = push_string(tokens, start, end - start);
+  } else {
+    // Only literals containing escape sequences need a copy, the decoded
+    // string is never longer than the source.
+    char *decoded = arena_alloc(l->arena, end - start);
+    size_t length = 0;
+    for (const char *p = start; p < end; p++) {
+      if ('\\' != *p) {
+        decoded[length++] = *p;
+        continue;
+      }
+      int c = decode_escape(*(++p));
+      if (-1 == c && l->is_chunk) {
+        l->error = 1;
+        return 0;
+      }
+      assert(-1 != c && "Unknown escape sequence");
+      decoded[length++] = c;
+    }
+    *index = push_string(tokens, decoded, length);
+  }
+  scan_newlines(start, end, &l->line, &l->line_start);
+  l->ptr = end + 1;
   return 1;
 }
 
-int tokenize_compare(struct Iterator *iter, token_t *t) {
-  if (peek(iter, 0) != '=' || peek(iter, 1) != '=')
-    return 0;
-  t->type = equal;
-  t->next = NULL;
-  t->string_rep = malloc(sizeof(char[3]));
-  strcpy(t->string_rep, "==");
-  (void)next(iter);
-  (void)next(iter);
-  return 1;
+static void unknown_token(struct Lexer *l) {
+  if (l->is_chunk) {
+    l->error = 1;
+    return;
+  }
+  size_t rest = l->end - l->ptr;
+  printf("Rest: %.*s\n", (int)(rest > 80 ? 80 : rest), l->ptr);
+  assert(0 && "Unknown token");
 }
 
-int tokenize_string(struct Iterator *iter, token_t *t) {
-  if ('"' != peek(iter, 0))
+// Returns 0 once the end of the input has been reached.
+static int create_token(struct Lexer *l, struct TokenArray *tokens) {
+  skip_whitespace(l);
+  const char *start = l->ptr;
+  uint32_t line = l->line;
+  if (start >= l->end || '\0' == *start)
     return 0;
-  (void)next(iter);
-  t->type = lexer_string;
-  t->next = NULL;
-  t->string_rep = calloc(sizeof(char), 256);
-  int i;
-  char c;
-  for (i = 0; (c = peek(iter, 0)); i++) {
-    if ('"' == c)
-      break;
-    (void)next(iter);
-    if ('\\' == c) {
-      char b = next(iter);
-      assert(!iter->is_eof);
-      switch (b) {
-      case 'n':
-        c = '\n';
-        break;
-      case 't':
-        c = '\t';
-        break;
-      case '\\':
-        c = '\\';
-        break;
-      case '0':
-        c = '\0';
-        break;
-      default:
-        assert(0);
-        break;
-      }
+  token_enum type;
+  uint32_t data = 0;
+  struct CharClass c = char_table[(unsigned char)*start];
+  switch (c.class) {
+  case char_alpha:
+    l->ptr = scan_identifier_short(start + 1, l->end);
+    type = classify_identifier(l, start, l->ptr - start, &data);
+    break;
+  case char_digit:
+    type = number;
+    l->ptr = scan_digits_short(start + 1, l->end);
+    break;
+  case char_quote:
+    type = lexer_string;
+    if (!tokenize_string(l, tokens, &data))
+      return 0;
+    break;
+  case char_operator:
+    if (l->end - start >= 2 && '=' == start[1]) {
+      type = c.equals_type;
+      l->ptr = start + 2;
+    } else if (l->end - start >= 2 && start[0] == start[1] &&
+               c.double_type != end) {
+      type = c.double_type;
+      l->ptr = start + 2;
+    } else if (c.type != end) {
+      type = c.type;
+      l->ptr = start + 1;
+    } else {
+      unknown_token(l);
+      return 0;
     }
-    t->string_rep[i] = c;
+    break;
+  case char_single:
+    type = c.type;
+    l->ptr = start + 1;
+    break;
+  default:
+    unknown_token(l);
+    return 0;
   }
-  t->string_rep[i] = '\0';
-  (void)next(iter);
+  push_token(tokens, type, start, line, data);
   return 1;
 }
 
-int tokenize_alpha(struct Iterator *iter, token_t *t) {
-  if (!lexer_isalpha(peek(iter, 0)))
-    return 0;
+static pthread_once_t lexer_once = PTHREAD_ONCE_INIT;
+
+// The character table is shared by all threads, the symbol table belongs to
+// the calling thread.
+static void lexer_init_once(void) {
+  pthread_once(&lexer_once, lexer_init);
+  symbol_table_init();
+}
+
+void lexer(const char *s, size_t length, struct TokenArray *tokens) {
+  lexer_init_once();
+  struct Lexer l = {
+      .ptr = s,
+      .end = s + length,
+      .line_start = s,
+      .line = 0,
+      .symbols = &symbol_table,
+      .arena = &lexer_arena,
+  };
+  *tokens = (struct TokenArray){
+      .source = s,
+      .source_length = length,
+  };
+  // Dense code has a token every two bytes or so. Regrowing copies every
+  // column while pages that are reserved but never written cost nothing.
+  token_array_reserve(tokens, length / 2 + TOKEN_LOOKAHEAD);
+  for (; create_token(&l, tokens);)
+    ;
+  for (int i = 0; i < TOKEN_LOOKAHEAD; i++)
+    push_token(tokens, end, l.ptr, l.line, 0);
+}
+
+// Enough for the tokens of most functions without regrowing
+#define LEXER_STREAM_TOKENS 4096
+
+void lexer_stream_init(struct LexerStream *s, const char *source,
+                       size_t length) {
+  lexer_init_once();
+  *s = (struct LexerStream){
+      .ptr = source,
+      .end = source + length,
+      .line_start = source,
+      .line = 0,
+      .tokens =
+          {
+              .source = source,
+              .source_length = length,
+          },
+  };
+  token_array_reserve(&s->tokens, LEXER_STREAM_TOKENS);
+}
 
-  t->type = alpha;
-  t->next = NULL;
-  t->string_rep = calloc(sizeof(char), 256);
-  int i;
-  char c;
-  for (i = 0; (c = peek(iter, 0)); i++, next(iter)) {
-    if (!lexer_isalpha(c) && !isdigit(c))
+int lexer_stream_next(struct LexerStream *s) {
+  struct Lexer l = {
+      .ptr = s->ptr,
+      .end = s->end,
+      .line_start = s->line_start,
+      .line = s->line,
+      .symbols = &symbol_table,
+      .arena = &lexer_arena,
+  };
+  struct TokenArray *tokens = &s->tokens;
+  tokens->count = 0;
+  tokens->string_count = 0;
+  arena_reset(&lexer_arena);
+  // Top level items end with the bracket that closes their body
+  int depth = 0;
+  for (; create_token(&l, tokens);) {
+    token_enum type = tokens->type[tokens->count - 1];
+    if (openbracket == type)
+      depth++;
+    else if (closebracket == type && --depth <= 0)
       break;
-    t->string_rep[i] = c;
   }
-  t->string_rep[i] = '\0';
+  s->ptr = l.ptr;
+  s->line_start = l.line_start;
+  s->line = l.line;
+  if (0 == tokens->count)
+    return 0;
+  for (int i = 0; i < TOKEN_LOOKAHEAD; i++)
+    push_token(tokens, end, l.ptr, l.line, 0);
   return 1;
 }
 
-void create_token(struct Iterator *iter, token_t *t) {
-  skip_whitespace(iter);
-  // Skip comments
-  for (; '/' == peek(iter, 0) && '/' == peek(iter, 1);) {
-    (void)next(iter);
-    (void)next(iter);
-    for (;;) {
-      char c = next(iter);
-      if (iter->is_eof)
-        return;
-      if ('\n' == c)
-        break;
-    }
-    skip_whitespace(iter);
-  }
-  if (iter->is_eof)
-    return;
-  if (tokenize_alpha(iter, t))
-    return;
-  else if (tokenize_string(iter, t))
-    return;
-  else if (tokenize_compare(iter, t))
-    return;
-  else if (tokenize_char(iter, t))
-    return;
-  else if (tokenize_number(iter, t))
-    return;
-  printf("Rest: %s\n", iter->ptr);
-  assert(0 && "Unknown token");
+void lexer_stream_free(struct LexerStream *s) {
+  token_array_free(&s->tokens);
+  arena_free(&lexer_arena);
 }
 
-token_t *lexer(const char *s) {
-  token_t *r = malloc(sizeof(token_t));
-  token_t *t = r;
-  struct Iterator i = {
-      .ptr = s,
-      .col = 0,
+// Chunks smaller than this are not worth a thread of their own
+#define LEXER_MIN_CHUNK (256 * 1024)
+#define LEXER_MAX_THREADS 64
+
+// Part of the input lexed by one thread of lexer_parallel(). Offsets of the
+// tokens are relative to the whole input, lines and symbols are local to the
+// chunk until they are merged.
+struct LexerChunk {
+  const char *start;
+  const char *end;
+  struct TokenArray tokens;
+  struct SymbolTable symbols;
+  struct Arena arena;
+  // State of the lexer where it stopped
+  struct Lexer l;
+  // Filled in by the fix-up pass
+  uint32_t *remap;
+  size_t token_base;
+  uint32_t line_base;
+  uint32_t string_base;
+  struct TokenArray *out;
+};
+
+// (Re)lexes [start, c->end) assuming start is not inside a string literal
+// or comment.
+static void lex_chunk(struct LexerChunk *c, const char *start) {
+  symbol_table_destroy(&c->symbols);
+  symbol_table_create(&c->symbols, NULL);
+  arena_free(&c->arena);
+  c->tokens.count = 0;
+  c->tokens.string_count = 0;
+  if (!c->tokens.capacity)
+    token_array_reserve(&c->tokens, (c->end - start) / 2 + 1);
+  c->start = start;
+  c->l = (struct Lexer){
+      .ptr = start,
+      .end = c->end,
+      .line_start = start,
       .line = 0,
-      .last_col = 0,
-      .last_line = 0,
-      .is_eof = 0,
+      .symbols = &c->symbols,
+      .arena = &c->arena,
+      .is_chunk = 1,
   };
-  for (;;) {
-    create_token(&i, t);
-    t->col = i.last_col;
-    t->line = i.last_line;
-    if (i.is_eof) {
-      t->type = end;
-      t->next = NULL;
+  for (; create_token(&c->l, &c->tokens);)
+    ;
+}
+
+static void *lex_chunk_thread(void *arg) {
+  struct LexerChunk *c = arg;
+  lex_chunk(c, c->start);
+  return NULL;
+}
+
+static void *copy_chunk_thread(void *arg) {
+  struct LexerChunk *c = arg;
+  struct TokenArray *out = c->out;
+  size_t n = c->tokens.count;
+  memcpy(out->type + c->token_base, c->tokens.type, n * sizeof(uint8_t));
+  memcpy(out->offset + c->token_base, c->tokens.offset, n * sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++) {
+    size_t j = c->token_base + i;
+    out->line[j] = c->tokens.line[i] + c->line_base;
+    uint32_t data = c->tokens.data[i];
+    if (alpha == c->tokens.type[i])
+      data = c->remap[data];
+    else if (lexer_string == c->tokens.type[i])
+      data += c->string_base;
+    out->data[j] = data;
+  }
+  return NULL;
+}
+
+static void run_threads(struct LexerChunk *chunks, int n,
+                        void *(*f)(void *)) {
+  pthread_t threads[LEXER_MAX_THREADS];
+  for (int i = 1; i < n; i++) {
+    int rc = pthread_create(&threads[i], NULL, f, &chunks[i]);
+    assert(0 == rc && "Could not create lexer thread");
+  }
+  f(&chunks[0]);
+  for (int i = 1; i < n; i++)
+    pthread_join(threads[i], NULL);
+}
+
+void lexer_parallel(const char *s, size_t length, struct TokenArray *tokens,
+                    int thread_count) {
+  lexer_init_once();
+  int n = thread_count;
+  if (n > LEXER_MAX_THREADS)
+    n = LEXER_MAX_THREADS;
+  if ((size_t)n > length / LEXER_MIN_CHUNK)
+    n = length / LEXER_MIN_CHUNK;
+  if (n < 2) {
+    lexer(s, length, tokens);
+    return;
+  }
+
+  // Split at newlines, every chunk starts at the beginning of a line so it
+  // can only be wrong about being inside a string literal. A // comment
+  // always ends at the newline.
+  const char *source_end = s + length;
+  struct LexerChunk chunks[LEXER_MAX_THREADS] = {0};
+  const char *start = s;
+  for (int i = 0; i < n; i++) {
+    const char *end = source_end;
+    if (i + 1 < n) {
+      end = s + length / n * (i + 1);
+      if (end < start)
+        end = start;
+      const char *nl = memchr(end, '\n', source_end - end);
+      end = nl ? nl + 1 : source_end;
+    }
+    chunks[i].start = start;
+    chunks[i].end = end;
+    chunks[i].tokens.source = s;
+    chunks[i].tokens.source_length = length;
+    start = end;
+  }
+  run_threads(chunks, n, lex_chunk_thread);
+
+  // Fix-up pass. Going front to back, every chunk has its final state once it
+  // is reached. A chunk that ended in the middle of a string literal makes
+  // the following chunks wrong: the ones entirely inside the literal are
+  // emptied and the one containing the closing quote is lexed again starting
+  // at the opening quote.
+  for (int i = 0; i < n; i++) {
+    struct LexerChunk *c = &chunks[i];
+    if (c->l.error) {
+      // Lex the chunk the normal way to report the error
+      struct TokenArray t;
+      lexer(c->l.ptr, c->end - c->l.ptr, &t);
+      assert(0 && "Lexer error not reproduced");
+    }
+    if (c->l.open_string) {
+      const char *quote = c->l.open_string;
+      const char *close = memchr(quote + 1, '"', source_end - quote - 1);
+      assert(close && "Unterminated string");
+      int j = i + 1;
+      for (; chunks[j].end <= close; j++) {
+        chunks[j].end = chunks[j].start;
+        lex_chunk(&chunks[j], chunks[j].start);
+      }
+      c->end = quote;
+      chunks[j].start = quote;
+      lex_chunk(&chunks[j], quote);
+    } else if (c->l.ptr < c->end) {
+      // Stopped at a NUL byte, the rest of the input is ignored
+      n = i + 1;
       break;
     }
-    i.last_col = i.col;
-    i.last_line = i.line;
-    t->next = malloc(sizeof(token_t));
-    t = t->next;
   }
-  return r;
+
+  size_t count = 0;
+  uint32_t line = 0;
+  uint32_t string_count = 0;
+  for (int i = 0; i < n; i++) {
+    struct LexerChunk *c = &chunks[i];
+    c->remap = malloc(c->symbols.count * sizeof(uint32_t));
+    assert(c->remap && "Out of memory");
+    symbol_table_merge(&c->symbols, c->remap);
+    c->token_base = count;
+    c->line_base = line;
+    c->string_base = string_count;
+    c->out = tokens;
+    count += c->tokens.count;
+    line += c->l.line;
+    string_count += c->tokens.string_count;
+  }
+
+  *tokens = (struct TokenArray){
+      .source = s,
+      .source_length = length,
+  };
+  token_array_reserve(tokens, count + TOKEN_LOOKAHEAD);
+  tokens->count = count;
+  tokens->string_capacity = string_count;
+  tokens->strings = malloc((string_count + 1) * sizeof(struct TokenString));
+  assert(tokens->strings && "Out of memory");
+  for (int i = 0; i < n; i++) {
+    struct LexerChunk *c = &chunks[i];
+    memcpy(tokens->strings + tokens->string_count, c->tokens.strings,
+           c->tokens.string_count * sizeof(struct TokenString));
+    tokens->string_count += c->tokens.string_count;
+    arena_append(&lexer_arena, &c->arena);
+  }
+  run_threads(chunks, n, copy_chunk_thread);
+
+  const char *stop = chunks[n - 1].l.ptr;
+  for (int i = 0; i < TOKEN_LOOKAHEAD; i++)
+    push_token(tokens, end, stop, line, 0);
+  for (int i = 0; i < LEXER_MAX_THREADS; i++) {
+    token_array_free(&chunks[i].tokens);
+    symbol_table_destroy(&chunks[i].symbols);
+    arena_free(&chunks[i].arena);
+    free(chunks[i].remap);
+  }
+}
+
+void token_array_free(struct TokenArray *tokens) {
+  free(tokens->type);
+  free(tokens->offset);
+  free(tokens->line);
+  free(tokens->data);
+  free(tokens->strings);
+  *tokens = (struct TokenArray){0};
+}
+
+const char *token_string(struct TokenArray *tokens, size_t i, size_t *length) {
+  const char *s = tokens->source + tokens->offset[i];
+  const char *source_end = tokens->source + tokens->source_length;
+  switch (tokens->type[i]) {
+  case lexer_string: {
+    struct TokenString *str = &tokens->strings[tokens->data[i]];
+    *length = str->length;
+    return str->string;
+  }
+  case number:
+    *length = scan_digits(s, source_end) - s;
+    return s;
+  case alpha:
+  case keyword_if:
+  case keyword_for:
+  case keyword_struct:
+  case keyword_return:
+  case type_u64:
+  case type_u32:
+  case type_u0:
+    *length = scan_identifier(s, source_end) - s;
+    return s;
+  case equal:
+  case not_equal:
+  case less_equal:
+  case greater_equal:
+  case shift_left:
+  case shift_right:
+    *length = 2;
+    return s;
+  case end:
+    *length = 0;
+    return s;
+  default:
+    *length = 1;
+    return s;
+  }
+}
+
+uint32_t token_col(struct TokenArray *tokens, size_t i) {
+  const char *s = tokens->source + tokens->offset[i];
+  const char *line_start = s;
+  for (; line_start > tokens->source && '\n' != line_start[-1]; line_start--)
+    ;
+  return s - line_start;
 }
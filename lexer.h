@@ -1,6 +1,7 @@
-typedef struct token_struct token_t;
 #ifndef LEXER_H
 #define LEXER_H
+#include <arena.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum {
@@ -9,9 +10,20 @@ typedef enum {
   plus,
   minus,
   equal,
+  not_equal,
+  less,
+  less_equal,
+  greater,
+  greater_equal,
+  shift_left,
+  shift_right,
   lexer_string,
   ampersand,
   star,
+  slash,
+  percent,
+  vertical_bar,
+  caret,
   dot,
   comma,
   openparen,
@@ -20,16 +32,76 @@ typedef enum {
   closebracket,
   semicolon,
   equals,
+  keyword_if,
+  keyword_for,
+  keyword_struct,
+  keyword_return,
+  type_u64,
+  type_u32,
+  type_u0,
   end,
 } token_enum;
 
-struct token_struct {
-  token_enum type;
-  char *string_rep;
-  uint32_t col;
+struct TokenString {
+  const char *string;
+  size_t length;
+};
+
+// Tokens are stored as parallel arrays so the parser can look at any token by
+// index and only touches the columns it needs. Token text is not stored, it
+// can be recovered from the offset into the source with token_string().
+struct TokenArray {
+  const char *source;
+  size_t source_length;
+  uint8_t *type;
+  // Byte offset of the first character of the token
+  uint64_t *offset;
+  uint32_t *line;
+  // Symbol of alpha tokens, index into strings for lexer_string tokens
+  uint32_t *data;
+  size_t count;
+  size_t capacity;
+  // String literals, pointing into the source unless they contained escape
+  // sequences in which case they are decoded into lexer_arena.
+  struct TokenString *strings;
+  uint32_t string_count;
+  uint32_t string_capacity;
+};
+
+// The token array is terminated by this many end tokens so that the parser
+// can look a few tokens ahead without checking the bounds.
+#define TOKEN_LOOKAHEAD 4
+
+// Decoded string literals are allocated from lexer_arena, which can be freed
+// together with the token array once the AST has been built.
+extern _Thread_local struct Arena lexer_arena;
+
+void lexer(const char *s, size_t length, struct TokenArray *tokens);
+// Same result as lexer(), but large inputs are split into chunks at line
+// boundaries which are lexed on up to thread_count threads.
+void lexer_parallel(const char *s, size_t length, struct TokenArray *tokens,
+                    int thread_count);
+
+// Lexes the input one top level item at a time, so only the tokens of a
+// single function or struct definition are held at once.
+struct LexerStream {
+  const char *ptr;
+  const char *end;
+  const char *line_start;
   uint32_t line;
-  token_t *next;
+  // Tokens of the current item followed by TOKEN_LOOKAHEAD end tokens
+  struct TokenArray tokens;
 };
 
-token_t *lexer(const char *s);
+void lexer_stream_init(struct LexerStream *s, const char *source,
+                       size_t length);
+// Replaces the tokens with the ones of the next top level item, up to and
+// including the bracket closing its body. Decoded strings of the previous
+// item in lexer_arena are released. Returns 0 once the input is exhausted.
+int lexer_stream_next(struct LexerStream *s);
+void lexer_stream_free(struct LexerStream *s);
+void token_array_free(struct TokenArray *tokens);
+// Text of a token, not NUL terminated.
+const char *token_string(struct TokenArray *tokens, size_t i, size_t *length);
+uint32_t token_col(struct TokenArray *tokens, size_t i);
 #endif // LEXER_H
@@ -0,0 +1,533 @@
+#include <arena.h>
+#include <assert.h>
+#include <codegen.h>
+#include <ir.h>
+#include <lower.h>
+#include <stdlib.h>
+#include <string.h>
+#include <symbol.h>
+
+struct FunctionVariable {
+  // lower_function() call this variable belongs to
+  uint32_t function;
+  uint32_t slot;
+  int is_argument;
+  struct BuiltinType type;
+};
+
+// Variables indexed by symbol, stored by value so they do not depend on any
+// arena. Entries left over from previously lowered functions are told apart
+// by FunctionVariable.function, so nothing has to be cleared between
+// functions. Zeroed entries never match as the first function is number 1.
+// A declaration replaces the entry of its symbol, so a name refers to the
+// latest declaration in textual order.
+_Thread_local struct FunctionVariable *variables;
+_Thread_local uint32_t variables_size;
+_Thread_local uint32_t current_function;
+// Numbers handed out so far, inlined bodies get a number of their own
+_Thread_local uint32_t function_count;
+
+// Entries replaced by the variables of inlined functions, they are put back
+// once the inlined body has been lowered. Those replaced in loop bodies are
+// kept as well, see lower_for_statement().
+struct SavedVariable {
+  uint32_t symbol;
+  struct FunctionVariable v;
+};
+_Thread_local struct SavedVariable *saved_variables;
+_Thread_local size_t saved_variables_size;
+_Thread_local size_t saved_variables_capacity;
+_Thread_local uint32_t inline_depth;
+_Thread_local uint32_t loop_depth;
+
+// Pending binary expressions of lower_expression(). Arguments of function
+// calls are lowered by a nested call that uses the entries above the ones of
+// the outer expression, and so do the operands on the value stack.
+struct ExpressionFrame {
+  ast_index node;
+  // Number of operands pushed so far
+  int state;
+};
+_Thread_local struct ExpressionFrame *expression_stack;
+_Thread_local size_t expression_stack_size;
+_Thread_local size_t expression_stack_capacity;
+_Thread_local ir_value *value_stack;
+_Thread_local size_t value_stack_size;
+_Thread_local size_t value_stack_capacity;
+
+struct Lower {
+  struct IrFunction *f;
+  // Block new instructions are appended to
+  ir_block block;
+  struct CompiledData **data;
+  // Top level function node, also while an inlined body is lowered
+  ast_index function;
+  // Set while the body of an inlined function is lowered, its returns store
+  // to slot result and jump to exit.
+  ir_block exit;
+  uint32_t result;
+};
+
+// Returns the entry of the variable, which stays valid until the next call.
+static struct FunctionVariable *add_variable(uint32_t symbol,
+                                             struct FunctionVariable v) {
+  if (symbol >= variables_size) {
+    // Symbols keep being added while streaming, so grow geometrically
+    uint32_t size = symbol_count();
+    if (size < variables_size * 2)
+      size = variables_size * 2;
+    variables = realloc(variables, size * sizeof(struct FunctionVariable));
+    assert(variables && "Out of memory");
+    memset(variables + variables_size, 0,
+           (size - variables_size) * sizeof(struct FunctionVariable));
+    variables_size = size;
+  }
+  if (inline_depth || loop_depth) {
+    if (saved_variables_size == saved_variables_capacity) {
+      saved_variables_capacity =
+          saved_variables_capacity ? saved_variables_capacity * 2 : 64;
+      saved_variables =
+          realloc(saved_variables,
+                  saved_variables_capacity * sizeof(struct SavedVariable));
+      assert(saved_variables && "Out of memory");
+    }
+    saved_variables[saved_variables_size++] =
+        (struct SavedVariable){.symbol = symbol, .v = variables[symbol]};
+  }
+  v.function = current_function;
+  variables[symbol] = v;
+  return &variables[symbol];
+}
+
+static struct FunctionVariable *get_variable(uint32_t symbol) {
+  if (symbol >= variables_size)
+    return NULL;
+  struct FunctionVariable *v = &variables[symbol];
+  if (v->function != current_function)
+    return NULL;
+  return v;
+}
+
+static void push_expression(ast_index node) {
+  if (expression_stack_size == expression_stack_capacity) {
+    expression_stack_capacity =
+        expression_stack_capacity ? expression_stack_capacity * 2 : 64;
+    expression_stack =
+        realloc(expression_stack,
+                expression_stack_capacity * sizeof(struct ExpressionFrame));
+    assert(expression_stack && "Out of memory");
+  }
+  expression_stack[expression_stack_size++] =
+      (struct ExpressionFrame){.node = node, .state = 0};
+}
+
+static void push_value(ir_value v) {
+  if (value_stack_size == value_stack_capacity) {
+    value_stack_capacity = value_stack_capacity ? value_stack_capacity * 2 : 64;
+    value_stack = realloc(value_stack, value_stack_capacity * sizeof(ir_value));
+    assert(value_stack && "Out of memory");
+  }
+  value_stack[value_stack_size++] = v;
+}
+
+static ir_value emit(struct Lower *l, ir_op op, uint32_t op_count) {
+  return ir_append(l->f, l->block, op, op_count);
+}
+
+static ir_value emit_const(struct Lower *l, int64_t n) {
+  ir_value v = emit(l, ir_const, 0);
+  ir_instr(l->f, v)->imm = n;
+  return v;
+}
+
+static void emit_store(struct Lower *l, ir_value address, int64_t displacement,
+                       uint8_t size, ir_value value) {
+  ir_value v = emit(l, ir_store, 2);
+  struct IrInstr *store = ir_instr(l->f, v);
+  store->ops[0] = address;
+  store->ops[1] = value;
+  store->imm = displacement;
+  store->size = size;
+}
+
+static ir_value emit_slot(struct Lower *l, uint32_t slot) {
+  ir_value v = emit(l, ir_slot, 0);
+  ir_instr(l->f, v)->imm = slot;
+  return v;
+}
+
+static ir_value emit_load(struct Lower *l, ir_value address,
+                          int64_t displacement, uint8_t size) {
+  assert((4 == size || 8 == size) && "Unsupported variable size");
+  ir_value v = emit(l, ir_load, 1);
+  struct IrInstr *load = ir_instr(l->f, v);
+  load->ops[0] = address;
+  load->imm = displacement;
+  load->size = size;
+  return v;
+}
+
+static void emit_jump(struct Lower *l, ir_block target) {
+  ir_instr(l->f, emit(l, ir_jump, 0))->target[0] = target;
+}
+
+static void emit_branch(struct Lower *l, ir_value condition, ir_block then,
+                        ir_block otherwise) {
+  struct IrInstr *branch = ir_instr(l->f, emit(l, ir_branch, 1));
+  branch->ops[0] = condition;
+  branch->target[0] = then;
+  branch->target[1] = otherwise;
+}
+
+// Slot address of a variable or one of its struct members, the offset from
+// the start of the slot and the size of the access are written to
+// displacement and size.
+static ir_value variable_address(struct Lower *l, uint32_t symbol,
+                                 uint32_t member, int64_t *displacement,
+                                 uint8_t *size) {
+  struct FunctionVariable *v = get_variable(symbol);
+  assert(v && "Unknown variable");
+  *displacement = 0;
+  *size = v->type.byte_size;
+  if (SYMBOL_NONE != member) {
+    assert(!v->is_argument && "FIXME");
+    struct BuiltinType type;
+    *displacement = struct_find_member(v->type.ast_struct, member, &type);
+    *size = type.byte_size;
+  }
+  return emit_slot(l, v->slot);
+}
+
+static ir_value lower_expression(struct Lower *l, ast_index i);
+static void lower_block(struct Lower *l, ast_index i);
+
+// Returns value from the function, or from the inlined body being lowered.
+static void emit_return(struct Lower *l, ir_value value) {
+  if (l->exit) {
+    emit_store(l, emit_slot(l, l->result), 0, 8, value);
+    emit_jump(l, l->exit);
+  } else {
+    ir_instr(l->f, emit(l, ir_ret, 1))->ops[0] = value;
+  }
+}
+
+// Lowers the body of the function node callee in place of a call with the
+// argument values. Arguments and the result are kept in slots of their own,
+// which mem2reg() turns into SSA values. The body of a call that is returned
+// right away returns itself, so the calls it returns stay in tail position,
+// and there is no result.
+static ir_value lower_inline(struct Lower *l, ast_index callee,
+                             ir_value *values, int tail) {
+  struct AstFunction *function = ast_function(ast_node(callee)->function.index);
+  uint32_t caller = current_function;
+  size_t saved = saved_variables_size;
+  current_function = ++function_count;
+  inline_depth++;
+  uint32_t n = 0;
+  for (ast_index j = function->arguments; j; j = ast_node(j)->next) {
+    struct AstNode *argument = ast_node(j);
+    struct BuiltinType *type = ast_type(argument->declaration.type);
+    uint32_t slot = ir_new_slot(l->f, type->byte_size, type->alignment, -1,
+                                type->variant != structure);
+    add_variable(argument->declaration.symbol,
+                 (struct FunctionVariable){
+                     .slot = slot, .is_argument = 1, .type = *type});
+    emit_store(l, emit_slot(l, slot), 0, type->byte_size, values[n++]);
+  }
+  ir_value v = IR_NONE;
+  if (tail) {
+    lower_block(l, function->body);
+    // Falling off the end returns whatever is in rax
+    if (l->exit)
+      emit_jump(l, l->exit);
+    else
+      emit(l, ir_ret, 0);
+  } else {
+    ir_block exit = l->exit;
+    uint32_t result = l->result;
+    l->exit = ir_new_block(l->f);
+    l->result = ir_new_slot(l->f, 8, 8, -1, 1);
+    lower_block(l, function->body);
+    emit_jump(l, l->exit);
+    l->block = l->exit;
+    v = emit_load(l, emit_slot(l, l->result), 0, 8);
+    l->exit = exit;
+    l->result = result;
+  }
+
+  for (; saved_variables_size > saved;) {
+    struct SavedVariable *s = &saved_variables[--saved_variables_size];
+    variables[s->symbol] = s->v;
+  }
+  inline_depth--;
+  current_function = caller;
+  return v;
+}
+
+// Arguments are evaluated right to left. Returns the result of the call, or
+// IR_NONE for inline assembly and for a call in tail position that has been
+// inlined, see lower_inline().
+static ir_value lower_call(struct Lower *l, struct AstNode *a,
+                           int allow_builtin, int tail) {
+  if (allow_builtin && SYMBOL_ASM == a->call.symbol) {
+    ir_value v = emit(l, ir_asm, 0);
+    ir_instr(l->f, v)->imm = ast_node(a->call.arguments)->string.index;
+    l->f->has_asm = 1;
+    return IR_NONE;
+  }
+  uint32_t count = 0;
+  for (ast_index c = a->call.arguments; c; c = ast_node(c)->next)
+    count++;
+  ast_index *arguments = arena_alloc(&l->f->arena, count * sizeof(ast_index));
+  ir_value *values = arena_alloc(&l->f->arena, count * sizeof(ir_value));
+  count = 0;
+  for (ast_index c = a->call.arguments; c; c = ast_node(c)->next)
+    arguments[count++] = c;
+  for (uint32_t i = count; i > 0; i--)
+    values[i - 1] = lower_expression(l, arguments[i - 1]);
+  ast_index callee = inline_target(l->function, a);
+  if (callee)
+    return lower_inline(l, callee, values, tail);
+  ir_value v = emit(l, ir_call, count);
+  struct IrInstr *call = ir_instr(l->f, v);
+  call->imm = a->call.symbol;
+  if (count)
+    memcpy(call->ops, values, count * sizeof(ir_value));
+  return v;
+}
+
+static ir_value lower_operand(struct Lower *l, struct AstNode *a) {
+  int64_t displacement;
+  uint8_t size;
+  switch (a->type) {
+  case literal: {
+    if (a->value_type == num)
+      return emit_const(l, ast_number(a));
+    assert(a->value_type == string && "unimplemented");
+    ir_value v = emit(l, ir_string, 0);
+    ir_instr(l->f, v)->name = add_data(l->data, ast_string(a->string.index));
+    return v;
+  }
+  case function_call:
+    return lower_call(l, a, 0, 0);
+  case variable: {
+    ir_value address = variable_address(l, a->variable.symbol,
+                                        a->variable.member, &displacement,
+                                        &size);
+    return emit_load(l, address, displacement, size);
+  }
+  case variable_reference: {
+    ir_value address = variable_address(l, a->variable.symbol,
+                                        a->variable.member, &displacement,
+                                        &size);
+    if (!displacement)
+      return address;
+    ir_value v = emit(l, ir_binary, 2);
+    struct IrInstr *add = ir_instr(l->f, v);
+    add->operator= operator_add;
+    add->ops[0] = address;
+    add->ops[1] = emit_const(l, displacement);
+    return v;
+  }
+  default:
+    assert(0);
+    return IR_NONE;
+  }
+}
+
+// Operands of binary expressions are evaluated right to left, walking the
+// tree with an explicit stack so long operator chains do not recurse.
+static ir_value lower_expression(struct Lower *l, ast_index i) {
+  size_t base = expression_stack_size;
+  push_expression(i);
+  for (; expression_stack_size > base;) {
+    struct ExpressionFrame *f = &expression_stack[expression_stack_size - 1];
+    struct AstNode *a = ast_node(f->node);
+    if (a->type != binaryexpression) {
+      expression_stack_size--;
+      push_value(lower_operand(l, a));
+      continue;
+    }
+    switch (f->state++) {
+    case 0:
+      push_expression(a->binary.right);
+      break;
+    case 1:
+      push_expression(a->binary.left);
+      break;
+    default: {
+      expression_stack_size--;
+      ir_value v = emit(l, ir_binary, 2);
+      struct IrInstr *binary = ir_instr(l->f, v);
+      binary->operator= a->operator;
+      binary->ops[0] = value_stack[--value_stack_size];
+      binary->ops[1] = value_stack[--value_stack_size];
+      push_value(v);
+      break;
+    }
+    }
+  }
+  return value_stack[--value_stack_size];
+}
+
+static void lower_if_statement(struct Lower *l, struct AstNode *a) {
+  ir_value condition = lower_expression(l, a->branch.condition);
+  ir_block body = ir_new_block(l->f);
+  ir_block end = ir_new_block(l->f);
+  emit_branch(l, condition, body, end);
+  l->block = body;
+  lower_block(l, a->branch.body);
+  emit_jump(l, end);
+  l->block = end;
+}
+
+// Swaps the entries saved since saved with the variables, in reverse order
+// to go back to the variables from before them and in order to return.
+static void swap_saved_variables(size_t saved, int reverse) {
+  size_t count = saved_variables_size - saved;
+  for (size_t n = 0; n < count; n++) {
+    struct SavedVariable *s =
+        &saved_variables[saved + (reverse ? count - 1 - n : n)];
+    struct FunctionVariable v = variables[s->symbol];
+    variables[s->symbol] = s->v;
+    s->v = v;
+  }
+}
+
+// Loops are rotated, the condition is tested once in front of the loop and
+// then at the end of every iteration, so an iteration takes one branch. The
+// preheader only runs when the body runs at least once, it is where code
+// that does not change in the loop is hoisted to. The names in the second
+// test refer to what they did in front of the body.
+static void lower_for_statement(struct Lower *l, struct AstNode *a) {
+  ir_block preheader = ir_new_block(l->f);
+  ir_block body = ir_new_block(l->f);
+  ir_block end = ir_new_block(l->f);
+  emit_branch(l, lower_expression(l, a->branch.condition), preheader, end);
+  l->block = preheader;
+  emit_jump(l, body);
+  l->block = body;
+  size_t saved = saved_variables_size;
+  loop_depth++;
+  lower_block(l, a->branch.body);
+  loop_depth--;
+  swap_saved_variables(saved, 1);
+  emit_branch(l, lower_expression(l, a->branch.condition), body, end);
+  swap_saved_variables(saved, 0);
+  // Enclosing loops and inlined bodies still need the entries
+  if (!loop_depth && !inline_depth)
+    saved_variables_size = saved;
+  l->block = end;
+}
+
+static void lower_block(struct Lower *l, ast_index i) {
+  for (; i; i = ast_node(i)->next) {
+    struct AstNode *a = ast_node(i);
+    int64_t displacement;
+    uint8_t size;
+    switch (a->type) {
+    case if_statement:
+      lower_if_statement(l, a);
+      break;
+    case for_statement:
+      lower_for_statement(l, a);
+      break;
+    case function_call:
+      lower_call(l, a, 1, 0);
+      break;
+    case return_statement: {
+      struct AstNode *value = ast_node(a->ret.value);
+      ir_value v = function_call == value->type
+                       ? lower_call(l, value, 0, 1)
+                       : lower_expression(l, a->ret.value);
+      if (v)
+        emit_return(l, v);
+      // Whatever follows is unreachable and dropped by ir_cfg()
+      l->block = ir_new_block(l->f);
+      break;
+    }
+    case variable_declaration: {
+      struct BuiltinType *type = ast_type(a->declaration.type);
+      uint32_t slot = ir_new_slot(l->f, type->byte_size, type->alignment,
+                                  -1, type->variant != structure);
+      add_variable(a->declaration.symbol,
+                   (struct FunctionVariable){
+                       .slot = slot, .is_argument = 0, .type = *type});
+      if (a->declaration.value) {
+        ir_value value = lower_expression(l, a->declaration.value);
+        emit_store(l, emit_slot(l, slot), 0, type->byte_size, value);
+      }
+      break;
+    }
+    case variable_assignment: {
+      assert(get_variable(a->assignment.symbol) && "Undefined variable.");
+      assert(a->assignment.value);
+      ir_value value = lower_expression(l, a->assignment.value);
+      ir_value address =
+          variable_address(l, a->assignment.symbol, a->assignment.member,
+                           &displacement, &size);
+      emit_store(l, address, displacement, size, value);
+      break;
+    }
+    case variable_reference_assignment: {
+      struct FunctionVariable *v = get_variable(a->assignment.symbol);
+      assert(v && "Undefined variable.");
+      assert(v->type.variant == pointer &&
+             "Attempting to dereference non pointer");
+      assert(a->assignment.value);
+      ir_value value = lower_expression(l, a->assignment.value);
+      ir_value address = variable_address(l, a->assignment.symbol,
+                                          SYMBOL_NONE, &displacement, &size);
+      ir_value pointer = emit_load(l, address, 0, 8);
+      emit_store(l, pointer, 0, 8, value);
+      break;
+    }
+    case noop:
+      break;
+    default:
+      assert(0 && "unimplemented");
+    }
+  }
+}
+
+void lower_function(struct IrFunction *f, ast_index a,
+                    struct CompiledData **data) {
+  struct AstFunction *function = ast_function(ast_node(a)->function.index);
+  ir_function_reset(f, function->symbol);
+  current_function = ++function_count;
+  for (ast_index j = function->arguments; j; j = ast_node(j)->next) {
+    struct AstNode *argument = ast_node(j);
+    assert(argument->type == function_argument);
+    struct BuiltinType *type = ast_type(argument->declaration.type);
+    uint32_t slot =
+        ir_new_slot(f, type->byte_size, type->alignment, f->arg_count++,
+                    type->variant != structure);
+    add_variable(argument->declaration.symbol,
+                 (struct FunctionVariable){
+                     .slot = slot, .is_argument = 1, .type = *type});
+  }
+  struct Lower l = {.f = f, .block = 1, .data = data, .function = a};
+  lower_block(&l, function->body);
+  // Falling off the end returns whatever is in rax
+  emit(&l, ir_ret, 0);
+}
+
+void lower_free(void) {
+  free(variables);
+  variables = NULL;
+  variables_size = 0;
+  current_function = 0;
+  function_count = 0;
+  free(saved_variables);
+  saved_variables = NULL;
+  saved_variables_size = 0;
+  saved_variables_capacity = 0;
+  free(expression_stack);
+  expression_stack = NULL;
+  expression_stack_size = 0;
+  expression_stack_capacity = 0;
+  free(value_stack);
+  value_stack = NULL;
+  value_stack_size = 0;
+  value_stack_capacity = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef LOWER_H
+#define LOWER_H
+#include <ast.h>
+#include <ir.h>
+
+// Lowers the function node a into f. Every variable is given a stack slot
+// that is read and written with loads and stores, mem2reg() turns them into
+// SSA values afterwards. String literals are appended to *data.
+void lower_function(struct IrFunction *f, ast_index a,
+                    struct CompiledData **data);
+// Releases the lowering state of the current thread.
+void lower_free(void);
+#endif // LOWER_H
@@ -1,11 +1,174 @@
+#include <arena.h>
 #include <assert.h>
 #include <ast.h>
+#include <codegen.h>
 #include <ctype.h>
 #include <lexer.h>
+#include <pool.h>
+#include <source.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stream.h>
 #include <string.h>
+#include <symbol.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One input file, compiled independently of all others.
+struct Unit {
+  char *path;
+  // NULL writes to stdout
+  char *output;
+  size_t size;
+  int failed;
+};
+
+struct Build {
+  struct Unit *units;
+  size_t unit_count;
+  size_t unit_capacity;
+  // Units sorted largest first, the order in which they are handed out
+  size_t *order;
+  int lexer_threads;
+  int stream;
+};
+
+static void add_unit(struct Build *b, const char *path) {
+  if (b->unit_count == b->unit_capacity) {
+    b->unit_capacity = b->unit_capacity ? b->unit_capacity * 2 : 16;
+    b->units = realloc(b->units, b->unit_capacity * sizeof(struct Unit));
+    assert(b->units && "Out of memory");
+  }
+  struct stat st;
+  b->units[b->unit_count++] = (struct Unit){
+      .path = strdup(path),
+      .size = 0 == stat(path, &st) ? st.st_size : 0,
+  };
+}
+
+// Adds every line of a response file as an input. Returns 0 on success.
+static int add_response_file(struct Build *b, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 1;
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  for (; -1 != (length = getline(&line, &capacity, fp));) {
+    for (; length > 0 && isspace((unsigned char)line[length - 1]);)
+      line[--length] = '\0';
+    if (length > 0)
+      add_unit(b, line);
+  }
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+// foo.src is compiled to foo.asm, files without an extension get one.
+static char *output_path(const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(path, '.');
+  size_t length = dot && (!slash || dot > slash) ? (size_t)(dot - path)
+                                                  : strlen(path);
+  char *r = malloc(length + sizeof(".asm"));
+  assert(r && "Out of memory");
+  memcpy(r, path, length);
+  strcpy(r + length, ".asm");
+  return r;
+}
+
+// Compiles u on the calling thread. All state of the compiler is thread
+// local and released at the end, so the next unit on this thread starts
+// from scratch.
+static void compile_unit(struct Unit *u, int lexer_threads, int stream) {
+  struct Source source;
+  if (0 != source_open(&source, u->path)) {
+    fprintf(stderr, "File \"%s\" could not be opened.\n", u->path);
+    u->failed = 1;
+    return;
+  }
+  FILE *fp = stdout;
+  if (u->output && !(fp = fopen(u->output, "w"))) {
+    fprintf(stderr, "File \"%s\" could not be created.\n", u->output);
+    source_close(&source);
+    u->failed = 1;
+    return;
+  }
+  fprintf(fp, "BITS 64\n");
+  fprintf(fp, "global _start\n");
+  for (int e = 0; e < codegen_options.export_count; e++)
+    fprintf(fp, "global %s\n", codegen_options.exports[e]);
+  fprintf(fp, "section .text\n");
+  if (stream) {
+    compile_stream(&source, fp, NULL);
+    source_close(&source);
+  } else {
+    struct TokenArray tokens;
+    lexer_parallel(source.data, source.length, &tokens, lexer_threads);
+
+    ast_index h = lex2ast(&tokens);
+    token_array_free(&tokens);
+    arena_free(&lexer_arena);
+    source_close(&source);
+
+    if (codegen_options.optimize) {
+      plan_inlining(h);
+      remove_unused_functions(h);
+    }
+    struct CompiledData *data = NULL;
+    compile_ast(h, &data, fp);
+    compile_data(data, fp);
+  }
+  ast_free();
+  codegen_free();
+  symbol_table_free();
+  if (fp != stdout)
+    fclose(fp);
+}
+
+static void compile_task(void *arg, size_t task) {
+  struct Build *b = arg;
+  compile_unit(&b->units[b->order[task]], b->lexer_threads, b->stream);
+}
+
+static struct Build *sort_build;
+
+static int compare_size(const void *a, const void *b) {
+  size_t x = sort_build->units[*(const size_t *)a].size;
+  size_t y = sort_build->units[*(const size_t *)b].size;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-j threads] [-s] [-O0] [-inline size] "
+          "[-omit-frame-pointer]\n       [-sysv] [-ir] [-export symbol]... "
+          "file... | @response_file\n"
+          "One file is compiled to stdout, several files are compiled in "
+          "parallel with\nevery file written to its own .asm file. A "
+          "response file lists one input per\nline.\n"
+          "-j number of threads, all cores by default. Used for the files "
+          "when there\n   are several of them, to lex the file otherwise\n"
+          "-s compiles one top level item at a time instead of lexing and "
+          "parsing the\n   whole file up front\n"
+          "-O0 turns off optimizations, unused functions are only left out "
+          "with\n    optimizations and without -s\n"
+          "-inline largest function in AST nodes that is inlined at its call "
+          "sites,\n        40 by default and 0 for none. Only with "
+          "optimizations and without -s\n"
+          "-omit-frame-pointer addresses the stack through rsp in functions "
+          "that call\n                    others, functions that do not "
+          "never set up rbp when\n                    optimizing\n"
+          "-sysv passes the first six arguments in rdi, rsi, rdx, rcx, r8 and "
+          "r9 as\n      in the System V ABI, to call and be called by C\n"
+          "-ir writes the intermediate representation of every function as "
+          "comments\n"
+          "-export makes a function global, it is kept like _start and main "
+          "even if\n        nothing calls it\n",
+          name);
+}
 
 int main(int argc, char **argv) {
   if (argc < 2) {
@@ -14,36 +177,70 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  FILE *fp = fopen(argv[1], "r");
-  if (!fp) {
-    fprintf(stderr, "File \"%s\" could not be opened.\n", argv[1]);
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct Build b = {0};
+  int to_files = 0;
+  codegen_options.exports = malloc(argc * sizeof(char *));
+  assert(codegen_options.exports && "Out of memory");
+  for (int arg = 1; arg < argc; arg++) {
+    if (0 == strcmp(argv[arg], "-j") && arg + 1 < argc) {
+      threads = atoi(argv[++arg]);
+    } else if (0 == strcmp(argv[arg], "-s")) {
+      b.stream = 1;
+    } else if (0 == strcmp(argv[arg], "-O0")) {
+      codegen_options.optimize = 0;
+    } else if (0 == strcmp(argv[arg], "-inline") && arg + 1 < argc) {
+      codegen_options.inline_budget = atoi(argv[++arg]);
+    } else if (0 == strcmp(argv[arg], "-omit-frame-pointer")) {
+      codegen_options.omit_frame_pointer = 1;
+    } else if (0 == strcmp(argv[arg], "-sysv")) {
+      codegen_options.sysv_abi = 1;
+    } else if (0 == strcmp(argv[arg], "-ir")) {
+      codegen_options.print_ir = 1;
+    } else if (0 == strcmp(argv[arg], "-export") && arg + 1 < argc) {
+      codegen_options.exports[codegen_options.export_count++] = argv[++arg];
+    } else if ('@' == argv[arg][0]) {
+      if (0 != add_response_file(&b, argv[arg] + 1)) {
+        fprintf(stderr, "File \"%s\" could not be opened.\n", argv[arg] + 1);
+        return 1;
+      }
+      to_files = 1;
+    } else if ('-' != argv[arg][0] || 0 == strcmp(argv[arg], "-")) {
+      add_unit(&b, argv[arg]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (0 == b.unit_count) {
+    usage(argv[0]);
     return 1;
   }
-  fseek(fp, 0, SEEK_END);
-  size_t l = ftell(fp);
-  char *buffer = malloc(l + 1);
-  fseek(fp, 0, SEEK_SET);
-  assert(fread(buffer, 1, l, fp) == l);
-  buffer[l] = '\0';
-  fclose(fp);
-  printf("BITS 64\n");
-  printf("global _start\n");
-  printf("section .text\n");
-  token_t *head = lexer(buffer);
-
-  ast_t *h = lex2ast(head);
-
-  struct CompiledData *data;
-  size_t s;
-  compile_ast(h, NULL, NULL, &data, stdout, &s);
-
-  printf("section .data\n");
-  for (; data; data = data->prev) {
-    printf("%s: db ", data->name);
-    for (char *b = data->buffer; *b; b++) {
-      printf("0x%x, ", *b);
-    }
-    printf("\n");
+
+  to_files |= b.unit_count > 1;
+  if (to_files) {
+    for (size_t i = 0; i < b.unit_count; i++)
+      b.units[i].output = output_path(b.units[i].path);
   }
-  return 0;
+  // Files are compiled on threads of their own, so every one of them is
+  // lexed serially.
+  b.lexer_threads = to_files ? 1 : threads;
+  b.order = malloc(b.unit_count * sizeof(size_t));
+  assert(b.order && "Out of memory");
+  for (size_t i = 0; i < b.unit_count; i++)
+    b.order[i] = i;
+  sort_build = &b;
+  qsort(b.order, b.unit_count, sizeof(size_t), compare_size);
+  pool_run(b.unit_count, to_files ? threads : 1, compile_task, &b);
+
+  int rc = 0;
+  for (size_t i = 0; i < b.unit_count; i++) {
+    rc |= b.units[i].failed;
+    free(b.units[i].path);
+    free(b.units[i].output);
+  }
+  free(b.order);
+  free(b.units);
+  free(codegen_options.exports);
+  return rc;
 }
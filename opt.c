@@ -0,0 +1,1329 @@
+#include <arena.h>
+#include <ast.h>
+#include <ir.h>
+#include <opt.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Per block lists in one allocation, list b is
+// items[start[b]] .. items[start[b + 1] - 1].
+struct BlockLists {
+  uint32_t *start;
+  ir_block *items;
+};
+
+// Children of every block in the dominator tree.
+static struct BlockLists dominator_tree(struct IrFunction *f) {
+  struct BlockLists t;
+  t.start = arena_calloc(&f->arena, f->block_count + 1, sizeof(uint32_t));
+  t.items = arena_alloc(&f->arena, f->order_count * sizeof(ir_block));
+  for (uint32_t i = 1; i < f->order_count; i++)
+    t.start[f->blocks[f->order[i]].idom + 1]++;
+  for (ir_block b = 0; b < f->block_count; b++)
+    t.start[b + 1] += t.start[b];
+  uint32_t *fill = arena_alloc(&f->arena, f->block_count * sizeof(uint32_t));
+  memcpy(fill, t.start, f->block_count * sizeof(uint32_t));
+  for (uint32_t i = 1; i < f->order_count; i++) {
+    ir_block b = f->order[i];
+    t.items[fill[f->blocks[b].idom]++] = b;
+  }
+  return t;
+}
+
+// Dominance frontier of every block, the blocks where its dominance ends.
+static struct BlockLists dominance_frontiers(struct IrFunction *f) {
+  struct BlockLists df;
+  df.start = arena_calloc(&f->arena, f->block_count + 1, sizeof(uint32_t));
+  // Walks the edges twice, counting first and filling the lists after
+  uint32_t *fill = NULL;
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < f->order_count; i++) {
+      struct IrBlock *block = &f->blocks[f->order[i]];
+      if (block->pred_count < 2)
+        continue;
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        for (ir_block r = block->preds[p]; r != block->idom;
+             r = f->blocks[r].idom) {
+          // Every block is added while it is processed, so a duplicate is
+          // always the last entry of the list.
+          uint32_t *n = pass ? &fill[r] : &df.start[r + 1];
+          if (pass && *n > df.start[r] && df.items[*n - 1] == f->order[i])
+            continue;
+          if (pass)
+            df.items[*n] = f->order[i];
+          (*n)++;
+        }
+      }
+    }
+    if (pass)
+      break;
+    for (ir_block b = 0; b < f->block_count; b++)
+      df.start[b + 1] += df.start[b];
+    df.items = arena_alloc(&f->arena, df.start[f->block_count] *
+                                          sizeof(ir_block));
+    fill = arena_alloc(&f->arena, f->block_count * sizeof(uint32_t));
+    memcpy(fill, df.start, f->block_count * sizeof(uint32_t));
+  }
+  // Duplicates left gaps at the end of some lists
+  for (ir_block b = 0; b < f->block_count; b++) {
+    for (uint32_t i = fill[b]; i < df.start[b + 1]; i++)
+      df.items[i] = IR_NONE;
+  }
+  return df;
+}
+
+// Flags the slots with an address that is used other than to load or store,
+// those may be accessed through pointers.
+static uint8_t *escaped_slots(struct IrFunction *f) {
+  uint8_t *escaped = arena_calloc(&f->arena, f->slot_count + 1, 1);
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      for (uint32_t o = 0; o < i->op_count; o++) {
+        struct IrInstr *op = &f->instrs[i->ops[o]];
+        if (op->op == ir_slot &&
+            !(0 == o && (i->op == ir_load || i->op == ir_store)))
+          escaped[op->imm] = 1;
+      }
+    }
+  }
+  return escaped;
+}
+
+void tail_recursion(struct IrFunction *f) {
+  if (f->has_asm)
+    return;
+  // Every iteration reuses the slots, a pointer into them could see the
+  // variables of a later call change
+  uint8_t *escaped = escaped_slots(f);
+  uint32_t *argument_slot =
+      arena_alloc(&f->arena, (f->arg_count + 1) * sizeof(uint32_t));
+  for (uint32_t s = 0; s < f->slot_count; s++) {
+    if (escaped[s])
+      return;
+    if (f->slots[s].argument >= 0)
+      argument_slot[f->slots[s].argument] = s;
+  }
+  ir_value *calls = arena_alloc(&f->arena, f->order_count * sizeof(ir_value));
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    ir_value ret = ir_terminator(f, f->order[b]);
+    if (!ret || f->instrs[ret].op != ir_ret)
+      continue;
+    ir_value call = f->instrs[ret].prev;
+    struct IrInstr *i = &f->instrs[call];
+    if (call && i->op == ir_call && i->imm == f->symbol &&
+        i->op_count == f->arg_count &&
+        (!f->instrs[ret].op_count || f->instrs[ret].ops[0] == call))
+      calls[count++] = call;
+  }
+  if (!count)
+    return;
+
+  // The entry can not be a loop header, its code moves to a block of its own
+  ir_block header = ir_move_instructions(f, 1);
+  for (uint32_t c = 0; c < count; c++) {
+    ir_value call = calls[c];
+    ir_block b = f->instrs[call].block;
+    for (uint32_t a = 0; a < f->arg_count; a++) {
+      uint32_t slot = argument_slot[a];
+      ir_value address = ir_insert_before(f, call, ir_slot, 0);
+      f->instrs[address].imm = slot;
+      ir_value store = ir_insert_before(f, call, ir_store, 2);
+      struct IrInstr *i = &f->instrs[store];
+      i->ops[0] = address;
+      i->ops[1] = f->instrs[call].ops[a];
+      i->size = f->slots[slot].size;
+    }
+    ir_remove(f, f->instrs[call].next);
+    ir_remove(f, call);
+    ir_instr(f, ir_append(f, b, ir_jump, 0))->target[0] = header;
+  }
+  ir_cfg(f);
+}
+
+// Slot that v is the address of if the slot is promoted, -1 otherwise.
+static int64_t promoted_slot(struct IrFunction *f, uint8_t *promote,
+                             ir_value v) {
+  struct IrInstr *i = &f->instrs[v];
+  if (i->op != ir_slot || !promote[i->imm])
+    return -1;
+  return i->imm;
+}
+
+// Removes phis with a single distinct operand and phis no other instruction
+// depends on. Phis without any operand but themselves become undef, which is
+// created if it is IR_NONE, so map needs room for one more value.
+static void remove_phis(struct IrFunction *f, ir_value *map, ir_value undef) {
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (uint32_t b = 0; b < f->order_count; b++) {
+      for (ir_value v = f->blocks[f->order[b]].first;
+           v && f->instrs[v].op == ir_phi;) {
+        struct IrInstr *phi = &f->instrs[v];
+        ir_value next = phi->next;
+        ir_value same = IR_NONE;
+        int trivial = 1;
+        for (uint32_t o = 0; o < phi->op_count && trivial; o++) {
+          ir_value op = ir_resolve(map, phi->ops[o]);
+          if (op == v || op == same)
+            continue;
+          trivial = !same;
+          same = op;
+        }
+        if (trivial) {
+          if (!same && !undef)
+            undef = ir_prepend(f, 1, ir_undef, 0);
+          map[v] = same ? same : undef;
+          ir_remove(f, v);
+          changed = 1;
+        }
+        v = next;
+      }
+    }
+  }
+  ir_replace_uses(f, map);
+
+  uint8_t *live = arena_calloc(&f->arena, f->instr_count, 1);
+  ir_value *work = arena_alloc(&f->arena, f->instr_count * sizeof(ir_value));
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if (i->op == ir_phi)
+        continue;
+      for (uint32_t o = 0; o < i->op_count; o++) {
+        ir_value op = i->ops[o];
+        if (f->instrs[op].op == ir_phi && !live[op]) {
+          live[op] = 1;
+          work[count++] = op;
+        }
+      }
+    }
+  }
+  for (; count > 0;) {
+    struct IrInstr *phi = &f->instrs[work[--count]];
+    for (uint32_t o = 0; o < phi->op_count; o++) {
+      ir_value op = phi->ops[o];
+      if (f->instrs[op].op == ir_phi && !live[op]) {
+        live[op] = 1;
+        work[count++] = op;
+      }
+    }
+  }
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first;
+         v && f->instrs[v].op == ir_phi;) {
+      ir_value next = f->instrs[v].next;
+      if (!live[v])
+        ir_remove(f, v);
+      v = next;
+    }
+  }
+}
+
+void mem2reg(struct IrFunction *f) {
+  if (f->has_asm || !f->slot_count)
+    return;
+  uint8_t *promote = arena_calloc(&f->arena, f->slot_count, 1);
+  for (uint32_t s = 0; s < f->slot_count; s++) {
+    struct IrSlot *slot = &f->slots[s];
+    promote[s] = slot->scalar && (4 == slot->size || 8 == slot->size);
+  }
+  // Any use of a slot address other than as the address of a load or store
+  // of the whole slot lets the address escape.
+  uint32_t stores = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      for (uint32_t o = 0; o < i->op_count; o++) {
+        struct IrInstr *op = &f->instrs[i->ops[o]];
+        if (op->op != ir_slot)
+          continue;
+        int whole = 0 == o && 0 == i->imm &&
+                    (i->op == ir_load || i->op == ir_store) &&
+                    i->size == f->slots[op->imm].size;
+        if (!whole)
+          promote[op->imm] = 0;
+      }
+      stores += i->op == ir_store;
+    }
+  }
+  uint32_t promoted = 0;
+  for (uint32_t s = 0; s < f->slot_count; s++)
+    promoted += promote[s];
+  if (!promoted)
+    return;
+
+  // Blocks storing to every slot, in lists like struct BlockLists
+  uint32_t *def_start =
+      arena_calloc(&f->arena, f->slot_count + 1, sizeof(uint32_t));
+  ir_block *def_blocks =
+      arena_alloc(&f->arena, (stores + 1) * sizeof(ir_block));
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t b = 0; b < f->order_count; b++) {
+      for (ir_value v = f->blocks[f->order[b]].first; v;
+           v = f->instrs[v].next) {
+        struct IrInstr *i = &f->instrs[v];
+        int64_t s;
+        if (i->op != ir_store || -1 == (s = promoted_slot(f, promote,
+                                                          i->ops[0])))
+          continue;
+        if (pass)
+          def_blocks[def_start[s]++] = f->order[b];
+        else
+          def_start[s + 1]++;
+      }
+    }
+    // Prefix sums for the first pass, the second one shifts every start to
+    // the next list and they are shifted back below.
+    if (!pass) {
+      for (uint32_t s = 0; s < f->slot_count; s++)
+        def_start[s + 1] += def_start[s];
+    }
+  }
+  for (uint32_t s = f->slot_count; s > 0; s--)
+    def_start[s] = def_start[s - 1];
+  def_start[0] = 0;
+
+  struct BlockLists df = dominance_frontiers(f);
+  // Tags are slot + 1 so zeroed entries match no slot
+  uint32_t *has_phi = arena_calloc(&f->arena, f->block_count, sizeof(uint32_t));
+  uint32_t *queued = arena_calloc(&f->arena, f->block_count, sizeof(uint32_t));
+  ir_block *work = arena_alloc(&f->arena, f->block_count * sizeof(ir_block));
+  for (uint32_t s = 0; s < f->slot_count; s++) {
+    if (!promote[s])
+      continue;
+    uint32_t count = 0;
+    for (uint32_t d = def_start[s]; d < def_start[s + 1]; d++) {
+      if (queued[def_blocks[d]] != s + 1) {
+        queued[def_blocks[d]] = s + 1;
+        work[count++] = def_blocks[d];
+      }
+    }
+    for (; count > 0;) {
+      ir_block b = work[--count];
+      for (uint32_t d = df.start[b]; d < df.start[b + 1]; d++) {
+        ir_block frontier = df.items[d];
+        if (!frontier || has_phi[frontier] == s + 1)
+          continue;
+        has_phi[frontier] = s + 1;
+        uint32_t preds = f->blocks[frontier].pred_count;
+        ir_value v = ir_prepend(f, frontier, ir_phi, preds);
+        struct IrInstr *phi = &f->instrs[v];
+        phi->op_count = 0;
+        phi->incoming = arena_alloc(&f->arena, preds * sizeof(ir_block));
+        phi->imm = s;
+        if (queued[frontier] != s + 1) {
+          queued[frontier] = s + 1;
+          work[count++] = frontier;
+        }
+      }
+    }
+  }
+
+  // Values of the slots on entry
+  ir_value undef = ir_prepend(f, 1, ir_undef, 0);
+  ir_value *current = arena_alloc(&f->arena, f->slot_count * sizeof(ir_value));
+  for (uint32_t s = 0; s < f->slot_count; s++) {
+    current[s] = undef;
+    if (promote[s] && f->slots[s].argument >= 0) {
+      current[s] = ir_prepend(f, 1, ir_arg, 0);
+      f->instrs[current[s]].imm = f->slots[s].argument;
+      f->instrs[current[s]].size = f->slots[s].size;
+    }
+  }
+
+  // Renames along the dominator tree. Every block logs the values it
+  // replaces, which are restored once its subtree is done.
+  struct BlockLists tree = dominator_tree(f);
+  ir_value *map =
+      arena_calloc(&f->arena, f->instr_count + stores, sizeof(ir_value));
+  struct {
+    uint32_t slot;
+    ir_value value;
+  } *log = arena_alloc(&f->arena, (f->instr_count + 1) * sizeof(*log));
+  struct {
+    ir_block block;
+    uint32_t child;
+    uint32_t log;
+  } *stack = arena_alloc(&f->arena, f->block_count * sizeof(*stack));
+  uint32_t log_size = 0;
+  uint32_t depth = 0;
+  stack[depth++].block = 1;
+  stack[0].child = UINT32_MAX;
+  for (; depth > 0;) {
+    ir_block b = stack[depth - 1].block;
+    if (UINT32_MAX == stack[depth - 1].child) {
+      stack[depth - 1].child = tree.start[b];
+      stack[depth - 1].log = log_size;
+      for (ir_value v = f->blocks[b].first; v;) {
+        struct IrInstr *i = &f->instrs[v];
+        ir_value next = i->next;
+        int64_t s;
+        if (i->op == ir_phi) {
+          log[log_size].slot = i->imm;
+          log[log_size++].value = current[i->imm];
+          current[i->imm] = v;
+        } else if (i->op == ir_load &&
+                   -1 != (s = promoted_slot(f, promote, i->ops[0]))) {
+          map[v] = current[s];
+          ir_remove(f, v);
+        } else if (i->op == ir_store &&
+                   -1 != (s = promoted_slot(f, promote, i->ops[0]))) {
+          ir_value value = i->ops[1];
+          // Stores to 32-bit variables truncate
+          if (4 == i->size) {
+            ir_value z = ir_insert_before(f, v, ir_zext, 1);
+            f->instrs[z].ops[0] = value;
+            value = z;
+          }
+          log[log_size].slot = s;
+          log[log_size++].value = current[s];
+          current[s] = value;
+          ir_remove(f, v);
+        }
+        v = next;
+      }
+      ir_block successors[2];
+      int n = ir_successors(f, b, successors);
+      for (int j = 0; j < n; j++) {
+        for (ir_value v = f->blocks[successors[j]].first;
+             v && f->instrs[v].op == ir_phi; v = f->instrs[v].next) {
+          struct IrInstr *phi = &f->instrs[v];
+          phi->incoming[phi->op_count] = b;
+          phi->ops[phi->op_count++] = current[phi->imm];
+        }
+      }
+    }
+    if (stack[depth - 1].child < tree.start[b + 1]) {
+      ir_block child = tree.items[stack[depth - 1].child++];
+      stack[depth].block = child;
+      stack[depth++].child = UINT32_MAX;
+      continue;
+    }
+    for (; log_size > stack[depth - 1].log;) {
+      log_size--;
+      current[log[log_size].slot] = log[log_size].value;
+    }
+    depth--;
+  }
+
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;) {
+      ir_value next = f->instrs[v].next;
+      if (-1 != promoted_slot(f, promote, v))
+        ir_remove(f, v);
+      v = next;
+    }
+  }
+  remove_phis(f, map, undef);
+}
+
+// Lattice of sccp(). Values start out unknown and only ever move down, to a
+// constant and from there to varying.
+enum { unknown, constant, varying };
+
+struct Lattice {
+  uint8_t state;
+  uint64_t value;
+};
+
+struct Propagation {
+  struct IrFunction *f;
+  struct IrUsers users;
+  struct Lattice *values;
+  // Blocks found to be executable
+  uint8_t *executable;
+  // Edges found to be executable, bit i for target[i] of the terminator
+  uint8_t *edges;
+  ir_block *blocks;
+  uint32_t block_count;
+  // Values whose lattice changed, every value is added at most twice
+  ir_value *work;
+  uint32_t work_count;
+};
+
+// Computes a operator b, returns 0 if the result is not known at compile
+// time. Division by zero is left to fault at run time, shift counts are
+// taken modulo 64 like the hardware does.
+static int fold(uint8_t operator, uint64_t a, uint64_t b, uint64_t *result) {
+  switch (operator) {
+  case operator_add:
+    *result = a + b;
+    return 1;
+  case operator_sub:
+    *result = a - b;
+    return 1;
+  case operator_mul:
+    *result = a * b;
+    return 1;
+  case operator_div:
+    if (!b)
+      return 0;
+    *result = a / b;
+    return 1;
+  case operator_mod:
+    if (!b)
+      return 0;
+    *result = a % b;
+    return 1;
+  case operator_shl:
+    *result = a << (b & 63);
+    return 1;
+  case operator_shr:
+    *result = a >> (b & 63);
+    return 1;
+  case operator_and:
+    *result = a & b;
+    return 1;
+  case operator_or:
+    *result = a | b;
+    return 1;
+  case operator_xor:
+    *result = a ^ b;
+    return 1;
+  case operator_eq:
+    *result = a == b;
+    return 1;
+  case operator_ne:
+    *result = a != b;
+    return 1;
+  case operator_lt:
+    *result = a < b;
+    return 1;
+  case operator_le:
+    *result = a <= b;
+    return 1;
+  case operator_gt:
+    *result = a > b;
+    return 1;
+  case operator_ge:
+    *result = a >= b;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void lower_lattice(struct Propagation *p, ir_value v, uint8_t state,
+                          uint64_t value) {
+  struct Lattice *l = &p->values[v];
+  if (constant == state && constant == l->state && l->value != value)
+    state = varying;
+  if (state <= l->state)
+    return;
+  l->state = state;
+  l->value = value;
+  p->work[p->work_count++] = v;
+}
+
+static int is_executable_edge(struct Propagation *p, ir_block from,
+                              ir_block to) {
+  struct IrInstr *t = &p->f->instrs[ir_terminator(p->f, from)];
+  return (t->target[0] == to && p->edges[from] & 1) ||
+         (t->op == ir_branch && t->target[1] == to && p->edges[from] & 2);
+}
+
+static void evaluate(struct Propagation *p, ir_value v);
+
+static void mark_edge(struct Propagation *p, ir_block from, int successor) {
+  struct IrFunction *f = p->f;
+  if (p->edges[from] & 1 << successor)
+    return;
+  p->edges[from] |= 1 << successor;
+  ir_block to = f->instrs[ir_terminator(f, from)].target[successor];
+  if (!p->executable[to]) {
+    p->executable[to] = 1;
+    p->blocks[p->block_count++] = to;
+    return;
+  }
+  // Only the phis see the new edge
+  for (ir_value v = f->blocks[to].first; v && f->instrs[v].op == ir_phi;
+       v = f->instrs[v].next)
+    evaluate(p, v);
+}
+
+static void evaluate(struct Propagation *p, ir_value v) {
+  struct IrFunction *f = p->f;
+  struct IrInstr *i = &f->instrs[v];
+  switch (i->op) {
+  case ir_const:
+    lower_lattice(p, v, constant, i->imm);
+    break;
+  case ir_binary: {
+    struct Lattice *a = &p->values[i->ops[0]];
+    struct Lattice *b = &p->values[i->ops[1]];
+    uint64_t result;
+    if ((i->operator== operator_mul || i->operator== operator_and) &&
+        ((constant == a->state && !a->value) ||
+         (constant == b->state && !b->value)))
+      lower_lattice(p, v, constant, 0);
+    // These give the same for a value with itself as for 0 with 0
+    else if ((is_comparison(i->operator) || i->operator== operator_sub ||
+              i->operator== operator_xor) &&
+             i->ops[0] == i->ops[1] && fold(i->operator, 0, 0, &result))
+      lower_lattice(p, v, constant, result);
+    else if (varying == a->state || varying == b->state)
+      lower_lattice(p, v, varying, 0);
+    else if (unknown == a->state || unknown == b->state)
+      break;
+    else if (fold(i->operator, a->value, b->value, &result))
+      lower_lattice(p, v, constant, result);
+    else
+      lower_lattice(p, v, varying, 0);
+    break;
+  }
+  case ir_zext: {
+    struct Lattice *a = &p->values[i->ops[0]];
+    lower_lattice(p, v, a->state, (uint32_t)a->value);
+    break;
+  }
+  case ir_phi: {
+    uint8_t state = unknown;
+    uint64_t value = 0;
+    for (uint32_t o = 0; o < i->op_count && varying != state; o++) {
+      struct Lattice *a = &p->values[i->ops[o]];
+      if (!is_executable_edge(p, i->incoming[o], i->block) ||
+          unknown == a->state)
+        continue;
+      if (varying == a->state || (constant == state && value != a->value))
+        state = varying;
+      else
+        state = constant;
+      value = a->value;
+    }
+    lower_lattice(p, v, state, value);
+    break;
+  }
+  case ir_jump:
+    mark_edge(p, i->block, 0);
+    break;
+  case ir_branch: {
+    struct Lattice *a = &p->values[i->ops[0]];
+    if (constant == a->state) {
+      mark_edge(p, i->block, !a->value);
+    } else if (varying == a->state) {
+      mark_edge(p, i->block, 0);
+      mark_edge(p, i->block, 1);
+    }
+    break;
+  }
+  case ir_store:
+  case ir_asm:
+  case ir_ret:
+    break;
+  default:
+    // Undefined values are taken to be anything so that a branch on them
+    // keeps both of its successors
+    lower_lattice(p, v, varying, 0);
+    break;
+  }
+}
+
+void sccp(struct IrFunction *f) {
+  struct Propagation p = {.f = f};
+  p.users = ir_users(f);
+  p.values = arena_calloc(&f->arena, f->instr_count, sizeof(struct Lattice));
+  p.executable = arena_calloc(&f->arena, f->block_count, 1);
+  p.edges = arena_calloc(&f->arena, f->block_count, 1);
+  p.blocks = arena_alloc(&f->arena, f->block_count * sizeof(ir_block));
+  p.work = arena_alloc(&f->arena, 2 * f->instr_count * sizeof(ir_value));
+  p.executable[1] = 1;
+  p.blocks[p.block_count++] = 1;
+  for (; p.block_count || p.work_count;) {
+    if (p.work_count) {
+      ir_value v = p.work[--p.work_count];
+      for (uint32_t u = p.users.start[v]; u < p.users.start[v + 1]; u++) {
+        ir_value user = p.users.users[u];
+        if (p.executable[f->instrs[user].block])
+          evaluate(&p, user);
+      }
+      continue;
+    }
+    ir_block b = p.blocks[--p.block_count];
+    for (ir_value v = f->blocks[b].first; v; v = f->instrs[v].next)
+      evaluate(&p, v);
+  }
+
+  // Constants replace the instructions computing them. Phis have to stay in
+  // front of their block, so constant phis are replaced by a new constant.
+  int changed = 0;
+  uint32_t phi_count = 0;
+  ir_value *phis = p.work;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    if (!p.executable[f->order[b]])
+      continue;
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if (i->op == ir_phi && constant == p.values[v].state) {
+        phis[phi_count++] = v;
+      } else if ((i->op == ir_binary || i->op == ir_zext) &&
+                 constant == p.values[v].state) {
+        i->op = ir_const;
+        i->op_count = 0;
+        i->imm = p.values[v].value;
+      } else if (i->op == ir_branch &&
+                 (constant == p.values[i->ops[0]].state ||
+                  i->target[0] == i->target[1])) {
+        ir_block target = i->target[0];
+        if (constant == p.values[i->ops[0]].state)
+          target = i->target[!p.values[i->ops[0]].value];
+        i->op = ir_jump;
+        i->op_count = 0;
+        i->target[0] = target;
+        changed = 1;
+      }
+    }
+  }
+  for (uint32_t n = 0; n < phi_count; n++) {
+    ir_value c = ir_prepend(f, 1, ir_const, 0);
+    f->instrs[c].imm = p.values[phis[n]].value;
+    phis[n + phi_count] = c;
+  }
+  ir_value *map = arena_calloc(&f->arena, f->instr_count + 1,
+                               sizeof(ir_value));
+  for (uint32_t n = 0; n < phi_count; n++) {
+    map[phis[n]] = phis[n + phi_count];
+    ir_remove(f, phis[n]);
+  }
+  if (changed)
+    ir_cfg(f);
+  if (changed || phi_count)
+    remove_phis(f, map, IR_NONE);
+}
+
+// What an instruction computes, two instructions with the same expression
+// compute the same value. Loads also depend on the state of memory.
+struct Expression {
+  uint8_t op;
+  uint8_t operator;
+  uint8_t size;
+  int64_t imm;
+  ir_value ops[2];
+  uint32_t memory;
+};
+
+struct Numbered {
+  struct Expression expression;
+  uint32_t hash;
+  ir_value value;
+  // Next entry in the same bucket
+  uint32_t next;
+};
+
+// Scoped hash table of the expressions computed by the dominators of the
+// current block. Entries are removed in the reverse order they are added,
+// so every bucket is a stack.
+struct Numbering {
+  uint32_t *buckets;
+  uint32_t mask;
+  struct Numbered *entries;
+  uint32_t count;
+};
+
+static int is_commutative(uint8_t operator) {
+  switch (operator) {
+  case operator_add:
+  case operator_mul:
+  case operator_and:
+  case operator_or:
+  case operator_xor:
+  case operator_eq:
+  case operator_ne:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Writes the expression v computes to x, returns 0 if v can not be replaced
+// by an earlier instruction. The memory a load depends on is left to the
+// caller.
+static int expression_of(struct IrFunction *f, ir_value v,
+                         struct Expression *x) {
+  struct IrInstr *i = &f->instrs[v];
+  *x = (struct Expression){.op = i->op};
+  switch (i->op) {
+  case ir_const:
+  case ir_slot:
+    x->imm = i->imm;
+    return 1;
+  case ir_undef:
+    return 1;
+  case ir_arg:
+    x->imm = i->imm;
+    x->size = i->size;
+    return 1;
+  case ir_binary:
+    x->operator= i->operator;
+    x->ops[0] = i->ops[0];
+    x->ops[1] = i->ops[1];
+    if (is_commutative(i->operator) && x->ops[0] > x->ops[1]) {
+      x->ops[0] = i->ops[1];
+      x->ops[1] = i->ops[0];
+    }
+    return 1;
+  case ir_zext:
+    x->ops[0] = i->ops[0];
+    return 1;
+  case ir_load:
+    x->ops[0] = i->ops[0];
+    x->imm = i->imm;
+    x->size = i->size;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static uint32_t hash_expression(struct Expression *x) {
+  uint64_t h = x->op | x->operator<< 8 | x->size << 16;
+  uint64_t words[] = {x->imm, x->ops[0], x->ops[1], x->memory};
+  for (size_t w = 0; w < sizeof(words) / sizeof(words[0]); w++)
+    h = (h ^ words[w]) * 0x100000001b3;
+  return h ^ h >> 32;
+}
+
+static int same_expression(struct Expression *a, struct Expression *b) {
+  return a->op == b->op && a->operator== b->operator&& a->size == b->size &&
+         a->imm == b->imm && a->ops[0] == b->ops[0] && a->ops[1] == b->ops[1] &&
+         a->memory == b->memory;
+}
+
+static ir_value find_expression(struct Numbering *n, struct Expression *x,
+                                uint32_t hash) {
+  for (uint32_t e = n->buckets[hash & n->mask]; e; e = n->entries[e].next) {
+    if (n->entries[e].hash == hash &&
+        same_expression(&n->entries[e].expression, x))
+      return n->entries[e].value;
+  }
+  return IR_NONE;
+}
+
+static void add_expression(struct Numbering *n, struct Expression *x,
+                           uint32_t hash, ir_value v) {
+  uint32_t e = ++n->count;
+  n->entries[e] = (struct Numbered){*x, hash, v, n->buckets[hash & n->mask]};
+  n->buckets[hash & n->mask] = e;
+}
+
+// Whether the 4 bytes of v that a store writes read back as v.
+static int fits_u32(struct IrFunction *f, ir_value v) {
+  struct IrInstr *i = &f->instrs[v];
+  return i->op == ir_zext || (i->op == ir_load && 4 == i->size) ||
+         (i->op == ir_const && i->imm == (int64_t)(uint32_t)i->imm);
+}
+
+// Memory that loads and stores access. A slot that does not escape is only
+// accessed by its own loads and stores, so every range of it they access is a
+// location of its own. A slot that escapes, or is accessed by overlapping
+// ranges, is one location.
+struct Locations {
+  // Location of every load and store of a slot numbered from 1, 0 for the
+  // other instructions
+  uint32_t *of;
+  uint32_t count;
+  // Locations that may be accessed through pointers
+  uint8_t *escaped;
+};
+
+struct Access {
+  uint32_t slot;
+  uint32_t size;
+  int64_t imm;
+  ir_value v;
+};
+
+static int compare_access(const void *a, const void *b) {
+  const struct Access *x = a;
+  const struct Access *y = b;
+  if (x->slot != y->slot)
+    return x->slot < y->slot ? -1 : 1;
+  if (x->imm != y->imm)
+    return x->imm < y->imm ? -1 : 1;
+  return (x->size > y->size) - (x->size < y->size);
+}
+
+static struct Locations memory_locations(struct IrFunction *f) {
+  uint8_t *escaped = escaped_slots(f);
+  struct Access *accesses =
+      arena_alloc(&f->arena, f->instr_count * sizeof(struct Access));
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if ((i->op == ir_load || i->op == ir_store) &&
+          f->instrs[i->ops[0]].op == ir_slot)
+        accesses[count++] = (struct Access){f->instrs[i->ops[0]].imm,
+                                            i->size, i->imm, v};
+    }
+  }
+  qsort(accesses, count, sizeof(struct Access), compare_access);
+
+  struct Locations l = {0};
+  l.of = arena_calloc(&f->arena, f->instr_count, sizeof(uint32_t));
+  l.escaped = arena_calloc(&f->arena, count + 1, 1);
+  for (uint32_t first = 0; first < count;) {
+    uint32_t slot = accesses[first].slot;
+    int whole = escaped[slot];
+    uint32_t end = first + 1;
+    // Sorted by offset, a range can only overlap another one if it overlaps
+    // the one in front of it
+    for (; end < count && accesses[end].slot == slot; end++) {
+      struct Access *a = &accesses[end - 1];
+      struct Access *b = &accesses[end];
+      if (b->imm < a->imm + a->size && (b->imm != a->imm || b->size != a->size))
+        whole = 1;
+    }
+    for (uint32_t a = first; a < end; a++) {
+      if (a == first || (!whole && (accesses[a].imm != accesses[a - 1].imm ||
+                                    accesses[a].size != accesses[a - 1].size)))
+        l.escaped[++l.count] = escaped[slot];
+      l.of[accesses[a].v] = l.count;
+    }
+    first = end;
+  }
+  return l;
+}
+
+// Versions of memory, every change of memory is numbered from one counter.
+// The version of a location is the newest change that may have written it.
+struct Memory {
+  uint32_t count;
+  // Last change of anything, for loads through pointers
+  uint32_t any;
+  // Last change of every location that escaped, by a store through a pointer
+  // or a call
+  uint32_t escaped;
+  // Last change that may have written every location, by inline assembly or
+  // by control flow from several blocks
+  uint32_t all;
+  // Last store to every location
+  uint32_t *locations;
+};
+
+static uint32_t max_version(uint32_t a, uint32_t b) { return a > b ? a : b; }
+
+// Version of the memory that the load or store v accesses.
+static uint32_t load_version(struct Memory *m, struct Locations *l,
+                             ir_value v) {
+  uint32_t location = l->of[v];
+  if (!location)
+    return max_version(m->any, m->all);
+  uint32_t version = max_version(m->locations[location], m->all);
+  return l->escaped[location] ? max_version(version, m->escaped) : version;
+}
+
+void gvn(struct IrFunction *f) {
+  struct BlockLists tree = dominator_tree(f);
+  struct Numbering n = {0};
+  uint32_t buckets = 64;
+  for (; buckets < 2 * f->instr_count;)
+    buckets *= 2;
+  n.mask = buckets - 1;
+  n.buckets = arena_calloc(&f->arena, buckets, sizeof(uint32_t));
+  n.entries = arena_alloc(&f->arena,
+                          (2 * f->instr_count + 1) * sizeof(struct Numbered));
+  ir_value *map = arena_calloc(&f->arena, f->instr_count + 1,
+                               sizeof(ir_value));
+
+  struct Locations l = memory_locations(f);
+  struct Memory m = {0};
+  m.locations = arena_calloc(&f->arena, l.count + 1, sizeof(uint32_t));
+  // Location versions replaced in the subtree of every block on the stack
+  struct {
+    uint32_t location;
+    uint32_t version;
+  } *log = arena_alloc(&f->arena, f->instr_count * sizeof(*log));
+  uint32_t log_size = 0;
+
+  struct {
+    ir_block block;
+    uint32_t child;
+    uint32_t count;
+    uint32_t log;
+    struct Memory memory;
+  } *stack = arena_alloc(&f->arena, f->block_count * sizeof(*stack));
+  uint32_t depth = 0;
+  stack[depth].block = 1;
+  stack[depth++].child = UINT32_MAX;
+  for (; depth > 0;) {
+    ir_block b = stack[depth - 1].block;
+    if (UINT32_MAX == stack[depth - 1].child) {
+      stack[depth - 1].child = tree.start[b];
+      stack[depth - 1].count = n.count;
+      stack[depth - 1].log = log_size;
+      stack[depth - 1].memory = m;
+      // Only a block with its immediate dominator as single predecessor sees
+      // memory as the dominator left it
+      if (1 != f->blocks[b].pred_count)
+        m.all = ++m.count;
+      for (ir_value v = f->blocks[b].first; v;) {
+        struct IrInstr *i = &f->instrs[v];
+        ir_value next = i->next;
+        for (uint32_t o = 0; o < i->op_count; o++)
+          i->ops[o] = ir_resolve(map, i->ops[o]);
+        struct Expression x;
+        if (i->op == ir_store) {
+          uint32_t location = l.of[v];
+          m.any = ++m.count;
+          if (location) {
+            log[log_size].location = location;
+            log[log_size++].version = m.locations[location];
+            m.locations[location] = m.count;
+          } else {
+            m.escaped = m.count;
+          }
+          // A load of what was just stored reads the stored value
+          if (8 == i->size || fits_u32(f, i->ops[1])) {
+            x = (struct Expression){
+                .op = ir_load,
+                .size = i->size,
+                .imm = i->imm,
+                .ops = {i->ops[0]},
+                .memory = load_version(&m, &l, v)};
+            add_expression(&n, &x, hash_expression(&x), i->ops[1]);
+          }
+        } else if (i->op == ir_call) {
+          m.any = m.escaped = ++m.count;
+        } else if (i->op == ir_asm) {
+          m.all = ++m.count;
+        } else if (expression_of(f, v, &x)) {
+          if (i->op == ir_load)
+            x.memory = load_version(&m, &l, v);
+          uint32_t hash = hash_expression(&x);
+          ir_value same = find_expression(&n, &x, hash);
+          if (same) {
+            map[v] = same;
+            ir_remove(f, v);
+          } else {
+            add_expression(&n, &x, hash, v);
+          }
+        }
+        v = next;
+      }
+    }
+    if (stack[depth - 1].child < tree.start[b + 1]) {
+      ir_block child = tree.items[stack[depth - 1].child++];
+      stack[depth].block = child;
+      stack[depth++].child = UINT32_MAX;
+      continue;
+    }
+    // Forget what the block added, newest entries first, and go back to
+    // memory as the dominator left it. Versions are not reused.
+    for (; n.count > stack[depth - 1].count; n.count--) {
+      struct Numbered *e = &n.entries[n.count];
+      n.buckets[e->hash & n.mask] = e->next;
+    }
+    for (; log_size > stack[depth - 1].log;) {
+      log_size--;
+      m.locations[log[log_size].location] = log[log_size].version;
+    }
+    uint32_t count = m.count;
+    m = stack[depth - 1].memory;
+    m.count = count;
+    depth--;
+  }
+  remove_phis(f, map, IR_NONE);
+}
+
+// Whether a dominates b.
+static int dominates(struct IrFunction *f, ir_block a, ir_block b) {
+  for (; b && b != a; b = f->blocks[b].idom)
+    ;
+  return b == a;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// What the blocks of the loop being processed do to memory.
+struct LoopMemory {
+  int stores;
+  // Stores through pointers and calls, which may write the locations that
+  // escaped
+  int escaped_writes;
+  int calls;
+};
+
+// Whether v can be computed in the preheader instead, given that its
+// operands are. Loads need memory to not change in the loop. Instructions
+// that may fault must run in every iteration before anything else that
+// could end the program, so hoisting does not make them fault earlier.
+static int is_hoistable(struct IrFunction *f, ir_value v,
+                        struct Locations *l, uint32_t *stored,
+                        ir_block header, struct LoopMemory *m,
+                        int every_iteration) {
+  struct IrInstr *i = &f->instrs[v];
+  int may_fault = !every_iteration || m->calls || f->has_asm;
+  switch (i->op) {
+  case ir_const:
+  case ir_undef:
+  case ir_slot:
+  case ir_string:
+  case ir_zext:
+    return 1;
+  case ir_binary: {
+    struct IrInstr *divisor = &f->instrs[i->ops[1]];
+    if (i->operator!= operator_div && i->operator!= operator_mod)
+      return 1;
+    return (divisor->op == ir_const && divisor->imm) || !may_fault;
+  }
+  case ir_load: {
+    uint32_t location = l->of[v];
+    if (f->has_asm)
+      return 0;
+    if (location)
+      return stored[location] != header &&
+             !(l->escaped[location] && m->escaped_writes);
+    return !m->stores && !may_fault;
+  }
+  default:
+    return 0;
+  }
+}
+
+void licm(struct IrFunction *f) {
+  struct Locations l = memory_locations(f);
+  // Header of the loop every block was last found in
+  ir_block *loop = arena_calloc(&f->arena, f->block_count, sizeof(ir_block));
+  // Header of the loop that last stored to every location
+  uint32_t *stored = arena_calloc(&f->arena, l.count + 1, sizeof(uint32_t));
+  uint8_t *every_iteration = arena_calloc(&f->arena, f->block_count, 1);
+  ir_block *blocks = arena_alloc(&f->arena, f->order_count * sizeof(ir_block));
+  // Blocks that leave the loop or go back to the header
+  ir_block *ends =
+      arena_alloc(&f->arena, 2 * f->order_count * sizeof(ir_block));
+  uint64_t *sorted = arena_alloc(&f->arena, f->order_count * sizeof(uint64_t));
+  // Inner loops come after the loops around them in reverse postorder, they
+  // go first so what they hoist can move on out of the outer loop.
+  for (uint32_t n = f->order_count; n > 0; n--) {
+    ir_block h = f->order[n - 1];
+    struct IrBlock *header = &f->blocks[h];
+    // The loop is every block that reaches a back edge to the header
+    // without passing the header
+    uint32_t count = 0;
+    uint32_t end_count = 0;
+    blocks[count++] = h;
+    loop[h] = h;
+    for (uint32_t p = 0; p < header->pred_count; p++) {
+      ir_block pred = header->preds[p];
+      if (!dominates(f, h, pred))
+        continue;
+      ends[end_count++] = pred;
+      if (loop[pred] != h) {
+        loop[pred] = h;
+        blocks[count++] = pred;
+      }
+    }
+    if (!end_count)
+      continue;
+    for (uint32_t b = 1; b < count; b++) {
+      struct IrBlock *block = &f->blocks[blocks[b]];
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        if (loop[block->preds[p]] != h) {
+          loop[block->preds[p]] = h;
+          blocks[count++] = block->preds[p];
+        }
+      }
+    }
+    ir_block preheader = IR_NONE;
+    uint32_t outside = 0;
+    for (uint32_t p = 0; p < header->pred_count; p++) {
+      if (loop[header->preds[p]] != h) {
+        preheader = header->preds[p];
+        outside++;
+      }
+    }
+    if (1 != outside ||
+        f->instrs[ir_terminator(f, preheader)].op != ir_jump)
+      continue;
+
+    struct LoopMemory m = {0};
+    for (uint32_t b = 0; b < count; b++) {
+      ir_block s[2];
+      int successors = ir_successors(f, blocks[b], s);
+      for (int k = 0; k < successors; k++) {
+        if (loop[s[k]] != h) {
+          ends[end_count++] = blocks[b];
+          break;
+        }
+      }
+      for (ir_value v = f->blocks[blocks[b]].first; v;
+           v = f->instrs[v].next) {
+        struct IrInstr *i = &f->instrs[v];
+        if (i->op == ir_store && l.of[v]) {
+          stored[l.of[v]] = h;
+        } else if (i->op == ir_store) {
+          m.escaped_writes = 1;
+        } else if (i->op == ir_call) {
+          m.escaped_writes = m.calls = 1;
+        }
+        m.stores |= i->op == ir_store;
+      }
+      sorted[b] = (uint64_t)f->blocks[blocks[b]].order << 32 | blocks[b];
+    }
+    for (uint32_t b = 0; b < count; b++) {
+      uint32_t e = 0;
+      for (; e < end_count && dominates(f, blocks[b], ends[e]); e++)
+        ;
+      every_iteration[blocks[b]] = e == end_count;
+    }
+
+    // In reverse postorder every operand is visited before its users, so
+    // whole chains of invariant instructions move in one pass
+    qsort(sorted, count, sizeof(uint64_t), compare_u64);
+    ir_value before = ir_terminator(f, preheader);
+    for (uint32_t b = 0; b < count; b++) {
+      ir_block block = (ir_block)sorted[b];
+      for (ir_value v = f->blocks[block].first; v;) {
+        struct IrInstr *i = &f->instrs[v];
+        ir_value next = i->next;
+        uint32_t o = 0;
+        for (; o < i->op_count && loop[f->instrs[i->ops[o]].block] != h; o++)
+          ;
+        if (o == i->op_count &&
+            is_hoistable(f, v, &l, stored, h, &m, every_iteration[block]))
+          ir_move_before(f, v, before);
+        v = next;
+      }
+    }
+  }
+}
+
+// Store to a location that is later overwritten, see remove_dead_stores().
+struct LaterStore {
+  uint32_t location;
+  int64_t imm;
+  uint32_t size;
+};
+
+// Longest list of later stores a block keeps, a store that is overwritten
+// after more stores than that is kept
+#define LATER_STORES 16
+
+// Forgets the later stores to location, or to every location that escaped if
+// it is 0.
+static uint32_t forget_stores(struct LaterStore *later, uint32_t count,
+                              uint32_t location, uint8_t *escaped) {
+  uint32_t kept = 0;
+  for (uint32_t n = 0; n < count; n++) {
+    if (location ? later[n].location != location
+                 : !escaped[later[n].location])
+      later[kept++] = later[n];
+  }
+  return kept;
+}
+
+// Removes stores to slots that are never read afterwards: stores to locations
+// nothing loads from, stores overwritten later in the same block before they
+// are read, and stores that are not read before the block returns. Walks
+// every block backwards, keeping the stores and reads that follow.
+static void remove_dead_stores(struct IrFunction *f) {
+  struct Locations l = memory_locations(f);
+  uint8_t *loaded = arena_calloc(&f->arena, l.count + 1, 1);
+  // Loads through pointers and calls may read the locations that escaped
+  int escaped_loaded = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if (i->op == ir_load && l.of[v])
+        loaded[l.of[v]] = 1;
+      else if (i->op == ir_load || i->op == ir_call)
+        escaped_loaded = 1;
+    }
+  }
+
+  // Block that last read every location, as of the current point of the walk
+  ir_block *read = arena_calloc(&f->arena, l.count + 1, sizeof(ir_block));
+  struct LaterStore later[LATER_STORES];
+  for (uint32_t n = 0; n < f->order_count; n++) {
+    ir_block b = f->order[n];
+    int returns = f->instrs[f->blocks[b].last].op == ir_ret;
+    int escaped_read = 0;
+    // Inline assembly may read any slot
+    int all_read = 0;
+    uint32_t count = 0;
+    for (ir_value v = f->blocks[b].last; v;) {
+      struct IrInstr *i = &f->instrs[v];
+      ir_value prev = i->prev;
+      uint32_t location = l.of[v];
+      if (i->op == ir_store && location) {
+        int escaped = l.escaped[location];
+        int is_read = read[location] == b || all_read ||
+                      (escaped && escaped_read);
+        int dead = (!loaded[location] && !(escaped && escaped_loaded) &&
+                    !f->has_asm) ||
+                   (returns && !is_read);
+        for (uint32_t s = 0; s < count && !dead; s++) {
+          dead = later[s].location == location && later[s].imm <= i->imm &&
+                 i->imm + i->size <= later[s].imm + later[s].size;
+        }
+        if (dead)
+          ir_remove(f, v);
+        else if (count < LATER_STORES)
+          later[count++] = (struct LaterStore){location, i->imm, i->size};
+      } else if (i->op == ir_load && location) {
+        read[location] = b;
+        count = forget_stores(later, count, location, l.escaped);
+      } else if (i->op == ir_load || i->op == ir_call) {
+        escaped_read = 1;
+        count = forget_stores(later, count, 0, l.escaped);
+      } else if (i->op == ir_asm) {
+        all_read = 1;
+        count = 0;
+      }
+      v = prev;
+    }
+  }
+}
+
+// Removes the instructions no store, call, inline assembly or terminator
+// depends on.
+static void remove_dead_instructions(struct IrFunction *f) {
+  uint8_t *live = arena_calloc(&f->arena, f->instr_count, 1);
+  ir_value *work = arena_alloc(&f->arena, f->instr_count * sizeof(ir_value));
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      uint8_t op = f->instrs[v].op;
+      if (op == ir_store || op == ir_call || op == ir_asm || op >= ir_jump) {
+        live[v] = 1;
+        work[count++] = v;
+      }
+    }
+  }
+  for (; count > 0;) {
+    struct IrInstr *i = &f->instrs[work[--count]];
+    for (uint32_t o = 0; o < i->op_count; o++) {
+      if (!live[i->ops[o]]) {
+        live[i->ops[o]] = 1;
+        work[count++] = i->ops[o];
+      }
+    }
+  }
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;) {
+      ir_value next = f->instrs[v].next;
+      if (!live[v])
+        ir_remove(f, v);
+      v = next;
+    }
+  }
+}
+
+void dce(struct IrFunction *f) {
+  remove_dead_stores(f);
+  remove_dead_instructions(f);
+}
@@ -0,0 +1,36 @@
+#ifndef OPT_H
+#define OPT_H
+#include <ir.h>
+
+// Turns calls of a function to itself that are directly returned into
+// stores to its argument slots and a jump back to the start, so they run in
+// constant stack space. Functions with inline assembly or a slot whose
+// address escapes are left alone. Needs ir_cfg() and is to run before
+// mem2reg(), which turns the argument slots into phis of the loop.
+void tail_recursion(struct IrFunction *f);
+// Promotes stack slots that are only ever loaded and stored as a whole to SSA
+// values, with phis at the iterated dominance frontiers of their stores.
+// Needs ir_cfg() and ir_dominators(). Functions with inline assembly are left
+// alone as the assembly may access any slot.
+void mem2reg(struct IrFunction *f);
+// Sparse conditional constant propagation (Wegman and Zadeck). Folds values
+// that are constant on every path that can execute, turns branches on
+// constants into jumps and removes the blocks that can not execute anymore.
+// Needs ir_cfg().
+void sccp(struct IrFunction *f);
+// Global value numbering over the dominator tree. An instruction that
+// computes the same as one in a dominating block is replaced by it. Loads are
+// only the same if memory can not have changed in between, which is the case
+// within a block and along a chain of blocks with a single predecessor, and
+// a load after a store to the same address takes the stored value. Needs
+// ir_dominators().
+void gvn(struct IrFunction *f);
+// Loop-invariant code motion. Computations whose operands do not change in
+// a loop, and loads of memory the loop does not write, move to the
+// preheader of the loop. Inner loops go first. Needs ir_dominators().
+void licm(struct IrFunction *f);
+// Removes stores to stack slots that are never read afterwards, and then
+// every instruction whose result is not needed by a store, call, inline
+// assembly or terminator. Needs ir_cfg().
+void dce(struct IrFunction *f);
+#endif // OPT_H
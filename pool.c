@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <pool.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+// Tasks of queue q are q, q + n, q + 2n, ... for n queues, so a queue only
+// has to remember which of its positions are left.
+struct PoolQueue {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+};
+
+struct Pool {
+  struct PoolQueue *queues;
+  int queue_count;
+  pool_task_t task;
+  void *arg;
+};
+
+struct PoolWorker {
+  struct Pool *pool;
+  int index;
+};
+
+// Takes a task from the front of queue q if front is set, otherwise from the
+// back. Returns 0 if the queue is empty.
+static int pool_take(struct Pool *pool, int q, int front, size_t *task) {
+  struct PoolQueue *queue = &pool->queues[q];
+  int found = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    size_t position = front ? queue->head++ : --queue->tail;
+    *task = position * pool->queue_count + q;
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static void *pool_worker(void *p) {
+  struct PoolWorker *w = p;
+  struct Pool *pool = w->pool;
+  size_t task;
+  for (;;) {
+    if (pool_take(pool, w->index, 1, &task)) {
+      pool->task(pool->arg, task);
+      continue;
+    }
+    // Nothing is ever added to a queue, so once every queue has been found
+    // empty there is no work left.
+    int stolen = 0;
+    for (int i = 1; i < pool->queue_count && !stolen; i++)
+      stolen = pool_take(pool, (w->index + i) % pool->queue_count, 0, &task);
+    if (!stolen)
+      return NULL;
+    pool->task(pool->arg, task);
+  }
+}
+
+void pool_run(size_t count, int thread_count, pool_task_t task, void *arg) {
+  if (thread_count < 1)
+    thread_count = 1;
+  if ((size_t)thread_count > count)
+    thread_count = count;
+  if (thread_count <= 1) {
+    for (size_t i = 0; i < count; i++)
+      task(arg, i);
+    return;
+  }
+  struct Pool pool = {
+      .queue_count = thread_count,
+      .task = task,
+      .arg = arg,
+  };
+  pool.queues = malloc(thread_count * sizeof(struct PoolQueue));
+  struct PoolWorker *workers = malloc(thread_count * sizeof(struct PoolWorker));
+  pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+  assert(pool.queues && workers && threads && "Out of memory");
+  for (int i = 0; i < thread_count; i++) {
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    pool.queues[i].head = 0;
+    // Number of tasks congruent to i modulo thread_count
+    pool.queues[i].tail = (count - i + thread_count - 1) / thread_count;
+    workers[i] = (struct PoolWorker){.pool = &pool, .index = i};
+  }
+  // The calling thread works on the first queue itself
+  for (int i = 1; i < thread_count; i++) {
+    int rc = pthread_create(&threads[i], NULL, pool_worker, &workers[i]);
+    assert(0 == rc && "Could not create thread");
+  }
+  pool_worker(&workers[0]);
+  for (int i = 1; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+  for (int i = 0; i < thread_count; i++)
+    pthread_mutex_destroy(&pool.queues[i].lock);
+  free(threads);
+  free(workers);
+  free(pool.queues);
+}
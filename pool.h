@@ -0,0 +1,13 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+
+typedef void (*pool_task_t)(void *arg, size_t task);
+
+// Runs task(arg, i) for every i in [0, count) on up to thread_count threads.
+// Tasks are dealt out round robin to one queue per thread, each thread works
+// through its own queue from the front and steals from the back of the
+// others once it runs dry. Queues are worked in task order, so putting the
+// largest tasks first gives the best balance.
+void pool_run(size_t count, int thread_count, pool_task_t task, void *arg);
+#endif // POOL_H
@@ -0,0 +1,214 @@
+#include <scan.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+static int is_identifier_char(unsigned char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+         ('0' <= c && c <= '9') || '_' == c;
+}
+
+static int is_digit_char(unsigned char c) { return '0' <= c && c <= '9'; }
+
+static int is_space_char(unsigned char c) {
+  return ' ' == c || ('\t' <= c && c <= '\r');
+}
+
+static const char *scan_identifier_scalar(const char *p, const char *end) {
+  for (; p < end && is_identifier_char(*p); p++)
+    ;
+  return p;
+}
+
+static const char *scan_digits_scalar(const char *p, const char *end) {
+  for (; p < end && is_digit_char(*p); p++)
+    ;
+  return p;
+}
+
+static const char *scan_whitespace_scalar(const char *p, const char *end,
+                                          uint32_t *line,
+                                          const char **line_start) {
+  for (; p < end && is_space_char(*p); p++) {
+    if ('\n' == *p) {
+      (*line)++;
+      *line_start = p + 1;
+    }
+  }
+  return p;
+}
+
+#ifdef SCAN_SIMD
+static int has_avx2;
+
+// Bytes in [lo, hi] are moved to the bottom of the signed range so that a
+// single signed compare can be used for the range check.
+static inline __m128i in_range_sse2(__m128i v, char lo, char hi) {
+  __m128i t = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - lo)));
+  return _mm_cmplt_epi8(t, _mm_set1_epi8((char)(0x80 + (hi - lo) + 1)));
+}
+
+static inline __m128i identifier_mask_sse2(__m128i v) {
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i r = in_range_sse2(lower, 'a', 'z');
+  r = _mm_or_si128(r, in_range_sse2(v, '0', '9'));
+  return _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+static inline __m128i space_mask_sse2(__m128i v) {
+  __m128i r = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  return _mm_or_si128(r, in_range_sse2(v, '\t', '\r'));
+}
+
+static const char *scan_identifier_sse2(const char *p, const char *end) {
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    uint32_t m = _mm_movemask_epi8(identifier_mask_sse2(v));
+    if (0xFFFF != m)
+      return p + __builtin_ctz(~m);
+  }
+  return scan_identifier_scalar(p, end);
+}
+
+static const char *scan_digits_sse2(const char *p, const char *end) {
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    uint32_t m = _mm_movemask_epi8(in_range_sse2(v, '0', '9'));
+    if (0xFFFF != m)
+      return p + __builtin_ctz(~m);
+  }
+  return scan_digits_scalar(p, end);
+}
+
+static const char *scan_whitespace_sse2(const char *p, const char *end,
+                                        uint32_t *line,
+                                        const char **line_start) {
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    uint32_t ws = _mm_movemask_epi8(space_mask_sse2(v));
+    uint32_t nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    uint32_t n = (0xFFFF == ws) ? 16 : __builtin_ctz(~ws);
+    nl &= (1u << n) - 1;
+    if (nl) {
+      *line += __builtin_popcount(nl);
+      *line_start = p + (31 - __builtin_clz(nl)) + 1;
+    }
+    if (n < 16)
+      return p + n;
+  }
+  return scan_whitespace_scalar(p, end, line, line_start);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i in_range_avx2(__m256i v, char lo, char hi) {
+  __m256i t = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - lo)));
+  return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + (hi - lo) + 1)), t);
+}
+
+AVX2 static inline __m256i identifier_mask_avx2(__m256i v) {
+  __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i r = in_range_avx2(lower, 'a', 'z');
+  r = _mm256_or_si256(r, in_range_avx2(v, '0', '9'));
+  return _mm256_or_si256(r, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+AVX2 static inline __m256i space_mask_avx2(__m256i v) {
+  __m256i r = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+  return _mm256_or_si256(r, in_range_avx2(v, '\t', '\r'));
+}
+
+AVX2 static const char *scan_identifier_avx2(const char *p, const char *end) {
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t m = _mm256_movemask_epi8(identifier_mask_avx2(v));
+    if (0xFFFFFFFF != m)
+      return p + __builtin_ctz(~m);
+  }
+  return scan_identifier_sse2(p, end);
+}
+
+AVX2 static const char *scan_digits_avx2(const char *p, const char *end) {
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t m = _mm256_movemask_epi8(in_range_avx2(v, '0', '9'));
+    if (0xFFFFFFFF != m)
+      return p + __builtin_ctz(~m);
+  }
+  return scan_digits_sse2(p, end);
+}
+
+AVX2 static const char *scan_whitespace_avx2(const char *p, const char *end,
+                                             uint32_t *line,
+                                             const char **line_start) {
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t ws = _mm256_movemask_epi8(space_mask_avx2(v));
+    uint32_t nl =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    uint32_t n = (0xFFFFFFFF == ws) ? 32 : __builtin_ctz(~ws);
+    nl &= (uint32_t)((1ull << n) - 1);
+    if (nl) {
+      *line += __builtin_popcount(nl);
+      *line_start = p + (31 - __builtin_clz(nl)) + 1;
+    }
+    if (n < 32)
+      return p + n;
+  }
+  return scan_whitespace_sse2(p, end, line, line_start);
+}
+#endif // SCAN_SIMD
+
+void scan_init(void) {
+#ifdef SCAN_SIMD
+  __builtin_cpu_init();
+  has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+const char *scan_identifier(const char *p, const char *end) {
+#ifdef SCAN_SIMD
+  if (has_avx2)
+    return scan_identifier_avx2(p, end);
+  return scan_identifier_sse2(p, end);
+#else
+  return scan_identifier_scalar(p, end);
+#endif
+}
+
+const char *scan_digits(const char *p, const char *end) {
+#ifdef SCAN_SIMD
+  if (has_avx2)
+    return scan_digits_avx2(p, end);
+  return scan_digits_sse2(p, end);
+#else
+  return scan_digits_scalar(p, end);
+#endif
+}
+
+const char *scan_whitespace(const char *p, const char *end, uint32_t *line,
+                            const char **line_start) {
+#ifdef SCAN_SIMD
+  if (has_avx2)
+    return scan_whitespace_avx2(p, end, line, line_start);
+  return scan_whitespace_sse2(p, end, line, line_start);
+#else
+  return scan_whitespace_scalar(p, end, line, line_start);
+#endif
+}
+
+void scan_newlines(const char *p, const char *end, uint32_t *line,
+                   const char **line_start) {
+  for (; p < end;) {
+    const char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+      break;
+    (*line)++;
+    p = nl + 1;
+    *line_start = p;
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef SCAN_H
+#define SCAN_H
+#include <stdint.h>
+
+// Vectorized scanners used by the lexer. Each of them returns a pointer to
+// the first byte in [p, end) that does not belong to the run being skipped.
+// SSE2 is used on every x86_64 cpu and AVX2 when the cpu supports it, other
+// architectures fall back to scalar loops.
+
+// Has to be called once before any of the scanners are used.
+void scan_init(void);
+
+// Skips [A-Za-z0-9_]
+const char *scan_identifier(const char *p, const char *end);
+
+// Skips [0-9]
+const char *scan_digits(const char *p, const char *end);
+
+// Skips whitespace. *line is incremented for every newline that is skipped
+// and *line_start is set to the byte following the last one.
+const char *scan_whitespace(const char *p, const char *end, uint32_t *line,
+                            const char **line_start);
+
+// Same bookkeeping as scan_whitespace() for an arbitrary range, used for
+// comments and string literals.
+void scan_newlines(const char *p, const char *end, uint32_t *line,
+                   const char **line_start);
+#endif // SCAN_H
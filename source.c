@@ -0,0 +1,107 @@
+#define _FILE_OFFSET_BITS 64
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <source.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SOURCE_READ_CHUNK (1 << 20)
+// Pages are released in batches of at least this many bytes to keep the
+// number of madvise() calls down.
+#define SOURCE_RELEASE_CHUNK (1 << 20)
+
+static int source_read_fd(struct Source *s, int fd) {
+  size_t capacity = SOURCE_READ_CHUNK;
+  size_t length = 0;
+  char *buffer = malloc(capacity);
+  if (!buffer)
+    return 1;
+  for (;;) {
+    if (capacity == length) {
+      capacity *= 2;
+      char *tmp = realloc(buffer, capacity);
+      if (!tmp) {
+        free(buffer);
+        return 1;
+      }
+      buffer = tmp;
+    }
+    ssize_t rc = read(fd, buffer + length, capacity - length);
+    if (rc < 0) {
+      if (EINTR == errno)
+        continue;
+      free(buffer);
+      return 1;
+    }
+    if (0 == rc)
+      break;
+    length += rc;
+  }
+  s->data = buffer;
+  s->length = length;
+  s->is_mapped = 0;
+  s->released = 0;
+  return 0;
+}
+
+static int source_map_fd(struct Source *s, int fd) {
+  struct stat st;
+  if (0 != fstat(fd, &st))
+    return 1;
+  if (!S_ISREG(st.st_mode) || 0 == st.st_size)
+    return 1;
+  if ((uintmax_t)st.st_size > SIZE_MAX)
+    return 1;
+  size_t length = st.st_size;
+  void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (MAP_FAILED == p)
+    return 1;
+  // The lexer only ever walks forward through the file.
+  (void)madvise(p, length, MADV_SEQUENTIAL);
+  s->data = p;
+  s->length = length;
+  s->is_mapped = 1;
+  s->released = 0;
+  return 0;
+}
+
+int source_open(struct Source *s, const char *path) {
+  int fd;
+  if (0 == strcmp(path, "-"))
+    fd = STDIN_FILENO;
+  else if (-1 == (fd = open(path, O_RDONLY)))
+    return 1;
+  int rc = source_map_fd(s, fd);
+  if (rc)
+    rc = source_read_fd(s, fd);
+  if (STDIN_FILENO != fd)
+    close(fd);
+  return rc;
+}
+
+void source_close(struct Source *s) {
+  if (s->is_mapped)
+    munmap((void *)s->data, s->length);
+  else
+    free((void *)s->data);
+  s->data = NULL;
+  s->length = 0;
+}
+
+void source_release(struct Source *s, size_t offset) {
+  if (!s->is_mapped || offset > s->length)
+    return;
+  size_t page = sysconf(_SC_PAGESIZE);
+  // The mapping starts on a page boundary
+  offset &= ~(page - 1);
+  if (offset < s->released + SOURCE_RELEASE_CHUNK)
+    return;
+  (void)madvise((void *)(s->data + s->released), offset - s->released,
+                MADV_DONTNEED);
+  s->released = offset;
+}
@@ -0,0 +1,23 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+#include <stddef.h>
+
+// Read only view of a source file. Regular files are memory mapped, anything
+// that can not be mapped(pipes, stdin, ...) is read into a heap buffer. The
+// data is not NUL terminated.
+struct Source {
+  const char *data;
+  size_t length;
+  int is_mapped;
+  // Everything before this offset has been handed back by source_release()
+  size_t released;
+};
+
+// Opens path, or stdin if path is "-". Returns 0 on success.
+int source_open(struct Source *s, const char *path);
+void source_close(struct Source *s);
+// Tells the kernel that the data before offset is not needed for now. Pages
+// of mapped files are dropped and read in again if they are touched later,
+// so the data stays valid. Does nothing for heap buffers.
+void source_release(struct Source *s, size_t offset);
+#endif // SOURCE_H
@@ -0,0 +1,39 @@
+#include <arena.h>
+#include <ast.h>
+#include <codegen.h>
+#include <lexer.h>
+#include <source.h>
+#include <stdio.h>
+#include <stream.h>
+
+void compile_stream(struct Source *source, FILE *fp,
+                    struct StreamStats *stats) {
+  struct StreamStats total = {0};
+  struct LexerStream lexer_stream;
+  lexer_stream_init(&lexer_stream, source->data, source->length);
+  for (; lexer_stream_next(&lexer_stream);) {
+    struct TokenArray *tokens = &lexer_stream.tokens;
+    struct AstMark mark = ast_mark();
+    ast_index a = lex2ast_item(tokens);
+    total.items++;
+    total.tokens += tokens->count - TOKEN_LOOKAHEAD;
+    total.nodes += ast.node_count - mark.node_count;
+
+    struct CompiledData *data = NULL;
+    compile_ast(a, &data, fp);
+    if (data) {
+      compile_data(data, fp);
+      fprintf(fp, "section .text\n");
+    }
+    arena_reset(&codegen_arena);
+    // Struct definitions are needed by the items that follow them
+    if (function == ast_node(a)->type)
+      ast_release(mark);
+    // The lexer never looks back, symbol names that point into released
+    // pages are read in again when they are used.
+    source_release(source, lexer_stream.ptr - source->data);
+  }
+  lexer_stream_free(&lexer_stream);
+  if (stats)
+    *stats = total;
+}
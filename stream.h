@@ -0,0 +1,22 @@
+#ifndef STREAM_H
+#define STREAM_H
+#include <source.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Totals of a compile_stream() run
+struct StreamStats {
+  size_t items;
+  size_t tokens;
+  size_t nodes;
+};
+
+// Compiles the source one top level item at a time. Lexer, parser and
+// codegen form a pipeline that holds a single function or struct definition:
+// its tokens are lexed, parsed and written to fp, then its tokens, nodes and
+// data are released before the next item is lexed. Memory use depends on the
+// largest item instead of the size of the source. The assembly is the same as
+// compiling the whole AST, except that every function is followed by its own
+// data section. stats may be NULL.
+void compile_stream(struct Source *source, FILE *fp, struct StreamStats *stats);
+#endif // STREAM_H
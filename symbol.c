@@ -0,0 +1,139 @@
+#include <arena.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <symbol.h>
+
+#define SYMBOL_INITIAL_SLOTS 1024
+
+_Thread_local struct SymbolTable symbol_table;
+// Names are copied here since the source buffer does not outlive the parser.
+_Thread_local struct Arena symbol_arena;
+
+static uint32_t load32(const char *s) {
+  uint32_t w;
+  memcpy(&w, s, sizeof(w));
+  return w;
+}
+
+static uint64_t load64(const char *s) {
+  uint64_t w;
+  memcpy(&w, s, sizeof(w));
+  return w;
+}
+
+static uint32_t symbol_hash(const char *s, size_t length) {
+  // Eight bytes per multiply, most identifiers take a single round with two
+  // overlapping loads. Nothing outside [s, s + length) is read since a name
+  // can end at the end of a mapped file.
+  const uint64_t k = 0x9E3779B97F4A7C15ull;
+  uint64_t h = length * k;
+  size_t i = 0;
+  for (; i + 8 < length; i += 8)
+    h = (h ^ load64(s + i)) * k;
+  size_t rest = length - i;
+  uint64_t w = 0;
+  if (rest >= 4)
+    w = (uint64_t)load32(s + i) << 32 | load32(s + length - 4);
+  else if (rest)
+    w = (unsigned char)s[i] << 16 | (unsigned char)s[i + rest / 2] << 8 |
+        (unsigned char)s[length - 1];
+  h = (h ^ w) * k;
+  return h ^ h >> 32;
+}
+
+static void symbol_table_grow(struct SymbolTable *t) {
+  uint32_t slot_count = (t->slot_mask + 1) * 2;
+  free(t->slots);
+  t->slots = calloc(slot_count, sizeof(uint32_t));
+  assert(t->slots && "Out of memory");
+  t->slot_mask = slot_count - 1;
+  for (uint32_t i = 1; i < t->count; i++) {
+    uint32_t j = t->symbols[i].hash & t->slot_mask;
+    for (; t->slots[j]; j = (j + 1) & t->slot_mask)
+      ;
+    t->slots[j] = i;
+  }
+}
+
+void symbol_table_create(struct SymbolTable *t, struct Arena *names) {
+  t->capacity = SYMBOL_INITIAL_SLOTS;
+  t->symbols = malloc(t->capacity * sizeof(struct Symbol));
+  t->slots = calloc(SYMBOL_INITIAL_SLOTS, sizeof(uint32_t));
+  assert(t->symbols && t->slots && "Out of memory");
+  t->slot_mask = SYMBOL_INITIAL_SLOTS - 1;
+  t->symbols[SYMBOL_NONE] = (struct Symbol){.name = "", .length = 0};
+  t->count = 1;
+  t->names = names;
+}
+
+void symbol_table_destroy(struct SymbolTable *t) {
+  free(t->symbols);
+  free(t->slots);
+  *t = (struct SymbolTable){0};
+}
+
+static uint32_t intern(struct SymbolTable *t, const char *s, size_t length,
+                       uint32_t h) {
+  uint32_t i = h & t->slot_mask;
+  for (; t->slots[i]; i = (i + 1) & t->slot_mask) {
+    struct Symbol *sym = &t->symbols[t->slots[i]];
+    if (sym->hash == h && sym->length == length &&
+        0 == memcmp(sym->name, s, length))
+      return t->slots[i];
+  }
+  assert(length <= UINT32_MAX);
+  if (t->count == t->capacity) {
+    t->capacity *= 2;
+    t->symbols = realloc(t->symbols, t->capacity * sizeof(struct Symbol));
+    assert(t->symbols && "Out of memory");
+  }
+  uint32_t id = t->count++;
+  t->symbols[id] = (struct Symbol){
+      .name = t->names ? arena_strndup(t->names, s, length) : s,
+      .length = length,
+      .hash = h,
+  };
+  t->slots[i] = id;
+  // Keep the load factor below one half
+  if (t->count * 2 > t->slot_mask + 1)
+    symbol_table_grow(t);
+  return id;
+}
+
+uint32_t symbol_table_intern(struct SymbolTable *t, const char *s,
+                             size_t length) {
+  return intern(t, s, length, symbol_hash(s, length));
+}
+
+void symbol_table_merge(struct SymbolTable *t, uint32_t *remap) {
+  remap[SYMBOL_NONE] = SYMBOL_NONE;
+  for (uint32_t i = 1; i < t->count; i++) {
+    struct Symbol *sym = &t->symbols[i];
+    remap[i] = intern(&symbol_table, sym->name, sym->length, sym->hash);
+  }
+}
+
+void symbol_table_init(void) {
+  if (symbol_table.symbols)
+    return;
+  symbol_table_create(&symbol_table, &symbol_arena);
+  uint32_t r = symbol_intern("asm", 3);
+  assert(SYMBOL_ASM == r);
+}
+
+void symbol_table_free(void) {
+  symbol_table_destroy(&symbol_table);
+  arena_free(&symbol_arena);
+}
+
+uint32_t symbol_intern(const char *s, size_t length) {
+  return symbol_table_intern(&symbol_table, s, length);
+}
+
+const char *symbol_name(uint32_t symbol) {
+  assert(symbol < symbol_table.count);
+  return symbol_table.symbols[symbol].name;
+}
+
+uint32_t symbol_count(void) { return symbol_table.count; }
@@ -0,0 +1,53 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+#include <arena.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Identifiers are interned by the lexer so that the rest of the compiler can
+// compare names as integers. Symbol 0 is never handed out and is used to
+// mean "no symbol".
+#define SYMBOL_NONE 0
+// Builtin functions are interned up front so they have fixed ids.
+#define SYMBOL_ASM 1
+
+struct Symbol {
+  const char *name;
+  uint32_t length;
+  uint32_t hash;
+};
+
+struct SymbolTable {
+  struct Symbol *symbols;
+  uint32_t count;
+  uint32_t capacity;
+  // Open addressing table of symbol ids
+  uint32_t *slots;
+  uint32_t slot_mask;
+  // Names are copied into this arena. If it is NULL the names point at the
+  // interned text, which then has to outlive the table.
+  struct Arena *names;
+};
+
+// Tables other than the global one are used by lexer threads, which merge
+// their symbols into the global table once they are done.
+void symbol_table_create(struct SymbolTable *t, struct Arena *names);
+void symbol_table_destroy(struct SymbolTable *t);
+uint32_t symbol_table_intern(struct SymbolTable *t, const char *s,
+                             size_t length);
+// Interns every symbol of t into the global table, remap[i] is set to the
+// global id of symbol i of t.
+void symbol_table_merge(struct SymbolTable *t, uint32_t *remap);
+
+// Every thread has a table of its own, so compilation units on different
+// threads do not share symbol ids.
+extern _Thread_local struct SymbolTable symbol_table;
+
+void symbol_table_init(void);
+// Releases the table of the current thread, symbol_table_init() starts a new
+// one.
+void symbol_table_free(void);
+uint32_t symbol_intern(const char *s, size_t length);
+const char *symbol_name(uint32_t symbol);
+uint32_t symbol_count(void);
+#endif // SYMBOL_H
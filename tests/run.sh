@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compiles every program in this directory with each set of options, runs it
+# and compares its exit code with the "// expect" line it starts with.
+cd "$(dirname "$0")" || exit 1
+if ! command -v nasm >/dev/null; then
+  echo "nasm not found, programs not run"
+  exit 0
+fi
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+for options in "" "-O0" "-inline 0" "-inline 1000" "-omit-frame-pointer" \
+  "-sysv" "-sysv -omit-frame-pointer" "-s"; do
+  for program in *.src; do
+    expected=$(sed -n '1s,^// expect \([0-9]*\)$,\1,p' "$program")
+    if ! ../compiler $options "$program" >"$dir/code.asm" ||
+      ! nasm -f elf64 -o "$dir/code.o" "$dir/code.asm" ||
+      ! ld -o "$dir/code" "$dir/code.o"; then
+      echo "$program $options: not built"
+      failed=1
+      continue
+    fi
+    "$dir/code"
+    code=$?
+    if [ "$code" != "$expected" ]; then
+      echo "$program $options: exited with $code instead of $expected"
+      failed=1
+    fi
+  done
+done
+[ 0 = $failed ] && echo "PROGRAMS COMPLETED"
+exit $failed
@@ -0,0 +1,1821 @@
+#include <arena.h>
+#include <assert.h>
+#include <ast.h>
+#include <codegen.h>
+#include <ir.h>
+#include <stdlib.h>
+#include <string.h>
+#include <symbol.h>
+#include <x86.h>
+
+// Registers are assigned by linear scan over live intervals (Poletto and
+// Sarkar). Instructions are numbered in the order blocks are emitted, an
+// instruction reads its operands at 2n and defines its result at 2n + 1.
+// Every value has a single interval from its definition to its last use or
+// the end of the last block it is live out of. Values that do not get a
+// register live on the stack for their whole lifetime.
+//
+// rax, rcx and rdx are never allocated. rax holds the result of calls and
+// returns, and all three are scratch registers for the instructions that
+// need one.
+
+enum {
+  rax,
+  rcx,
+  rdx,
+  rbx,
+  rsp,
+  rbp,
+  rsi,
+  rdi,
+  r8,
+  r9,
+  r10,
+  r11,
+  r12,
+  r13,
+  r14,
+  r15,
+};
+
+static const char *reg64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp",
+                              "rsi", "rdi", "r8",  "r9",  "r10", "r11",
+                              "r12", "r13", "r14", "r15"};
+static const char *reg32[] = {"eax",  "ecx",  "edx",  "ebx",  "esp",  "ebp",
+                              "esi",  "edi",  "r8d",  "r9d",  "r10d", "r11d",
+                              "r12d", "r13d", "r14d", "r15d"};
+static const char *reg8[] = {"al",   "cl",   "dl",   "bl",   "spl",  "bpl",
+                             "sil",  "dil",  "r8b",  "r9b",  "r10b", "r11b",
+                             "r12b", "r13b", "r14b", "r15b"};
+
+// Caller-saved registers come first, so values that are not live across a
+// call leave the callee-saved ones alone and cost no push and pop.
+static const uint8_t allocatable[] = {rsi, rdi, r8,  r9,  r10, r11,
+                                      rbx, r12, r13, r14, r15};
+#define ALLOCATABLE_COUNT (sizeof(allocatable) / sizeof(allocatable[0]))
+#define CALLEE_SAVED (1u << rbx | 1u << r12 | 1u << r13 | 1u << r14 | 1u << r15)
+#define NO_REGISTER -1
+
+// Condition codes of the comparisons, all values are unsigned
+static const char *condition_codes[] = {
+    [operator_eq] = "e",  [operator_ne] = "ne", [operator_lt] = "b",
+    [operator_le] = "be", [operator_gt] = "a",  [operator_ge] = "ae",
+};
+
+struct Interval {
+  uint32_t from;
+  uint32_t to;
+};
+
+struct Location {
+  int8_t reg;
+  // Offset from rbp if reg is NO_REGISTER
+  int32_t offset;
+};
+
+struct Emitter {
+  struct IrFunction *f;
+  FILE *fp;
+  // Number of every instruction in emission order
+  uint32_t *position;
+  // Number of operands that refer to every value, except for a comparison
+  // that is fused into the branch right after it
+  uint32_t *uses;
+  struct Interval *interval;
+  struct Location *location;
+  // Callee-saved registers pushed by the prologue, in push order
+  uint8_t saved[ALLOCATABLE_COUNT];
+  int saved_count;
+  char (*labels)[10];
+  // Block a jump to every block ends up in, see jump_target()
+  ir_block *forward;
+  // Split edge blocks whose phi moves the branch in front of them makes, see
+  // find_early_moves()
+  uint8_t *early_moves;
+  // Block emitted after the current one, jumps to it fall through
+  ir_block next;
+  // Whether calls in tail position can reuse the frame of the function
+  int tail_calls;
+  // rbp is set up by the prologue, otherwise the frame is addressed through
+  // rsp, see frame_operand()
+  int frame_pointer;
+  // Bytes the prologue subtracts from rsp below the saved registers
+  int32_t frame_size;
+  // Distance from rsp to where rbp would point, without pushed arguments
+  int32_t rsp_offset;
+  // Bytes pushed for the call being set up
+  int32_t pushed;
+  // Interval of every slot, see slot_intervals()
+  struct Interval *slot_interval;
+};
+
+// Constants and addresses are recomputed where they are used instead of
+// occupying a register.
+static int is_rematerialized(struct IrInstr *i) {
+  switch (i->op) {
+  case ir_const:
+  case ir_undef:
+  case ir_slot:
+  case ir_string:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int has_result(struct IrInstr *i) {
+  switch (i->op) {
+  case ir_arg:
+  case ir_load:
+  case ir_binary:
+  case ir_zext:
+  case ir_call:
+  case ir_phi:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// With codegen_options.sysv_abi the first arguments are passed in these, as
+// in the System V ABI
+static const uint8_t argument_registers[] = {rdi, rsi, rdx, rcx, r8, r9};
+#define ARGUMENT_REGISTER_COUNT                                                \
+  (sizeof(argument_registers) / sizeof(argument_registers[0]))
+
+// Register an argument is passed in, NO_REGISTER if it is passed on the stack.
+static int argument_register(uint32_t argument) {
+  if (!codegen_options.sysv_abi || argument >= ARGUMENT_REGISTER_COUNT)
+    return NO_REGISTER;
+  return argument_registers[argument];
+}
+
+// Arguments on the stack are where the caller pushed them, above the return
+// address and the saved rbp.
+static int32_t argument_offset(uint32_t argument) {
+  if (codegen_options.sysv_abi)
+    argument -= ARGUMENT_REGISTER_COUNT;
+  return 0x10 + 8 * argument;
+}
+
+// Writes the memory operand at offset from where rbp points to s. Functions
+// without a frame pointer address it through rsp instead, which is where rbp
+// would point minus what the prologue and the pushes since then took.
+static const char *frame_operand(struct Emitter *e, int32_t offset, char *s) {
+  if (e->frame_pointer)
+    sprintf(s, "[rbp%+d]", offset);
+  else
+    sprintf(s, "[rsp%+d]", offset + e->rsp_offset + e->pushed);
+  return s;
+}
+
+static int fits_imm32(int64_t n) { return n == (int32_t)n; }
+
+static uint32_t block_end(struct Emitter *e, ir_block b) {
+  return 2 * e->position[e->f->blocks[b].last];
+}
+
+// Extends the interval of v, which is live into block b, to the end of every
+// block on a path from its definition to b.
+static void live_in(struct Emitter *e, ir_value v, ir_block b,
+                    ir_value *visited, ir_block *work) {
+  struct IrFunction *f = e->f;
+  ir_block defined = f->instrs[v].block;
+  struct Interval *interval = &e->interval[v];
+  if (b == defined || visited[b] == v)
+    return;
+  uint32_t depth = 0;
+  visited[b] = v;
+  work[depth++] = b;
+  for (; depth > 0;) {
+    struct IrBlock *block = &f->blocks[work[--depth]];
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      ir_block pred = block->preds[p];
+      if (block_end(e, pred) > interval->to)
+        interval->to = block_end(e, pred);
+      if (pred != defined && visited[pred] != v) {
+        visited[pred] = v;
+        work[depth++] = pred;
+      }
+    }
+  }
+}
+
+// Computes the interval of every value. A value is live out of every block
+// on a path from its definition to a use, these are found by walking
+// predecessors back from the use until the defining block. Operands of phis
+// are used at the end of the predecessor they come from.
+static void build_intervals(struct Emitter *e) {
+  struct IrFunction *f = e->f;
+  e->position = arena_calloc(&f->arena, f->instr_count, sizeof(uint32_t));
+  e->interval = arena_calloc(&f->arena, f->instr_count, sizeof(*e->interval));
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      e->position[v] = count++;
+      e->interval[v].from = e->interval[v].to = 2 * e->position[v] + 1;
+    }
+  }
+
+  struct IrUsers users = ir_users(f);
+  e->uses = arena_calloc(&f->arena, f->instr_count, sizeof(uint32_t));
+  // Blocks already walked for a value, so every value walks a block once
+  ir_value *visited = arena_calloc(&f->arena, f->block_count,
+                                   sizeof(ir_value));
+  ir_block *work = arena_alloc(&f->arena, f->block_count * sizeof(ir_block));
+  for (ir_value v = 1; v < f->instr_count; v++) {
+    e->uses[v] = users.start[v + 1] - users.start[v];
+    struct IrInstr *i = &f->instrs[v];
+    // A comparison only used by the branch after it is not computed, the
+    // branch compares the operands itself and jumps on the flags
+    if (1 == e->uses[v] && i->op == ir_binary && is_comparison(i->operator) &&
+        i->next == users.users[users.start[v]] &&
+        f->instrs[i->next].op == ir_branch)
+      e->uses[v] = 0;
+  }
+  for (ir_value v = 1; v < f->instr_count; v++) {
+    if (is_rematerialized(&f->instrs[v]))
+      continue;
+    struct Interval *interval = &e->interval[v];
+    for (uint32_t u = users.start[v]; u < users.start[v + 1]; u++) {
+      ir_value user = users.users[u];
+      struct IrInstr *i = &f->instrs[user];
+      if (i->op != ir_phi) {
+        // Operands of a fused comparison are read by the branch
+        uint32_t read = 2 * e->position[user];
+        if (i->op == ir_binary && !e->uses[user] && is_comparison(i->operator))
+          read += 2;
+        if (read > interval->to)
+          interval->to = read;
+        live_in(e, v, i->block, visited, work);
+        continue;
+      }
+      for (uint32_t o = 0; o < i->op_count; o++) {
+        if (i->ops[o] != v)
+          continue;
+        if (block_end(e, i->incoming[o]) > interval->to)
+          interval->to = block_end(e, i->incoming[o]);
+        live_in(e, v, i->incoming[o], visited, work);
+      }
+    }
+  }
+}
+
+// Whether one of the sorted positions lies strictly inside the interval.
+static int crosses(struct Interval *interval, uint32_t *positions,
+                   uint32_t count) {
+  uint32_t low = 0;
+  uint32_t high = count;
+  for (; low < high;) {
+    uint32_t middle = low + (high - low) / 2;
+    if (positions[middle] <= interval->from)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low < count && positions[low] < interval->to;
+}
+
+static void allocate_registers(struct Emitter *e) {
+  struct IrFunction *f = e->f;
+  e->location = arena_alloc(&f->arena, f->instr_count * sizeof(*e->location));
+  // Calls clobber the caller-saved registers, inline assembly all of them
+  uint32_t *calls = arena_alloc(&f->arena, f->instr_count * sizeof(uint32_t));
+  uint32_t *asms = arena_alloc(&f->arena, f->instr_count * sizeof(uint32_t));
+  uint32_t call_count = 0;
+  uint32_t asm_count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      e->location[v] = (struct Location){.reg = NO_REGISTER};
+      if (f->instrs[v].op == ir_call)
+        calls[call_count++] = 2 * e->position[v] + 1;
+      if (f->instrs[v].op == ir_asm)
+        asms[asm_count++] = 2 * e->position[v] + 1;
+    }
+  }
+
+  // Values in registers, sorted by the end of their interval
+  ir_value active[ALLOCATABLE_COUNT];
+  int active_count = 0;
+  uint32_t free_registers = 0;
+  for (size_t r = 0; r < ALLOCATABLE_COUNT; r++)
+    free_registers |= 1u << allocatable[r];
+  uint32_t used_registers = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if (!has_result(i) || !e->uses[v])
+        continue;
+      struct Interval *interval = &e->interval[v];
+      int expired = 0;
+      for (; expired < active_count &&
+             e->interval[active[expired]].to < interval->from;
+           expired++)
+        free_registers |= 1u << e->location[active[expired]].reg;
+      active_count -= expired;
+      memmove(active, active + expired, active_count * sizeof(ir_value));
+
+      uint32_t usable = ~0u;
+      if (crosses(interval, asms, asm_count))
+        usable = 0;
+      else if (crosses(interval, calls, call_count))
+        usable = CALLEE_SAVED;
+      uint32_t allowed = free_registers & usable;
+      int reg = NO_REGISTER;
+      // Reusing the register of the first operand saves a move, as does
+      // keeping an argument in the register it is passed in
+      if ((i->op == ir_binary || i->op == ir_zext) &&
+          NO_REGISTER != e->location[i->ops[0]].reg &&
+          allowed & 1u << e->location[i->ops[0]].reg)
+        reg = e->location[i->ops[0]].reg;
+      if (i->op == ir_arg && NO_REGISTER != argument_register(i->imm) &&
+          allowed & 1u << argument_register(i->imm))
+        reg = argument_register(i->imm);
+      for (size_t r = 0; NO_REGISTER == reg && r < ALLOCATABLE_COUNT; r++) {
+        if (allowed & 1u << allocatable[r])
+          reg = allocatable[r];
+      }
+      if (NO_REGISTER == reg) {
+        // Out of registers, the value that lives the longest goes to the
+        // stack. That is either this one or one that holds a register this
+        // one could use.
+        int victim = active_count - 1;
+        for (; victim >= 0 &&
+               !(usable & 1u << e->location[active[victim]].reg);
+             victim--)
+          ;
+        if (victim < 0 || e->interval[active[victim]].to <= interval->to)
+          continue;
+        reg = e->location[active[victim]].reg;
+        e->location[active[victim]].reg = NO_REGISTER;
+        active_count--;
+        memmove(active + victim, active + victim + 1,
+                (active_count - victim) * sizeof(ir_value));
+      }
+      free_registers &= ~(1u << reg);
+      used_registers |= 1u << reg;
+      e->location[v].reg = reg;
+      int a = active_count++;
+      for (; a > 0 && e->interval[active[a - 1]].to > interval->to; a--)
+        active[a] = active[a - 1];
+      active[a] = v;
+    }
+  }
+
+  // Inline assembly may clobber any register, the caller still expects the
+  // callee-saved ones to survive
+  if (f->has_asm)
+    used_registers |= CALLEE_SAVED;
+  e->saved_count = 0;
+  for (size_t r = 0; r < ALLOCATABLE_COUNT; r++) {
+    if (used_registers & CALLEE_SAVED & 1u << allocatable[r])
+      e->saved[e->saved_count++] = allocatable[r];
+  }
+}
+
+// Ors the bits of the count words at from into to, returns whether any of
+// them were new.
+static int merge_bits(uint64_t *to, uint64_t *from, uint32_t count) {
+  int changed = 0;
+  for (uint32_t w = 0; w < count; w++) {
+    changed |= 0 != (from[w] & ~to[w]);
+    to[w] |= from[w];
+  }
+  return changed;
+}
+
+// Computes the interval in which every slot holds something. What is stored
+// in a slot may be read again on every edge from a block that is reachable
+// from an access to a block from which an access can be reached, like the
+// edges of the loops around the accesses, so the interval covers these
+// edges as well as the accesses themselves. A slot whose address escapes may
+// be accessed through it anywhere, as may every slot of a function with
+// inline assembly, so it lives through the whole function. Slots that are
+// never accessed get an empty interval, whose from lies after its to.
+static struct Interval *slot_intervals(struct Emitter *e) {
+  struct IrFunction *f = e->f;
+  struct Interval *interval =
+      arena_alloc(&f->arena, (f->slot_count + 1) * sizeof(*interval));
+  for (uint32_t s = 0; s < f->slot_count; s++)
+    interval[s] = (struct Interval){.from = UINT32_MAX, .to = 0};
+  uint8_t *escaped = arena_calloc(&f->arena, f->slot_count + 1, 1);
+  // Per block a bit for every slot, set if the block is reachable from an
+  // access and if an access can be reached from it, counting its own
+  uint32_t words = (f->slot_count + 63) / 64;
+  uint64_t *reached = arena_calloc(&f->arena, (size_t)f->block_count * words,
+                                   sizeof(uint64_t));
+  uint64_t *reaching = arena_calloc(&f->arena, (size_t)f->block_count * words,
+                                    sizeof(uint64_t));
+  uint32_t end = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    ir_block block = f->order[b];
+    for (ir_value v = f->blocks[block].first; v; v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      end = 2 * e->position[v] + 1;
+      // The address itself counts as an access, after the operands
+      for (uint32_t o = 0; o <= i->op_count; o++) {
+        struct IrInstr *address = o < i->op_count ? &f->instrs[i->ops[o]] : i;
+        if (address->op != ir_slot)
+          continue;
+        uint32_t s = address->imm;
+        if (end - 1 < interval[s].from)
+          interval[s].from = end - 1;
+        interval[s].to = end;
+        reached[block * words + s / 64] |= 1ull << s % 64;
+        reaching[block * words + s / 64] |= 1ull << s % 64;
+        if (o < i->op_count &&
+            !(0 == o && (i->op == ir_load || i->op == ir_store)))
+          escaped[s] = 1;
+      }
+    }
+  }
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (uint32_t b = 0; b < f->order_count; b++) {
+      struct IrBlock *block = &f->blocks[f->order[b]];
+      for (uint32_t p = 0; p < block->pred_count; p++)
+        changed |= merge_bits(&reached[f->order[b] * words],
+                              &reached[block->preds[p] * words], words);
+    }
+    for (uint32_t b = f->order_count; b > 0; b--) {
+      ir_block successors[2];
+      int n = ir_successors(f, f->order[b - 1], successors);
+      for (int c = 0; c < n; c++)
+        changed |= merge_bits(&reaching[f->order[b - 1] * words],
+                              &reaching[successors[c] * words], words);
+    }
+  }
+
+  // Every slot is extended to the start of the earliest and the end of the
+  // latest block of an edge it is live on
+  uint64_t *first = arena_calloc(&f->arena, words, sizeof(uint64_t));
+  uint64_t *last = arena_calloc(&f->arena, words, sizeof(uint64_t));
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    ir_block block = f->order[b];
+    uint32_t start = 2 * e->position[f->blocks[block].first];
+    for (uint32_t p = 0; p < f->blocks[block].pred_count; p++) {
+      uint64_t *from = &reached[f->blocks[block].preds[p] * words];
+      for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = from[w] & reaching[block * words + w] & ~first[w];
+        first[w] |= bits;
+        for (; bits; bits &= bits - 1) {
+          uint32_t s = 64 * w + __builtin_ctzll(bits);
+          if (start < interval[s].from)
+            interval[s].from = start;
+        }
+      }
+    }
+  }
+  for (uint32_t b = f->order_count; b > 0; b--) {
+    ir_block block = f->order[b - 1];
+    ir_block successors[2];
+    int n = ir_successors(f, block, successors);
+    for (int c = 0; c < n; c++) {
+      uint64_t *to = &reaching[successors[c] * words];
+      for (uint32_t w = 0; w < words; w++) {
+        uint64_t bits = reached[block * words + w] & to[w] & ~last[w];
+        last[w] |= bits;
+        for (; bits; bits &= bits - 1) {
+          uint32_t s = 64 * w + __builtin_ctzll(bits);
+          if (block_end(e, block) > interval[s].to)
+            interval[s].to = block_end(e, block);
+        }
+      }
+    }
+  }
+  for (uint32_t s = 0; s < f->slot_count; s++) {
+    if ((f->has_asm || escaped[s]) && interval[s].from <= interval[s].to)
+      interval[s] = (struct Interval){.from = 0, .to = end};
+  }
+  return interval;
+}
+
+// Something that takes room in the frame, a slot or a value on the stack.
+struct FrameItem {
+  struct Interval interval;
+  // A multiple of the alignment
+  uint32_t size;
+  uint32_t alignment;
+  // Bytes between the item and the saved registers
+  uint32_t depth;
+  // Where the offset from rbp of the item goes
+  int32_t *offset;
+};
+
+static int compare_starts(const void *a, const void *b) {
+  const struct FrameItem *x = a;
+  const struct FrameItem *y = b;
+  return (x->interval.from > y->interval.from) -
+         (x->interval.from < y->interval.from);
+}
+
+static int compare_ends(const void *a, const void *b) {
+  const struct FrameItem *x = *(struct FrameItem *const *)a;
+  const struct FrameItem *y = *(struct FrameItem *const *)b;
+  return (x->interval.to > y->interval.to) -
+         (x->interval.to < y->interval.to);
+}
+
+// Room in the frame that no live item takes anymore. Items of 4 and 8 bytes
+// are the common ones and have a list each, a free 8 byte cell is split
+// when no 4 byte one is left. Others only reuse room of their own size.
+struct FreeRoom {
+  uint32_t *words;
+  uint32_t word_count;
+  uint32_t *cells;
+  uint32_t cell_count;
+  struct FrameItem **others;
+  uint32_t other_count;
+  // Depth of the first byte that was never taken
+  uint32_t bottom;
+};
+
+// Depth of size bytes of room at alignment, at most 8.
+static uint32_t take_room(struct FreeRoom *room, uint32_t size,
+                          uint32_t alignment) {
+  if (4 == size && !room->word_count && room->cell_count) {
+    room->words[room->word_count++] = room->cells[--room->cell_count] + 4;
+    return room->cells[room->cell_count];
+  }
+  if (4 == size && room->word_count)
+    return room->words[--room->word_count];
+  if (8 == size && room->cell_count)
+    return room->cells[--room->cell_count];
+  for (uint32_t o = room->other_count; size > 8 && o > 0; o--) {
+    if (room->others[o - 1]->size == size &&
+        !(room->others[o - 1]->depth & (alignment - 1))) {
+      uint32_t depth = room->others[o - 1]->depth;
+      room->others[o - 1] = room->others[--room->other_count];
+      return depth;
+    }
+  }
+  // Aligning to 8 skips at most a word, which the next u32 can use
+  if (room->bottom & (alignment - 1)) {
+    room->words[room->word_count++] = room->bottom;
+    room->bottom += 4;
+  }
+  room->bottom += size;
+  return room->bottom - size;
+}
+
+static void give_room(struct FreeRoom *room, struct FrameItem *item) {
+  if (4 == item->size) {
+    room->words[room->word_count++] = item->depth;
+  } else if (8 == item->size && (item->depth & 7)) {
+    // A struct of two u32 takes words, not an aligned cell
+    room->words[room->word_count++] = item->depth;
+    room->words[room->word_count++] = item->depth + 4;
+  } else if (8 == item->size) {
+    room->cells[room->cell_count++] = item->depth;
+  } else if (item->size) {
+    room->others[room->other_count++] = item;
+  }
+}
+
+// Assigns offsets to the slots and the values on the stack, and sizes the
+// frame below the saved registers. Without a frame pointer the saved
+// registers start where rbp would have been pushed. A leaf function keeps up
+// to 128 bytes below rsp, in the red zone that signal handlers leave alone.
+//
+// Items whose intervals do not overlap share their bytes: in the order their
+// intervals start, every item takes the room of one whose interval has
+// ended. Room is aligned like the item, a struct like its largest member, as
+// rbp is 16 byte aligned and the saved registers take multiples of 8 bytes.
+static void layout_frame(struct Emitter *e, int leaf) {
+  struct IrFunction *f = e->f;
+  struct Interval *live = e->slot_interval = slot_intervals(e);
+  uint32_t capacity = f->slot_count + f->instr_count;
+  struct FrameItem *items = arena_alloc(&f->arena, capacity * sizeof(*items));
+  uint32_t count = 0;
+  for (uint32_t s = 0; s < f->slot_count; s++) {
+    struct IrSlot *slot = &f->slots[s];
+    // Slots promoted to values are not referenced anymore and take no space
+    if (live[s].from > live[s].to)
+      continue;
+    if (slot->argument >= 0 &&
+        NO_REGISTER == argument_register(slot->argument)) {
+      slot->offset = argument_offset(slot->argument);
+      continue;
+    }
+    struct Interval interval = live[s];
+    // Arguments passed in registers are stored by the prologue
+    if (slot->argument >= 0)
+      interval.from = 0;
+    // The room of a struct is padded to a multiple of its alignment
+    uint32_t alignment = slot->alignment < 8 ? slot->alignment : 8;
+    items[count++] = (struct FrameItem){
+        .interval = interval,
+        .size = (slot->size + alignment - 1) & -alignment,
+        .alignment = alignment,
+        .offset = &slot->offset};
+  }
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if (!has_result(i) || !e->uses[v] || NO_REGISTER != e->location[v].reg)
+        continue;
+      // Arguments stay where the caller pushed them
+      if (i->op == ir_arg && 8 == i->size &&
+          NO_REGISTER == argument_register(i->imm))
+        e->location[v].offset = argument_offset(i->imm);
+      else
+        items[count++] =
+            (struct FrameItem){.interval = e->interval[v],
+                               .size = 8,
+                               .alignment = 8,
+                               .offset = &e->location[v].offset};
+    }
+  }
+  qsort(items, count, sizeof(*items), compare_starts);
+  struct FrameItem **ending = arena_alloc(&f->arena, count * sizeof(*ending));
+  for (uint32_t n = 0; n < count; n++)
+    ending[n] = &items[n];
+  qsort(ending, count, sizeof(*ending), compare_ends);
+
+  int32_t saved = 8 * e->saved_count - (e->frame_pointer ? 0 : 8);
+  struct FreeRoom room = {
+      .words = arena_alloc(&f->arena, 3 * count * sizeof(uint32_t)),
+      .cells = arena_alloc(&f->arena, count * sizeof(uint32_t)),
+      .others = arena_alloc(&f->arena, count * sizeof(*room.others))};
+  uint32_t ended = 0;
+  for (uint32_t n = 0; n < count; n++) {
+    struct FrameItem *item = &items[n];
+    for (; ending[ended]->interval.to < item->interval.from; ended++)
+      give_room(&room, ending[ended]);
+    item->depth = take_room(&room, item->size, item->alignment);
+    *item->offset = -(saved + (int32_t)(item->depth + item->size));
+  }
+  // rsp stays 16 byte aligned below the frame, as it was before the call
+  int32_t frame = saved + (int32_t)room.bottom;
+  if (!e->frame_pointer && leaf && room.bottom <= 128)
+    e->frame_size = 0;
+  else
+    e->frame_size = ((frame + 15) & ~15) - saved;
+  e->rsp_offset = e->frame_pointer ? 0 : saved + e->frame_size;
+}
+
+static int in_register(struct Emitter *e, ir_value v) {
+  return !is_rematerialized(&e->f->instrs[v]) &&
+         NO_REGISTER != e->location[v].reg;
+}
+
+static int in_memory(struct Emitter *e, ir_value v) {
+  return !is_rematerialized(&e->f->instrs[v]) &&
+         NO_REGISTER == e->location[v].reg;
+}
+
+static int is_imm32(struct Emitter *e, ir_value v) {
+  struct IrInstr *i = &e->f->instrs[v];
+  return i->op == ir_undef || (i->op == ir_const && fits_imm32(i->imm));
+}
+
+static int same_location(struct Location a, struct Location b) {
+  return a.reg == b.reg && (NO_REGISTER != a.reg || a.offset == b.offset);
+}
+
+// Whether v is kept in the location l.
+static int is_at(struct Emitter *e, ir_value v, struct Location l) {
+  return !is_rematerialized(&e->f->instrs[v]) &&
+         same_location(e->location[v], l);
+}
+
+static const char *register_name(int reg, int size) {
+  return 4 == size ? reg32[reg] : reg64[reg];
+}
+
+static void load_register(struct Emitter *e, int reg, ir_value v) {
+  struct IrInstr *i = &e->f->instrs[v];
+  char s[32];
+  switch (i->op) {
+  case ir_const:
+    if (!i->imm)
+      fprintf(e->fp, "xor %s, %s\n", reg32[reg], reg32[reg]);
+    else if (i->imm == (int64_t)(uint32_t)i->imm)
+      fprintf(e->fp, "mov %s, %ld\n", reg32[reg], i->imm);
+    else
+      fprintf(e->fp, "mov %s, %ld\n", reg64[reg], i->imm);
+    break;
+  case ir_undef:
+    break;
+  case ir_slot:
+    fprintf(e->fp, "lea %s, %s\n", reg64[reg],
+            frame_operand(e, e->f->slots[i->imm].offset, s));
+    break;
+  case ir_string:
+    fprintf(e->fp, "mov %s, %s\n", reg64[reg], i->name);
+    break;
+  default:
+    if (NO_REGISTER == e->location[v].reg)
+      fprintf(e->fp, "mov %s, %s\n", reg64[reg],
+              frame_operand(e, e->location[v].offset, s));
+    else if (e->location[v].reg != reg)
+      fprintf(e->fp, "mov %s, %s\n", reg64[reg], reg64[e->location[v].reg]);
+    break;
+  }
+}
+
+// Writes an operand that reads size bytes of v to s. Values that can not be
+// an operand by themselves are put into scratch first.
+static const char *operand(struct Emitter *e, ir_value v, int size,
+                           int scratch, char *s) {
+  struct IrInstr *i = &e->f->instrs[v];
+  if (i->op == ir_undef) {
+    sprintf(s, "0");
+  } else if (i->op == ir_const && 4 == size) {
+    sprintf(s, "%d", (int32_t)i->imm);
+  } else if (i->op == ir_const && fits_imm32(i->imm)) {
+    sprintf(s, "%ld", i->imm);
+  } else if (in_register(e, v)) {
+    sprintf(s, "%s", register_name(e->location[v].reg, size));
+  } else if (in_memory(e, v)) {
+    frame_operand(e, e->location[v].offset, s);
+  } else {
+    load_register(e, scratch, v);
+    sprintf(s, "%s", register_name(scratch, size));
+  }
+  return s;
+}
+
+// Copies v to dst, through rax if both are in memory.
+static void move(struct Emitter *e, struct Location dst, ir_value v) {
+  if (e->f->instrs[v].op == ir_undef || is_at(e, v, dst))
+    return;
+  if (NO_REGISTER != dst.reg) {
+    load_register(e, dst.reg, v);
+    return;
+  }
+  char s[32];
+  char d[32];
+  frame_operand(e, dst.offset, d);
+  if (is_imm32(e, v)) {
+    fprintf(e->fp, "mov qword %s, %s\n", d, operand(e, v, 8, rax, s));
+    return;
+  }
+  int reg = rax;
+  if (in_register(e, v))
+    reg = e->location[v].reg;
+  else
+    load_register(e, rax, v);
+  fprintf(e->fp, "mov %s, %s\n", d, reg64[reg]);
+}
+
+// Register the result of v is computed in, rax if it lives on the stack.
+static int result_register(struct Emitter *e, ir_value v) {
+  return NO_REGISTER == e->location[v].reg ? rax : e->location[v].reg;
+}
+
+// Moves the result from rax to the stack if that is where v lives.
+static void store_result(struct Emitter *e, ir_value v) {
+  char s[32];
+  if (NO_REGISTER == e->location[v].reg)
+    fprintf(e->fp, "mov %s, rax\n",
+            frame_operand(e, e->location[v].offset, s));
+}
+
+// Copies what is at src to dst, through rax if both are in memory.
+static void copy_location(struct Emitter *e, struct Location dst,
+                          struct Location src) {
+  char d[32];
+  char s[32];
+  if (same_location(dst, src))
+    return;
+  if (NO_REGISTER != dst.reg && NO_REGISTER != src.reg) {
+    fprintf(e->fp, "mov %s, %s\n", reg64[dst.reg], reg64[src.reg]);
+  } else if (NO_REGISTER != dst.reg) {
+    fprintf(e->fp, "mov %s, %s\n", reg64[dst.reg],
+            frame_operand(e, src.offset, s));
+  } else if (NO_REGISTER != src.reg) {
+    fprintf(e->fp, "mov %s, %s\n", frame_operand(e, dst.offset, d),
+            reg64[src.reg]);
+  } else {
+    fprintf(e->fp, "mov rax, %s\n", frame_operand(e, src.offset, s));
+    fprintf(e->fp, "mov %s, rax\n", frame_operand(e, dst.offset, d));
+  }
+}
+
+// One of several copies that happen at the same time, see emit_moves().
+struct Move {
+  struct Location dst;
+  // Source value, IR_NONE once the source has been saved in the scratch
+  // register
+  ir_value source;
+  // Where the source is, unless it is recomputed like a constant
+  struct Location at;
+  int located;
+  int done;
+};
+
+static struct Move move_value(struct Emitter *e, struct Location dst,
+                              ir_value v) {
+  return (struct Move){.dst = dst,
+                       .source = v,
+                       .at = e->location[v],
+                       .located = !is_rematerialized(&e->f->instrs[v])};
+}
+
+// Whether a move that is not done yet reads from l.
+static int is_read(struct Move *moves, uint32_t count, uint32_t except,
+                   struct Location l) {
+  for (uint32_t r = 0; r < count; r++) {
+    if (!moves[r].done && r != except && moves[r].source &&
+        moves[r].located && same_location(moves[r].at, l))
+      return 1;
+  }
+  return 0;
+}
+
+// Performs the moves in parallel: a location that is read by another move is
+// written only after that move, and cycles are broken by keeping one value
+// in scratch. Neither scratch nor rax, which copies between memory
+// locations, may be the location of a move.
+static void emit_moves(struct Emitter *e, struct Move *moves, uint32_t count,
+                       int scratch) {
+  uint32_t left = count;
+  for (uint32_t m = 0; m < count; m++) {
+    if (moves[m].located && same_location(moves[m].at, moves[m].dst)) {
+      moves[m].done = 1;
+      left--;
+    }
+  }
+  for (; left > 0;) {
+    uint32_t m = 0;
+    for (; m < count; m++) {
+      if (!moves[m].done && !is_read(moves, count, m, moves[m].dst))
+        break;
+    }
+    if (m == count) {
+      // Every remaining location is still needed, so save one of them
+      for (m = 0; moves[m].done; m++)
+        ;
+      struct Location saved = moves[m].dst;
+      copy_location(e, (struct Location){.reg = scratch}, saved);
+      for (uint32_t r = 0; r < count; r++) {
+        if (!moves[r].done && moves[r].source && moves[r].located &&
+            same_location(moves[r].at, saved))
+          moves[r].source = IR_NONE;
+      }
+    }
+    if (IR_NONE == moves[m].source)
+      copy_location(e, moves[m].dst, (struct Location){.reg = scratch});
+    else if (moves[m].located)
+      copy_location(e, moves[m].dst, moves[m].at);
+    else
+      move(e, moves[m].dst, moves[m].source);
+    moves[m].done = 1;
+    left--;
+  }
+}
+
+// Memory operand of ops[0] + imm of a load or store. Addresses that are
+// neither slots nor in a register are loaded into rcx.
+static void memory_operand(struct Emitter *e, struct IrInstr *i, char *s) {
+  struct IrInstr *address = &e->f->instrs[i->ops[0]];
+  if (address->op == ir_slot) {
+    frame_operand(e, e->f->slots[address->imm].offset + i->imm, s);
+    return;
+  }
+  int reg = rcx;
+  if (in_register(e, i->ops[0]))
+    reg = e->location[i->ops[0]].reg;
+  else
+    load_register(e, rcx, i->ops[0]);
+  if (i->imm)
+    sprintf(s, "[%s%+ld]", reg64[reg], i->imm);
+  else
+    sprintf(s, "[%s]", reg64[reg]);
+}
+
+// Comparison with the same result when the operands are swapped.
+static uint8_t swap_comparison(uint8_t operator) {
+  switch (operator) {
+  case operator_lt:
+    return operator_gt;
+  case operator_le:
+    return operator_ge;
+  case operator_gt:
+    return operator_lt;
+  case operator_ge:
+    return operator_le;
+  default:
+    return operator;
+  }
+}
+
+// Comparison with the opposite result.
+static uint8_t negate_comparison(uint8_t operator) {
+  switch (operator) {
+  case operator_eq:
+    return operator_ne;
+  case operator_ne:
+    return operator_eq;
+  case operator_lt:
+    return operator_ge;
+  case operator_le:
+    return operator_gt;
+  case operator_gt:
+    return operator_le;
+  default: // operator_ge
+    return operator_lt;
+  }
+}
+
+// Sets the flags for the comparison i, returns the comparison the flags
+// have to be tested for.
+static uint8_t emit_compare(struct Emitter *e, struct IrInstr *i) {
+  ir_value left = i->ops[0];
+  ir_value right = i->ops[1];
+  uint8_t operator= i->operator;
+  // Only the right operand of cmp can be an immediate
+  if (is_rematerialized(&e->f->instrs[left]) &&
+      !is_rematerialized(&e->f->instrs[right])) {
+    left = i->ops[1];
+    right = i->ops[0];
+    operator= swap_comparison(operator);
+  }
+  char a[48];
+  char b[32];
+  if (in_register(e, left)) {
+    sprintf(a, "%s", reg64[e->location[left].reg]);
+  } else if (in_memory(e, left) && !in_memory(e, right)) {
+    sprintf(a, "qword %s", frame_operand(e, e->location[left].offset, b));
+  } else {
+    load_register(e, rax, left);
+    sprintf(a, "rax");
+  }
+  struct IrInstr *r = &e->f->instrs[right];
+  if (r->op == ir_const && !r->imm && !in_memory(e, left))
+    fprintf(e->fp, "test %s, %s\n", a, a);
+  else
+    fprintf(e->fp, "cmp %s, %s\n", a, operand(e, right, 8, rcx, b));
+  return operator;
+}
+
+// Comparisons used as values are computed without branches.
+static void emit_set(struct Emitter *e, ir_value v, struct IrInstr *i) {
+  uint8_t operator= emit_compare(e, i);
+  int reg = result_register(e, v);
+  fprintf(e->fp, "set%s %s\n", condition_codes[operator], reg8[reg]);
+  fprintf(e->fp, "movzx %s, %s\n", reg32[reg], reg8[reg]);
+  store_result(e, v);
+}
+
+// Writes a register or memory operand of v to s. Values that are neither
+// are put into scratch first.
+static const char *register_or_memory(struct Emitter *e, ir_value v,
+                                      int scratch, char *s) {
+  if (in_register(e, v)) {
+    sprintf(s, "%s", reg64[e->location[v].reg]);
+  } else if (in_memory(e, v)) {
+    char m[32];
+    sprintf(s, "qword %s", frame_operand(e, e->location[v].offset, m));
+  } else {
+    load_register(e, scratch, v);
+    sprintf(s, "%s", reg64[scratch]);
+  }
+  return s;
+}
+
+// Exponent of n if it is a power of two, -1 otherwise.
+static int power_of_two(uint64_t n) {
+  if (!n || n & (n - 1))
+    return -1;
+  int k = 0;
+  for (; n > 1; n >>= 1)
+    k++;
+  return k;
+}
+
+// Multiplies by a constant with a shift, lea or imul with an immediate.
+// Returns 0 if the constant needs a register.
+static int emit_multiply_constant(struct Emitter *e, ir_value v,
+                                  struct IrInstr *i) {
+  ir_value left = i->ops[0];
+  ir_value right = i->ops[1];
+  if (e->f->instrs[left].op == ir_const) {
+    left = i->ops[1];
+    right = i->ops[0];
+  }
+  struct IrInstr *c = &e->f->instrs[right];
+  if (c->op != ir_const || is_rematerialized(&e->f->instrs[left]))
+    return 0;
+  int reg = result_register(e, v);
+  int shift = power_of_two(c->imm);
+  char s[32];
+  if (!c->imm) {
+    fprintf(e->fp, "xor %s, %s\n", reg32[reg], reg32[reg]);
+  } else if (shift >= 0) {
+    load_register(e, reg, left);
+    if (shift)
+      fprintf(e->fp, "shl %s, %d\n", reg64[reg], shift);
+  } else if (3 == c->imm || 5 == c->imm || 9 == c->imm) {
+    int x = reg;
+    if (in_register(e, left))
+      x = e->location[left].reg;
+    else
+      load_register(e, reg, left);
+    fprintf(e->fp, "lea %s, [%s+%s*%ld]\n", reg64[reg], reg64[x], reg64[x],
+            c->imm - 1);
+  } else if (fits_imm32(c->imm)) {
+    fprintf(e->fp, "imul %s, %s, %ld\n", reg64[reg],
+            operand(e, left, 8, rcx, s), c->imm);
+  } else {
+    return 0;
+  }
+  store_result(e, v);
+  return 1;
+}
+
+static void emit_shift(struct Emitter *e, ir_value v, struct IrInstr *i) {
+  const char *instruction = i->operator== operator_shl ? "shl" : "shr";
+  int reg = result_register(e, v);
+  struct IrInstr *count = &e->f->instrs[i->ops[1]];
+  if (count->op == ir_const || count->op == ir_undef) {
+    load_register(e, reg, i->ops[0]);
+    fprintf(e->fp, "%s %s, %d\n", instruction, reg64[reg],
+            count->op == ir_const ? (int)(count->imm & 63) : 0);
+  } else {
+    // The count has to be in cl
+    load_register(e, rcx, i->ops[1]);
+    load_register(e, reg, i->ops[0]);
+    fprintf(e->fp, "%s %s, cl\n", instruction, reg64[reg]);
+  }
+  store_result(e, v);
+}
+
+// Unsigned division by a constant d is a multiplication by 2^(64 + shift) / d
+// rounded up, of which the high half is shifted right by shift (Granlund and
+// Montgomery). The multiplier may need 65 bits, then add is set and the top
+// bit is added separately.
+struct Magic {
+  uint64_t multiplier;
+  int add;
+  int shift;
+};
+
+// Finds the smallest shift that works for every dividend, see Hacker's
+// Delight 10-10.
+static struct Magic magic_divisor(uint64_t d) {
+  struct Magic m = {0};
+  const uint64_t high = 1ull << 63;
+  uint64_t nc = -1 - (-d) % d;
+  int p = 63;
+  uint64_t q1 = high / nc;
+  uint64_t r1 = high - q1 * nc;
+  uint64_t q2 = (high - 1) / d;
+  uint64_t r2 = (high - 1) - q2 * d;
+  uint64_t delta;
+  do {
+    p++;
+    if (r1 >= nc - r1) {
+      q1 = 2 * q1 + 1;
+      r1 = 2 * r1 - nc;
+    } else {
+      q1 = 2 * q1;
+      r1 = 2 * r1;
+    }
+    if (r2 + 1 >= d - r2) {
+      if (q2 >= high - 1)
+        m.add = 1;
+      q2 = 2 * q2 + 1;
+      r2 = 2 * r2 + 1 - d;
+    } else {
+      if (q2 >= high)
+        m.add = 1;
+      q2 = 2 * q2;
+      r2 = 2 * r2 + 1;
+    }
+    delta = d - 1 - r2;
+  } while (p < 128 && (q1 < delta || (q1 == delta && !r1)));
+  m.multiplier = q2 + 1;
+  m.shift = p - 64;
+  return m;
+}
+
+// Division and remainder by a constant that is not a power of two, without
+// div. The quotient ends up in rax or rdx, which one is returned.
+static int emit_divide_constant(struct Emitter *e, ir_value left, uint64_t d,
+                                int remainder) {
+  char x[32];
+  register_or_memory(e, left, rcx, x);
+  struct Magic m = magic_divisor(d);
+  fprintf(e->fp, "mov rax, %lu\n", m.multiplier);
+  fprintf(e->fp, "mul %s\n", x);
+  int quotient = rdx;
+  if (m.add) {
+    fprintf(e->fp, "mov rax, %s\n", x);
+    fprintf(e->fp, "sub rax, rdx\n");
+    fprintf(e->fp, "shr rax, 1\n");
+    fprintf(e->fp, "add rax, rdx\n");
+    quotient = rax;
+    if (m.shift > 1)
+      fprintf(e->fp, "shr rax, %d\n", m.shift - 1);
+  } else if (m.shift) {
+    fprintf(e->fp, "shr rdx, %d\n", m.shift);
+  }
+  if (!remainder)
+    return quotient;
+  // x - quotient * d, the other one of rax and rdx is free
+  if (fits_imm32(d)) {
+    fprintf(e->fp, "imul %s, %s, %ld\n", reg64[quotient], reg64[quotient],
+            (int64_t)d);
+  } else {
+    int other = rax == quotient ? rdx : rax;
+    fprintf(e->fp, "mov %s, %lu\n", reg64[other], d);
+    fprintf(e->fp, "imul %s, %s\n", reg64[quotient], reg64[other]);
+  }
+  fprintf(e->fp, "neg %s\n", reg64[quotient]);
+  fprintf(e->fp, "add %s, %s\n", reg64[quotient], x);
+  return quotient;
+}
+
+static void emit_divide(struct Emitter *e, ir_value v, struct IrInstr *i) {
+  int remainder = i->operator== operator_mod;
+  int reg = result_register(e, v);
+  struct IrInstr *c = &e->f->instrs[i->ops[1]];
+  char s[32];
+  if (c->op == ir_const && c->imm) {
+    int shift = power_of_two(c->imm);
+    if (shift < 0) {
+      int result = emit_divide_constant(e, i->ops[0], c->imm, remainder);
+      fprintf(e->fp, "mov %s, %s\n", reg64[reg], reg64[result]);
+    } else if (remainder && 1 == c->imm) {
+      fprintf(e->fp, "xor %s, %s\n", reg32[reg], reg32[reg]);
+    } else if (remainder && fits_imm32(c->imm - 1)) {
+      load_register(e, reg, i->ops[0]);
+      fprintf(e->fp, "and %s, %ld\n", reg64[reg], c->imm - 1);
+    } else if (remainder) {
+      load_register(e, rcx, i->ops[0]);
+      fprintf(e->fp, "mov %s, %ld\n", reg64[reg], c->imm - 1);
+      fprintf(e->fp, "and %s, rcx\n", reg64[reg]);
+    } else {
+      load_register(e, reg, i->ops[0]);
+      if (shift)
+        fprintf(e->fp, "shr %s, %d\n", reg64[reg], shift);
+    }
+    store_result(e, v);
+    return;
+  }
+  // div takes the dividend in rdx:rax and leaves the remainder in rdx
+  load_register(e, rax, i->ops[0]);
+  fprintf(e->fp, "xor edx, edx\n");
+  fprintf(e->fp, "div %s\n", register_or_memory(e, i->ops[1], rcx, s));
+  int result = remainder ? rdx : rax;
+  if (reg != result)
+    fprintf(e->fp, "mov %s, %s\n", reg64[reg], reg64[result]);
+  store_result(e, v);
+}
+
+static void emit_binary(struct Emitter *e, ir_value v, struct IrInstr *i) {
+  const char *instruction;
+  switch (i->operator) {
+  case operator_add:
+    instruction = "add";
+    break;
+  case operator_sub:
+    instruction = "sub";
+    break;
+  case operator_mul:
+    if (emit_multiply_constant(e, v, i))
+      return;
+    instruction = "imul";
+    break;
+  case operator_and:
+    instruction = "and";
+    break;
+  case operator_or:
+    instruction = "or";
+    break;
+  case operator_xor:
+    instruction = "xor";
+    break;
+  case operator_div:
+  case operator_mod:
+    emit_divide(e, v, i);
+    return;
+  case operator_shl:
+  case operator_shr:
+    emit_shift(e, v, i);
+    return;
+  default:
+    emit_set(e, v, i);
+    return;
+  }
+  ir_value left = i->ops[0];
+  ir_value right = i->ops[1];
+  int reg = result_register(e, v);
+  struct Location result = {.reg = reg};
+  char a[32];
+  char b[32];
+  if (is_at(e, right, result) && !is_at(e, left, result)) {
+    // The result goes where the right operand is, all of the operators but
+    // sub are commutative
+    if (i->operator== operator_sub) {
+      fprintf(e->fp, "neg %s\n", reg64[reg]);
+      instruction = "add";
+    }
+    fprintf(e->fp, "%s %s, %s\n", instruction, reg64[reg],
+            operand(e, left, 8, rcx, a));
+  } else {
+    load_register(e, reg, left);
+    fprintf(e->fp, "%s %s, %s\n", instruction, reg64[reg],
+            operand(e, right, 8, rcx, b));
+  }
+  store_result(e, v);
+}
+
+// Restores the callee-saved registers and the frame of the caller.
+static void emit_teardown(struct Emitter *e) {
+  if (!e->frame_pointer) {
+    if (e->frame_size)
+      fprintf(e->fp, "add rsp, %d\n", e->frame_size);
+    for (int r = e->saved_count; r > 0; r--)
+      fprintf(e->fp, "pop %s\n", reg64[e->saved[r - 1]]);
+    return;
+  }
+  if (e->saved_count) {
+    fprintf(e->fp, "lea rsp, [rbp-%d]\n", 8 * e->saved_count);
+    for (int r = e->saved_count; r > 0; r--)
+      fprintf(e->fp, "pop %s\n", reg64[e->saved[r - 1]]);
+  } else {
+    fprintf(e->fp, "mov rsp, rbp\n");
+  }
+  fprintf(e->fp, "pop rbp\n");
+}
+
+// A call whose result is returned right away, by a return of its value or
+// one without operands that returns whatever is in rax. If it passes no more
+// arguments than the function got, they fit where the caller put those. With
+// arguments in registers it may pass as many as fit in these.
+static int is_tail_call(struct Emitter *e, ir_value v) {
+  struct IrInstr *i = &e->f->instrs[v];
+  struct IrInstr *ret = &e->f->instrs[i->next];
+  uint32_t fit = codegen_options.sysv_abi ? ARGUMENT_REGISTER_COUNT
+                                          : e->f->arg_count;
+  return e->tail_calls && i->op == ir_call && i->next && ret->op == ir_ret &&
+         (!ret->op_count || ret->ops[0] == v) && i->op_count <= fit;
+}
+
+// Moves the first count arguments of the call i to their registers.
+static void emit_register_arguments(struct Emitter *e, struct IrInstr *i,
+                                    uint32_t count) {
+  struct Move *moves =
+      arena_alloc(&e->f->arena, (count + 1) * sizeof(struct Move));
+  for (uint32_t a = 0; a < count; a++)
+    moves[a] = move_value(
+        e, (struct Location){.reg = argument_registers[a]}, i->ops[a]);
+  emit_moves(e, moves, count, rax);
+}
+
+// Whether v is read from the incoming arguments. They are not written while
+// tail calls are allowed, as argument slots are then promoted.
+static int is_incoming(struct Emitter *e, ir_value v) {
+  return in_memory(e, v) && e->location[v].offset > 0;
+}
+
+// The callee returns straight to the caller of this function. Arguments are
+// written over the incoming ones, those that are read from there are pushed
+// first so no argument overwrites another before it has been read.
+static void emit_tail_call(struct Emitter *e, struct IrInstr *i) {
+  struct IrInstr *instrs = e->f->instrs;
+  char s[32];
+  if (codegen_options.sysv_abi) {
+    emit_register_arguments(e, i, i->op_count);
+    emit_teardown(e);
+    fprintf(e->fp, "jmp %s\n", symbol_name(i->imm));
+    return;
+  }
+  for (uint32_t a = i->op_count; a > 0; a--) {
+    ir_value argument = i->ops[a - 1];
+    if (is_incoming(e, argument) && instrs[argument].imm != a - 1) {
+      fprintf(e->fp, "push qword %s\n",
+              frame_operand(e, e->location[argument].offset, s));
+      e->pushed += 8;
+    }
+  }
+  for (uint32_t a = 0; a < i->op_count; a++) {
+    ir_value argument = i->ops[a];
+    struct IrInstr *value = &instrs[argument];
+    int in_place = value->op == ir_arg && value->imm == a && 8 == value->size;
+    if (!in_place && !is_incoming(e, argument))
+      move(e,
+           (struct Location){.reg = NO_REGISTER,
+                             .offset = argument_offset(a)},
+           argument);
+  }
+  for (uint32_t a = 0; a < i->op_count; a++) {
+    ir_value argument = i->ops[a];
+    // The address of pop is computed with rsp after the pop
+    if (is_incoming(e, argument) && instrs[argument].imm != a) {
+      e->pushed -= 8;
+      fprintf(e->fp, "pop qword %s\n",
+              frame_operand(e, argument_offset(a), s));
+    }
+  }
+  emit_teardown(e);
+  fprintf(e->fp, "jmp %s\n", symbol_name(i->imm));
+}
+
+static void emit_call(struct Emitter *e, ir_value v, struct IrInstr *i) {
+  char s[32];
+  if (is_tail_call(e, v)) {
+    emit_tail_call(e, i);
+    return;
+  }
+  uint32_t in_registers = 0;
+  if (codegen_options.sysv_abi)
+    in_registers = i->op_count < ARGUMENT_REGISTER_COUNT
+                       ? i->op_count
+                       : ARGUMENT_REGISTER_COUNT;
+  // rsp is 16 byte aligned at the call, as the callee may rely on
+  uint32_t padding = 8 * ((i->op_count - in_registers) & 1);
+  if (padding) {
+    fprintf(e->fp, "sub rsp, %u\n", padding);
+    e->pushed += padding;
+  }
+  for (uint32_t a = i->op_count; a > in_registers; a--) {
+    ir_value argument = i->ops[a - 1];
+    if (in_memory(e, argument))
+      fprintf(e->fp, "push qword %s\n",
+              frame_operand(e, e->location[argument].offset, s));
+    else
+      fprintf(e->fp, "push %s\n", operand(e, argument, 8, rax, s));
+    e->pushed += 8;
+  }
+  emit_register_arguments(e, i, in_registers);
+  fprintf(e->fp, "call %s\n", symbol_name(i->imm));
+  if (i->op_count > in_registers)
+    fprintf(e->fp, "add rsp, %u\n",
+            8 * (i->op_count - in_registers) + padding);
+  e->pushed = 0;
+  if (!e->uses[v])
+    return;
+  if (NO_REGISTER != e->location[v].reg)
+    fprintf(e->fp, "mov %s, rax\n", reg64[e->location[v].reg]);
+  store_result(e, v);
+}
+
+// Operand of the phi v that comes from b, IR_NONE if it needs no copy on
+// that edge.
+static ir_value phi_source(struct Emitter *e, ir_value v, ir_block b) {
+  struct IrInstr *phi = &e->f->instrs[v];
+  if (!e->uses[v])
+    return IR_NONE;
+  uint32_t o = 0;
+  for (; o < phi->op_count && phi->incoming[o] != b; o++)
+    ;
+  assert(o < phi->op_count && "Phi without operand for predecessor");
+  ir_value source = phi->ops[o];
+  if (e->f->instrs[source].op == ir_undef || is_at(e, source, e->location[v]))
+    return IR_NONE;
+  return source;
+}
+
+// Copies the operands of the phis of target that come from the current
+// block b to the locations of the phis, in parallel.
+static void emit_phi_moves(struct Emitter *e, ir_block b, ir_block target) {
+  struct IrFunction *f = e->f;
+  uint32_t count = 0;
+  for (ir_value v = f->blocks[target].first; v && f->instrs[v].op == ir_phi;
+       v = f->instrs[v].next)
+    count++;
+  if (!count)
+    return;
+  struct Move *moves = arena_alloc(&f->arena, count * sizeof(struct Move));
+  count = 0;
+  for (ir_value v = f->blocks[target].first; v && f->instrs[v].op == ir_phi;
+       v = f->instrs[v].next) {
+    ir_value source = phi_source(e, v, b);
+    if (source)
+      moves[count++] = move_value(e, e->location[v], source);
+  }
+  emit_moves(e, moves, count, rdx);
+}
+
+// Scratch space of find_early_moves().
+struct EarlyMoves {
+  // Values kept in every register, in the order of their intervals, which
+  // do not overlap
+  ir_value *held[sizeof(reg64) / sizeof(reg64[0])];
+  uint32_t held_count[sizeof(reg64) / sizeof(reg64[0])];
+  // Blocks that read the value in question and those reached from the block
+  // in question, marked with the stamp of the question
+  uint32_t *used;
+  uint32_t *seen;
+  uint32_t stamp;
+  ir_block *work;
+  struct IrUsers users;
+};
+
+// Value kept in reg at position, IR_NONE if there is none.
+static ir_value held_at(struct Emitter *e, struct EarlyMoves *m, int reg,
+                        uint32_t position) {
+  uint32_t low = 0;
+  uint32_t high = m->held_count[reg];
+  for (; low < high;) {
+    uint32_t middle = low + (high - low) / 2;
+    if (e->interval[m->held[reg][middle]].from <= position)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (!low || e->interval[m->held[reg][low - 1]].to < position)
+    return IR_NONE;
+  return m->held[reg][low - 1];
+}
+
+// Whether v is read in a block that can be reached from b without passing
+// its definition, or by a phi on an edge from such a block. Such blocks all
+// lie within the interval of v, see build_intervals(), so the search stops
+// at the others.
+static int is_live_in(struct Emitter *e, struct EarlyMoves *m, ir_value v,
+                      ir_block b) {
+  struct IrFunction *f = e->f;
+  m->stamp++;
+  for (uint32_t u = m->users.start[v]; u < m->users.start[v + 1]; u++) {
+    struct IrInstr *i = &f->instrs[m->users.users[u]];
+    if (i->op != ir_phi)
+      m->used[i->block] = m->stamp;
+    for (uint32_t o = 0; i->op == ir_phi && o < i->op_count; o++) {
+      if (i->ops[o] == v)
+        m->used[i->incoming[o]] = m->stamp;
+    }
+  }
+  uint32_t depth = 0;
+  m->seen[b] = m->stamp;
+  m->work[depth++] = b;
+  for (; depth > 0;) {
+    ir_block block = m->work[--depth];
+    if (m->used[block] == m->stamp)
+      return 1;
+    if (block == f->instrs[v].block)
+      continue;
+    ir_block successors[2];
+    int n = ir_successors(f, block, successors);
+    for (int c = 0; c < n; c++) {
+      ir_block next = successors[c];
+      if (m->seen[next] != m->stamp &&
+          2 * e->position[f->blocks[next].first] <= e->interval[v].to) {
+        m->seen[next] = m->stamp;
+        m->work[depth++] = next;
+      }
+    }
+  }
+  return 0;
+}
+
+// Whether the phi moves of edge, a split edge block back to a loop header
+// from the end of b, can be made in front of the branch of b. The branch
+// then goes straight to the header, so an iteration takes one branch. The
+// moves may neither write where the branch reads its operands nor where a
+// value lives that the other target of the branch still needs. Phis on the
+// stack keep their edge block.
+static int moves_early(struct Emitter *e, struct EarlyMoves *m, ir_block b,
+                       ir_block edge, ir_block other) {
+  struct IrFunction *f = e->f;
+  ir_value jump = f->blocks[edge].first;
+  ir_block header = f->instrs[jump].target[0];
+  if (f->instrs[jump].op != ir_jump || jump != f->blocks[edge].last ||
+      e->position[f->blocks[header].first] > e->position[f->blocks[b].last])
+    return 0;
+  struct IrInstr *branch = &f->instrs[f->blocks[b].last];
+  struct IrInstr *c = &f->instrs[branch->ops[0]];
+  ir_value read[2] = {branch->ops[0]};
+  if (c->op == ir_binary && is_comparison(c->operator) &&
+      !e->uses[branch->ops[0]]) {
+    read[0] = c->ops[0];
+    read[1] = c->ops[1];
+  }
+  uint32_t start = 2 * e->position[f->blocks[other].first];
+  int count = 0;
+  for (ir_value v = f->blocks[header].first; v && f->instrs[v].op == ir_phi;
+       v = f->instrs[v].next) {
+    if (!phi_source(e, v, edge))
+      continue;
+    struct Location written = e->location[v];
+    if (NO_REGISTER == written.reg)
+      return 0;
+    for (int r = 0; r < 2; r++) {
+      if (read[r] && is_at(e, read[r], written))
+        return 0;
+    }
+    ir_value held = held_at(e, m, written.reg, start);
+    if (held && is_live_in(e, m, held, other))
+      return 0;
+    count++;
+  }
+  return count > 0;
+}
+
+// Marks the split edge blocks whose moves are made early, see moves_early().
+static void find_early_moves(struct Emitter *e) {
+  struct IrFunction *f = e->f;
+  struct EarlyMoves m = {
+      .used = arena_calloc(&f->arena, f->block_count, sizeof(uint32_t)),
+      .seen = arena_calloc(&f->arena, f->block_count, sizeof(uint32_t)),
+      .work = arena_alloc(&f->arena, f->block_count * sizeof(ir_block)),
+      .users = ir_users(f)};
+  e->early_moves = arena_calloc(&f->arena, f->block_count, 1);
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t b = 0; b < f->order_count; b++) {
+      for (ir_value v = f->blocks[f->order[b]].first; v;
+           v = f->instrs[v].next) {
+        int reg = e->location[v].reg;
+        if (!has_result(&f->instrs[v]) || !e->uses[v] || NO_REGISTER == reg)
+          continue;
+        if (pass)
+          m.held[reg][m.held_count[reg]] = v;
+        m.held_count[reg]++;
+      }
+    }
+    for (size_t r = 0; !pass && r < sizeof(m.held) / sizeof(m.held[0]); r++) {
+      m.held[r] = arena_alloc(&f->arena, m.held_count[r] * sizeof(ir_value));
+      m.held_count[r] = 0;
+    }
+  }
+  for (uint32_t n = 0; n < f->order_count; n++) {
+    ir_block b = f->order[n];
+    struct IrInstr *branch = &f->instrs[f->blocks[b].last];
+    if (branch->op != ir_branch ||
+        is_rematerialized(&f->instrs[branch->ops[0]]))
+      continue;
+    for (int t = 0; t < 2; t++) {
+      if (moves_early(e, &m, b, branch->target[t], branch->target[1 - t])) {
+        e->early_moves[branch->target[t]] = 1;
+        break;
+      }
+    }
+  }
+}
+
+// Follows blocks that do nothing but jump on, like the ones ir_split_edges()
+// added for phi copies that turned out to be unnecessary or that are made
+// early. Such blocks are not emitted, jumps go to where they lead instead.
+static ir_block jump_target(struct Emitter *e, ir_block b) {
+  struct IrFunction *f = e->f;
+  ir_block target = b;
+  // A cycle of empty blocks is an endless loop that has to stay
+  for (uint32_t n = 0; n < f->order_count; n++) {
+    struct IrInstr *first = &f->instrs[f->blocks[target].first];
+    if (first->op != ir_jump)
+      return target;
+    for (ir_value v = f->blocks[first->target[0]].first;
+         v && f->instrs[v].op == ir_phi && !e->early_moves[target];
+         v = f->instrs[v].next) {
+      if (phi_source(e, v, target))
+        return target;
+    }
+    target = first->target[0];
+  }
+  return b;
+}
+
+static void emit_jump(struct Emitter *e, ir_block target) {
+  target = e->forward[target];
+  if (target != e->next)
+    fprintf(e->fp, "jmp %s\n", e->labels[target]);
+}
+
+static void emit_branch(struct Emitter *e, struct IrInstr *i) {
+  ir_value condition = i->ops[0];
+  struct IrInstr *c = &e->f->instrs[condition];
+  if (is_rematerialized(c)) {
+    // Addresses are never zero
+    emit_jump(e, i->target[c->op == ir_const && !c->imm]);
+    return;
+  }
+  for (int t = 0; t < 2; t++) {
+    ir_block edge = i->target[t];
+    if (e->early_moves[edge])
+      emit_phi_moves(e, edge, e->f->instrs[e->f->blocks[edge].first].target[0]);
+  }
+  const char *jump = "nz";
+  const char *inverse = "z";
+  if (c->op == ir_binary && is_comparison(c->operator) &&
+      !e->uses[condition]) {
+    // Fused with the comparison right in front of the branch
+    uint8_t operator= emit_compare(e, c);
+    jump = condition_codes[operator];
+    inverse = condition_codes[negate_comparison(operator)];
+  } else if (in_register(e, condition)) {
+    fprintf(e->fp, "test %s, %s\n", reg64[e->location[condition].reg],
+            reg64[e->location[condition].reg]);
+  } else {
+    char s[32];
+    fprintf(e->fp, "cmp qword %s, 0\n",
+            frame_operand(e, e->location[condition].offset, s));
+  }
+  if (e->forward[i->target[0]] == e->next) {
+    fprintf(e->fp, "j%s %s\n", inverse,
+            e->labels[e->forward[i->target[1]]]);
+  } else {
+    fprintf(e->fp, "j%s %s\n", jump, e->labels[e->forward[i->target[0]]]);
+    emit_jump(e, i->target[1]);
+  }
+}
+
+static void emit_instr(struct Emitter *e, ir_block b, ir_value v) {
+  struct IrInstr *i = &e->f->instrs[v];
+  char memory[32];
+  char s[32];
+  // Results nobody reads are not computed, calls still have to happen
+  if (has_result(i) && i->op != ir_call && !e->uses[v])
+    return;
+  switch (i->op) {
+  case ir_arg:
+    // Arguments in registers are moved to their values by the prologue
+    if ((in_memory(e, v) && 8 == i->size) ||
+        NO_REGISTER != argument_register(i->imm))
+      break;
+    fprintf(e->fp, "mov %s, %s\n",
+            register_name(result_register(e, v), i->size),
+            frame_operand(e, argument_offset(i->imm), s));
+    store_result(e, v);
+    break;
+  case ir_load:
+    memory_operand(e, i, memory);
+    fprintf(e->fp, "mov %s, %s\n",
+            register_name(result_register(e, v), i->size), memory);
+    store_result(e, v);
+    break;
+  case ir_store:
+    if (in_register(e, i->ops[1]) || is_imm32(e, i->ops[1])) {
+      operand(e, i->ops[1], i->size, rax, s);
+    } else {
+      load_register(e, rax, i->ops[1]);
+      sprintf(s, "%s", register_name(rax, i->size));
+    }
+    memory_operand(e, i, memory);
+    fprintf(e->fp, "mov %s %s, %s\n", 4 == i->size ? "dword" : "qword",
+            memory, s);
+    break;
+  case ir_binary:
+    emit_binary(e, v, i);
+    break;
+  case ir_zext: {
+    int reg = result_register(e, v);
+    fprintf(e->fp, "mov %s, %s\n", reg32[reg],
+            operand(e, i->ops[0], 4, reg, s));
+    store_result(e, v);
+    break;
+  }
+  case ir_call:
+    emit_call(e, v, i);
+    break;
+  case ir_asm:
+    fprintf(e->fp, "%s", ast_string(i->imm));
+    break;
+  case ir_jump:
+    emit_phi_moves(e, b, i->target[0]);
+    emit_jump(e, i->target[0]);
+    break;
+  case ir_branch:
+    emit_branch(e, i);
+    break;
+  case ir_ret:
+    // The tail call in front of it has already left the function
+    if (i->prev && is_tail_call(e, i->prev))
+      break;
+    if (i->op_count)
+      load_register(e, rax, i->ops[0]);
+    emit_teardown(e);
+    fprintf(e->fp, "ret\n");
+    break;
+  default:
+    // Phis are copied by their predecessors, everything else is recomputed
+    // where it is used
+    break;
+  }
+}
+
+// Moves the arguments that are passed in registers to the start of the
+// function. Their registers are copied to where they live on entry, so their
+// intervals have to start there.
+static void hoist_register_arguments(struct IrFunction *f) {
+  ir_value *arguments =
+      arena_alloc(&f->arena, f->instr_count * sizeof(ir_value));
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      if (i->op == ir_arg && NO_REGISTER != argument_register(i->imm))
+        arguments[count++] = v;
+    }
+  }
+  for (uint32_t a = 0; a < count; a++) {
+    ir_value first = f->blocks[f->order[0]].first;
+    if (arguments[a] != first)
+      ir_move_before(f, arguments[a], first);
+  }
+}
+
+// Stores the arguments passed in registers to their slots and copies them to
+// the values that read them. A u32 may come with garbage in the upper half
+// of its register.
+static void emit_incoming_arguments(struct Emitter *e) {
+  struct IrFunction *f = e->f;
+  char s[32];
+  for (uint32_t n = 0; n < f->slot_count; n++) {
+    struct IrSlot *slot = &f->slots[n];
+    if (slot->argument < 0 ||
+        NO_REGISTER == argument_register(slot->argument) ||
+        e->slot_interval[n].from > e->slot_interval[n].to)
+      continue;
+    fprintf(e->fp, "mov %s, %s\n", frame_operand(e, slot->offset, s),
+            register_name(argument_register(slot->argument), slot->size));
+  }
+  uint32_t count = 0;
+  for (ir_value v = f->blocks[f->order[0]].first;
+       v && f->instrs[v].op == ir_arg; v = f->instrs[v].next)
+    count++;
+  struct Move *moves = arena_alloc(&f->arena, (count + 1) * sizeof(*moves));
+  count = 0;
+  for (ir_value v = f->blocks[f->order[0]].first;
+       v && f->instrs[v].op == ir_arg; v = f->instrs[v].next) {
+    struct IrInstr *i = &f->instrs[v];
+    int reg = argument_register(i->imm);
+    if (NO_REGISTER == reg || !e->uses[v])
+      continue;
+    if (4 == i->size)
+      fprintf(e->fp, "mov %s, %s\n", reg32[reg], reg32[reg]);
+    moves[count++] = (struct Move){.dst = e->location[v],
+                                   .source = v,
+                                   .at = {.reg = reg},
+                                   .located = 1};
+  }
+  emit_moves(e, moves, count, rax);
+}
+
+void x86_emit(struct IrFunction *f, FILE *fp) {
+  ir_split_edges(f);
+  struct Emitter e = {.f = f, .fp = fp};
+  // The frame is gone by the time a tail call jumps, nothing may point into
+  // it then
+  e.tail_calls = codegen_options.optimize && !f->has_asm;
+  for (uint32_t b = 0; b < f->order_count && e.tail_calls; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v;
+         v = f->instrs[v].next) {
+      struct IrInstr *i = &f->instrs[v];
+      for (uint32_t o = 0; o < i->op_count; o++) {
+        if (f->instrs[i->ops[o]].op == ir_slot &&
+            !(0 == o && (i->op == ir_load || i->op == ir_store)))
+          e.tail_calls = 0;
+      }
+    }
+  }
+  int leaf = 1;
+  for (uint32_t b = 0; b < f->order_count && leaf; b++) {
+    for (ir_value v = f->blocks[f->order[b]].first; v && leaf;
+         v = f->instrs[v].next)
+      leaf = f->instrs[v].op != ir_call;
+  }
+  // Inline assembly addresses the arguments through rbp
+  e.frame_pointer = !codegen_options.optimize || f->has_asm ||
+                    !(leaf || codegen_options.omit_frame_pointer);
+  if (codegen_options.sysv_abi)
+    hoist_register_arguments(f);
+  build_intervals(&e);
+  allocate_registers(&e);
+  layout_frame(&e, leaf);
+  find_early_moves(&e);
+
+  e.forward = arena_alloc(&f->arena, f->block_count * sizeof(ir_block));
+  e.labels = arena_alloc(&f->arena, f->block_count * sizeof(*e.labels));
+  e.forward[f->order[0]] = f->order[0];
+  for (uint32_t b = 1; b < f->order_count; b++) {
+    ir_block block = f->order[b];
+    e.forward[block] = jump_target(&e, block);
+    if (e.forward[block] == block)
+      gen_label(e.labels[block], sizeof(*e.labels));
+  }
+
+  fprintf(fp, "%s:\n", symbol_name(f->symbol));
+  if (e.frame_pointer) {
+    fprintf(fp, "push rbp\n");
+    fprintf(fp, "mov rbp, rsp\n");
+  }
+  for (int r = 0; r < e.saved_count; r++)
+    fprintf(fp, "push %s\n", reg64[e.saved[r]]);
+  if (e.frame_size)
+    fprintf(fp, "sub rsp, %d\n", e.frame_size);
+  if (codegen_options.sysv_abi)
+    emit_incoming_arguments(&e);
+  for (uint32_t b = 0; b < f->order_count; b++) {
+    ir_block block = f->order[b];
+    if (e.forward[block] != block)
+      continue;
+    uint32_t n = b + 1;
+    for (; n < f->order_count && e.forward[f->order[n]] != f->order[n]; n++)
+      ;
+    e.next = n < f->order_count ? f->order[n] : IR_NONE;
+    if (b)
+      fprintf(fp, "%s:\n", e.labels[block]);
+    for (ir_value v = f->blocks[block].first; v; v = f->instrs[v].next)
+      emit_instr(&e, block, v);
+  }
+  fprintf(fp, "\n");
+}
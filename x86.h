@@ -0,0 +1,11 @@
+#ifndef X86_H
+#define X86_H
+#include <ir.h>
+#include <stdio.h>
+
+// Writes f as NASM x86-64 assembly. Arguments are passed on the stack and
+// popped by the caller, the result is returned in rax. With
+// codegen_options.sysv_abi the first six arguments are passed in registers
+// as in the System V ABI.
+void x86_emit(struct IrFunction *f, FILE *fp);
+#endif // X86_H